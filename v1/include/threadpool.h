@@ -2,14 +2,31 @@
 #define THREADPOOL_H
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <atomic>
+#include <cassert>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include <thread>
 #include <unordered_map>
+#include <exception>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // This code implements a custom Any class similar to std::any in C++17. Its core idea is to store values of any Type through Type Erasure technique.
 class Any
@@ -23,17 +40,19 @@ public:
     Any &operator=(Any &&) = default;
 
     template <typename T>
-    Any(T data) : base_(std::make_unique<Derived<T>>(data)) {}
+    Any(T data) : base_(std::make_unique<Derived<T>>(std::move(data))) {}
 
     template <typename T>
-    T cast_()
+    T cast_() &
     {
-        Derived<T> *ptr = dynamic_cast<Derived<T> *>(base_.get());
-        if (ptr == nullptr)
-        {
-            throw std::bad_cast();
-        }
-        return ptr->data_;
+        return derived<T>()->data_;
+    }
+
+    // A temporary, e.g. res.get().cast_<T>(), gives its value away instead of copying it
+    template <typename T>
+    T cast_() &&
+    {
+        return std::move(derived<T>()->data_);
     }
 
 private:
@@ -49,63 +68,147 @@ private:
     class Derived : public Base
     {
     public:
-        Derived(T data) : data_(data) {}
+        Derived(T data) : data_(std::move(data)) {}
         T data_;
     };
 
+    template <typename T>
+    Derived<T> *derived()
+    {
+        Derived<T> *ptr = dynamic_cast<Derived<T> *>(base_.get());
+        if (ptr == nullptr)
+        {
+            throw std::bad_cast();
+        }
+        return ptr;
+    }
+
 private:
     std::unique_ptr<Base> base_;
 };
 
-// Implement the Semaphore class
-class Semaphore
+// Hint to the CPU that we are busy waiting
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Implement a one-shot Event: set() once, wait() until it is set
+// A result is signalled exactly once, so it needs no counter, mutex or condition variable: one
+// atomic word is enough. A waiter spins for a short while first, then sleeps on the word (a futex
+// on Linux; elsewhere it yields and naps, there is no futex to sleep on).
+class Event
 {
 public:
-    Semaphore(int limit = 0) : resLimit_(limit) {};
-    ~Semaphore() = default;
+    Event() : state_(UNSET) {}
+    ~Event() = default;
 
-    // 添加移动构造函数
-    Semaphore(Semaphore &&other) noexcept
-        : resLimit_(other.resLimit_)
+    // Moving hands over the state word only, not the sleepers: nobody may be waiting on either event.
+    // Result moves its event under the lock of its task, so set() cannot race with the move.
+    Event(Event &&other) noexcept : state_(other.state_.load())
+    {
+        assert(state_.load() != WAITED);
+    }
+    Event &operator=(Event &&other) noexcept
+    {
+        assert(state_.load() != WAITED && other.state_.load() != WAITED);
+        state_.store(other.state_.load());
+        return *this;
+    }
+
+    Event(const Event &) = delete;
+    Event &operator=(const Event &) = delete;
+
+    bool isSet() const { return state_.load(std::memory_order_acquire) == SET; }
+
+    // set the event, wake every waiter
+    void set()
+    {
+        if (state_.exchange(SET, std::memory_order_acq_rel) == WAITED)
+            wakeAll();
+    }
+
+    // wait for the event
+    void wait()
     {
-        other.resLimit_ = 0;
+        if (spin())
+            return;
+        while (prepareSleep())
+            sleep(std::chrono::nanoseconds(-1));
     }
 
-    // 添加移动赋值运算符
-    Semaphore &operator=(Semaphore &&other) noexcept
+    // wait for the event at most timeout, false if it was not set
+    template <typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period> &timeout)
     {
-        if (this != &other)
+        if (spin())
+            return true;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (prepareSleep())
         {
-            resLimit_ = other.resLimit_;
-            other.resLimit_ = 0;
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::steady_clock::duration::zero())
+                return isSet();
+            sleep(std::chrono::duration_cast<std::chrono::nanoseconds>(left));
         }
-        return *this;
+        return true;
     }
 
-    // 显式删除拷贝构造函数和拷贝赋值运算符
-    Semaphore(const Semaphore &) = delete;
-    Semaphore &operator=(const Semaphore &) = delete;
+private:
+    enum : uint32_t
+    {
+        UNSET = 0,
+        WAITED = 1, // not set, somebody sleeps or is about to
+        SET = 2,
+    };
+    static const int SPIN_ROUNDS = 100;
 
-    // wait for the resource
-    void wait()
+    bool spin() const
     {
-        std::unique_lock<std::mutex> lock(mtx_);
-        cv_.wait(lock, [&]() -> bool
-                 { return resLimit_ > 0; });
-        --resLimit_;
+        for (int i = 0; i < SPIN_ROUNDS; ++i)
+        {
+            if (isSet())
+                return true;
+            cpuRelax();
+        }
+        return isSet();
     }
-    // post the resource
-    void post()
+
+    // mark the event as waited on, false if it is set meanwhile
+    bool prepareSleep()
+    {
+        uint32_t state = UNSET;
+        return state_.compare_exchange_strong(state, WAITED, std::memory_order_acq_rel) || state != SET;
+    }
+
+    // sleep while the event is still WAITED, a negative timeout sleeps without limit
+    void sleep(std::chrono::nanoseconds timeout)
+    {
+#if defined(__linux__)
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAIT_PRIVATE, static_cast<uint32_t>(WAITED),
+                timeout.count() < 0 ? nullptr : &ts, nullptr, 0);
+#else
+        std::chrono::nanoseconds nap = std::chrono::microseconds(50);
+        std::this_thread::sleep_for(timeout.count() < 0 || nap < timeout ? nap : timeout);
+#endif
+    }
+
+    void wakeAll()
     {
-        std::unique_lock<std::mutex> lock(mtx_);
-        ++resLimit_;
-        cv_.notify_all();
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
     }
 
 private:
-    int resLimit_;
-    std::mutex mtx_;
-    std::condition_variable cv_;
+    std::atomic<uint32_t> state_;
 };
 
 // Forward declaration of the Task class
@@ -119,28 +222,11 @@ public:
     ~Result();
 
     // 自定义移动构造函数
-    Result(Result &&other) noexcept
-        : any_(std::move(other.any_)),
-          sem_(std::move(other.sem_)),
-          task_(std::move(other.task_)),
-          isValid_(other.isValid_.load())
-    {
-        other.isValid_ = false;
-    }
+    // The task may be queued already: it is re-pointed at the new Result, see Task::moveResult()
+    Result(Result &&other) noexcept;
 
     // 自定义移动赋值运算符
-    Result &operator=(Result &&other) noexcept
-    {
-        if (this != &other)
-        {
-            any_ = std::move(other.any_);
-            sem_ = std::move(other.sem_);
-            task_ = std::move(other.task_);
-            isValid_ = other.isValid_.load();
-            other.isValid_ = false;
-        }
-        return *this;
-    }
+    Result &operator=(Result &&other) noexcept;
 
     // 显式删除拷贝构造函数和拷贝赋值运算符
     Result(const Result &) = delete;
@@ -148,12 +234,18 @@ public:
 
     void setVal(Any any);
     Any get();
+    void cancel();          // Cancel the task, see Task::cancel()
+    void cancelOnDestroy(); // Dropping the Result cancels the task: nobody is left to take its value
 
 private:
+    friend class ThreadPool; // submitTask() invalidates the Result when the queue stays full
+    friend class Task;       // Moves the value and the event along with the link, see Task::moveResult()
+
     Any any_;
-    Semaphore sem_;
+    Event done_; // set once any_ holds the value
     std::shared_ptr<Task> task_;
     std::atomic_bool isValid_;
+    bool cancelOnDestroy_;
 };
 /*
  * Abstact class Task
@@ -166,12 +258,120 @@ public:
     ~Task() = default;
     void exec();
     void setResult(Result *res);
+    void unsetResult(Result *res);            // Unlink res if the task still reports to it
+    void moveResult(Result &from, Result &to); // Result moved: move its value and event, report to to
+    bool claim();      // Take the queued task for running, false if another thread already did
+    void resetClaim(); // The task is queued (again), the next claim() succeeds
+    virtual void discard(); // Dropped unrun by ThreadPool::shutdown(), or when cancelled or expired; wakes the Result
     virtual Any run() = 0;
 
+    // The worker that dequeues a cancelled task drops it unrun. A running task is not interrupted,
+    // run() can poll isCancelled() to stop early.
+    void cancel();
+    bool isCancelled() const;
+    // A task dequeued after deadline is dropped like a cancelled one. Set it before submitting.
+    void setDeadline(std::chrono::steady_clock::time_point deadline);
+    bool isExpired() const;
+
+private:
+    void deliver(Any any); // Hand the value to the Result, if one is linked
+
 private:
     Result *result_;
+    std::mutex resultMtx_; // Guards result_: a Result may be moved or destroyed while the task runs
+    std::atomic_bool claimed_; // A thread has started the task since it was queued
+    std::atomic_bool cancelled_;
+    std::chrono::steady_clock::time_point deadline_; // time_point::max() when there is none
 };
 
+template <typename R>
+class TypedResult;
+
+/*
+ * Typed task: override call() instead of run()
+ * The value is constructed inside the task object and moved out by TypedResult<R>::get(): no Any,
+ * no heap allocation per result and no dynamic_cast. Submit a TypedTask object once.
+ * */
+template <typename R>
+class TypedTask : public Task
+{
+public:
+    using ResultType = R;
+
+    TypedTask() : hasValue_(false) {}
+    ~TypedTask()
+    {
+        if (hasValue_)
+            value().~R();
+    }
+
+    virtual R call() = 0;
+
+    // get() throws instead of waiting for a value that never comes
+    void discard() override
+    {
+        const char *why = isCancelled() ? "task cancelled before it started"
+                          : isExpired()   ? "task deadline passed before it started"
+                                          : "task discarded by ThreadPool::shutdown()";
+        error_ = std::make_exception_ptr(std::runtime_error(why));
+        done_.set();
+    }
+
+private:
+    friend class TypedResult<R>;
+
+    // The pool runs every task through run(): keep the value here instead of returning an Any
+    Any run() override final
+    {
+        try
+        {
+            new (&storage_) R(call());
+            hasValue_ = true;
+        }
+        catch (...)
+        {
+            error_ = std::current_exception();
+            done_.set();
+            throw; // The exception handler still sees it
+        }
+        done_.set();
+        return Any();
+    }
+
+    R &value() { return *reinterpret_cast<R *>(&storage_); }
+
+private:
+    typename std::aligned_storage<sizeof(R), alignof(R)>::type storage_; // The value once hasValue_
+    bool hasValue_;
+    std::exception_ptr error_; // Thrown by call(), rethrown by get()
+    Event done_;               // set once the value or the error is stored
+};
+
+// Receives the value of a TypedTask, get() moves it out
+template <typename R>
+class TypedResult
+{
+public:
+    TypedResult() = default;
+    explicit TypedResult(std::shared_ptr<TypedTask<R>> task) : task_(std::move(task)) {}
+
+    TypedResult(TypedResult &&) = default;
+    TypedResult &operator=(TypedResult &&) = default;
+    TypedResult(const TypedResult &) = delete;
+    TypedResult &operator=(const TypedResult &) = delete;
+
+    bool isValid() const { return task_ != nullptr; } // false if the task was not queued, or after get()
+    R get();                                          // Wait for the value, rethrows the exception of call()
+
+private:
+    std::shared_ptr<TypedTask<R>> task_;
+};
+
+// The submissions return a TypedResult for the subclasses of TypedTask, a Result for other tasks
+template <typename T>
+using TypedResultOf = std::enable_if_t<std::is_base_of<TypedTask<typename T::ResultType>, T>::value,
+                                       TypedResult<typename T::ResultType>>;
+
 // Supporting Mode
 enum class PoolMode
 {
@@ -179,6 +379,30 @@ enum class PoolMode
     MODE_CACHED,
 };
 
+// What a submission does with its task when the queue stays full, see ThreadPool::setRejectPolicy()
+enum class RejectPolicy
+{
+    REJECT_DISCARD,        // Drop the task: post() returns false, the Result is invalid
+    REJECT_THROW,          // Drop the task and throw QueueFullError to the submitter
+    REJECT_CALLER_RUNS,    // Run the task on the submitting thread, which slows the producer down
+    REJECT_DISCARD_OLDEST, // Drop the oldest queued task instead, its Result gets an empty value
+    REJECT_CUSTOM,         // Hand the task to the handler of ThreadPool::setRejectHandler()
+};
+
+// Thrown by the submissions of a pool with RejectPolicy::REJECT_THROW
+class QueueFullError : public std::runtime_error
+{
+public:
+    QueueFullError() : std::runtime_error("ThreadPool task queue is full") {}
+};
+
+// What shutdown() does with the tasks still queued
+enum class ShutdownMode
+{
+    SHUTDOWN_DRAIN,   // Run them, and the tasks they queue meanwhile, then stop
+    SHUTDOWN_DISCARD, // Drop them, only the tasks already running finish
+};
+
 // The Class Thread
 class Thread
 {
@@ -188,10 +412,12 @@ public:
     ~Thread();
 
     void start();
+    void join(); // Wait for the thread function to return, never called by the thread itself
     int getThreadId() const;
 
 private:
     ThreadFunc threadFunc_; // Thread function
+    std::thread thread_;    // Owned by the pool, which joins it
     static int generateId_; // Used to generate the thread id
     int threadId_;          // Used to index the current thread
 };
@@ -200,23 +426,68 @@ private:
 class ThreadPool
 {
 public:
+    using ExceptionHandler = std::function<void(std::exception_ptr)>; // Receives the exceptions thrown by tasks
+    using RejectHandler = std::function<bool(std::shared_ptr<Task>)>;  // Receives the refused tasks, true if it took the task
+
     ThreadPool();
     ~ThreadPool();
 
     void setMode(PoolMode mode);                                          // Set the pool mode
     void setThreadMaxSize(size_t size);                                   // Set the max thread size
     void setTaskQueMaxSize(size_t size);                                  // Set the task queue size
+    void setSubmitTimeout(std::chrono::milliseconds time);                // How long a submission waits for room in a full queue
+    void setRejectPolicy(RejectPolicy policy);                            // What happens to the tasks a full queue refuses
+    void setRejectHandler(RejectHandler handler);                         // Use REJECT_CUSTOM with this handler
     Result submitTask(std::shared_ptr<Task> task);                        // Submit the task to the thread pool
+    Result trySubmit(std::shared_ptr<Task> task);                         // Never wait for room, the reject policy applies at once
+    Result submitFor(std::shared_ptr<Task> task, std::chrono::milliseconds timeout); // Wait at most timeout for room
+    template <typename T>
+    TypedResultOf<T> submitTask(std::shared_ptr<T> task); // Submit a TypedTask, the value comes back without Any
+    template <typename T>
+    TypedResultOf<T> trySubmit(std::shared_ptr<T> task);
+    template <typename T>
+    TypedResultOf<T> submitFor(std::shared_ptr<T> task, std::chrono::milliseconds timeout);
+    bool post(std::shared_ptr<Task> task);                                // Submit the task without a Result, fire and forget
+    uint64_t getRejectedCount() const;                                    // Submissions a full queue refused
+    uint64_t getEvictedCount() const;                                     // Queued tasks dropped by REJECT_DISCARD_OLDEST
+    uint64_t getSkippedCount() const;                                     // Tasks dropped unrun when dequeued: cancelled or expired
+    void setExceptionHandler(ExceptionHandler handler);                   // Set the handler of task exceptions
     void start(int initThreadSize = std::thread::hardware_concurrency()); // Start the thread pool
+    size_t shutdown(ShutdownMode mode = ShutdownMode::SHUTDOWN_DRAIN);    // Stop and join the threads, returns the tasks dropped
+
+    // Drain the queue for at most timeout, then drop what is left
+    template <typename Rep, typename Period>
+    size_t shutdownFor(std::chrono::duration<Rep, Period> timeout)
+    {
+        return stop(true, std::chrono::steady_clock::now() + timeout);
+    }
 
     ThreadPool(const ThreadPool &) = delete;
     ThreadPool &operator=(const ThreadPool &) = delete;
 
 private:
-    void threadFunc(int threadId);  // Thread function
-    bool checkRunningState() const; // Check the state of the poo
+    friend class Result; // Result::get() helps while it waits on a worker
+    template <typename R>
+    friend class TypedResult;
+
+    void threadFunc(int threadId);             // Thread function
+    bool pushTask(std::shared_ptr<Task> task, std::chrono::nanoseconds wait); // Queue the task, false if the queue stays full
+    bool pushOrReject(std::shared_ptr<Task> task, std::chrono::nanoseconds wait); // Queue or apply the reject policy, false if dropped
+    bool evictAndPush(std::shared_ptr<Task> task);                            // REJECT_DISCARD_OLDEST
+    Result submitWithin(std::shared_ptr<Task> task, std::chrono::nanoseconds wait);
+    template <typename R>
+    TypedResult<R> submitTypedWithin(std::shared_ptr<TypedTask<R>> task, std::chrono::nanoseconds wait);
+    static void await(std::shared_ptr<Task> task, Event &done); // Wait for done, helping on a worker
+    void runTask(std::shared_ptr<Task> task);  // Run a claimed task, exceptions go to the handler
+    bool helpOnce();                           // Run the newest queued task on this thread, false if there is none or it is nested too deep
+    size_t stop(bool drain, std::chrono::steady_clock::time_point deadline); // shutdown(), drain until deadline
+    bool checkRunningState() const;            // Check the state of the poo
+
+    static thread_local ThreadPool *current_; // Pool of the worker running on this thread, nullptr elsewhere
+    static thread_local int helpDepth_;       // Tasks run by helpOnce() on the stack of this thread
 private:
     std::unordered_map<int, std::unique_ptr<Thread>> threads_; // Threads
+    std::vector<std::unique_ptr<Thread>> retiredThreads_;      // Threads of idle workers that exited, not joined yet
     size_t initThreadSize_;                                    // Thread Size
     size_t maxThreadSize_;                                     // Max Thread Size
     std::atomic_int curThreadSize_;                            // current number of threads
@@ -224,7 +495,7 @@ private:
 
     // Users may input temporary task which we need to consider the lifetime of the task
     // So we use intelligent pointer to manage the task
-    std::queue<std::shared_ptr<Task>> taskQue_; // Task Queue
+    std::deque<std::shared_ptr<Task>> taskQue_; // Task Queue, workers take the front, helpOnce() the back
     std::atomic_int taskSize_;                  // Task Size
     size_t maxTaskQueSize_;                     // Max Task Queue Size
 
@@ -233,8 +504,58 @@ private:
     std::condition_variable notFull_;  // Condition Variable to notify the thread that the task queue is not full
     std::condition_variable exitCv_;   // Condition Variable to notify the thread that the thread pool is exiting
 
+    ExceptionHandler exceptionHandler_; // Handler of the exceptions thrown by tasks
+
+    std::chrono::nanoseconds submitWait_; // How long a submission waits for room in a full queue
+    RejectPolicy rejectPolicy_;           // What happens to the tasks a full queue refuses
+    RejectHandler rejectHandler_;         // Receives them with REJECT_CUSTOM
+    std::atomic<uint64_t> rejected_;      // Submissions a full queue refused
+    std::atomic<uint64_t> evicted_;       // Queued tasks dropped to make room
+    std::atomic<uint64_t> skipped_;       // Cancelled or expired tasks dropped when dequeued
+
     PoolMode poolMode_;              // Pool Mode
+    std::mutex shutdownMtx_;         // Serializes shutdown() calls
+    std::atomic_bool stopping_;      // shutdown() has begun: no growth, workers exit once the queue is empty
     std::atomic_bool isPoolRunning_; // state of the pool running or not
 };
 
+template <typename T>
+TypedResultOf<T> ThreadPool::submitTask(std::shared_ptr<T> task)
+{
+    return submitTypedWithin<typename T::ResultType>(std::move(task), submitWait_);
+}
+
+template <typename T>
+TypedResultOf<T> ThreadPool::trySubmit(std::shared_ptr<T> task)
+{
+    return submitTypedWithin<typename T::ResultType>(std::move(task), std::chrono::nanoseconds(0));
+}
+
+template <typename T>
+TypedResultOf<T> ThreadPool::submitFor(std::shared_ptr<T> task, std::chrono::milliseconds timeout)
+{
+    return submitTypedWithin<typename T::ResultType>(std::move(task), timeout);
+}
+
+template <typename R>
+TypedResult<R> ThreadPool::submitTypedWithin(std::shared_ptr<TypedTask<R>> task, std::chrono::nanoseconds wait)
+{
+    if (!pushOrReject(task, wait))
+        return TypedResult<R>();
+    return TypedResult<R>(std::move(task));
+}
+
+template <typename R>
+R TypedResult<R>::get()
+{
+    if (task_ == nullptr)
+        throw std::logic_error("TypedResult::get() without a queued task");
+
+    std::shared_ptr<TypedTask<R>> task = std::move(task_);
+    ThreadPool::await(task, task->done_);
+    if (task->error_)
+        std::rethrow_exception(task->error_);
+    return std::move(task->value());
+}
+
 #endif
\ No newline at end of file
@@ -63,6 +63,26 @@ private:
     std::string b_;
 };
 
+// 示例3：TypedTask，结果不经过 Any，直接移动给 TypedResult
+class TypedSumTask : public TypedTask<unsigned long long>
+{
+public:
+    TypedSumTask(int a, int b) : a_(a), b_(b) {}
+    unsigned long long call() override
+    {
+        unsigned long long sum = 0;
+        for (int i = a_; i <= b_; ++i)
+        {
+            sum += i;
+        }
+        return sum;
+    }
+
+private:
+    int a_;
+    int b_;
+};
+
 int main()
 {
     {
@@ -83,6 +103,9 @@ int main()
         unsigned long long sum2 = res2.get().cast_<unsigned long long>();
         unsigned long long sum3 = res3.get().cast_<unsigned long long>();
         std::cout << "Sum: " << sum1 + sum2 + sum3 << std::endl;
+
+        TypedResult<unsigned long long> typed = pool.submitTask(std::make_shared<TypedSumTask>(1, 100));
+        std::cout << "Typed sum: " << typed.get() << std::endl;
     }
 
     std::cout << "main over!" << std::endl;
@@ -4,19 +4,30 @@
 const int TASK_MAX_THRESHOLD = 1024;
 const int THREAD_MAX_SIZE = 10;
 const int THREAD_IDLE_MAX_TIME = 5;
+const int HELP_WAIT_MS = 1; // A worker waiting for a Result looks at the queue again this often
+const int HELP_MAX_DEPTH = 32; // Nested waits a worker helps in before it just waits, bounds its stack
+const int SUBMIT_WAIT_MS = 1000; // Default time a submission waits for room in a full queue
 Thread::Thread(ThreadFunc func) : threadFunc_(func), threadId_(generateId_++)
 {
 }
 
 Thread::~Thread()
 {
+    join();
 }
 int Thread::generateId_ = 0;
+thread_local ThreadPool *ThreadPool::current_ = nullptr;
+thread_local int ThreadPool::helpDepth_ = 0;
 void Thread::start()
 {
-    // Create a thread to run the threadFunc_
-    std::thread t(threadFunc_, threadId_);
-    t.detach(); // Detach the thread from the main thread
+    // Create a thread to run the threadFunc_, the pool joins it when it stops
+    thread_ = std::thread(threadFunc_, threadId_);
+}
+
+void Thread::join()
+{
+    if (thread_.joinable())
+        thread_.join();
 }
 
 int Thread::getThreadId() const
@@ -30,20 +41,76 @@ ThreadPool::ThreadPool() : initThreadSize_(0),
                            idleThreadSize_(0),
                            taskSize_(0),
                            maxTaskQueSize_(TASK_MAX_THRESHOLD),
+                           submitWait_(std::chrono::milliseconds(SUBMIT_WAIT_MS)),
+                           rejectPolicy_(RejectPolicy::REJECT_DISCARD),
+                           rejected_(0),
+                           evicted_(0),
+                           skipped_(0),
                            poolMode_(PoolMode::MODE_FIXED),
+                           stopping_(false),
                            isPoolRunning_(false)
 {
 }
 
 ThreadPool::~ThreadPool()
 {
-    isPoolRunning_ = false;
-    notEmpty_.notify_all();
+    shutdown(ShutdownMode::SHUTDOWN_DISCARD);
+}
 
-    // Two kinds of threads: running and blocked
+size_t ThreadPool::shutdown(ShutdownMode mode)
+{
+    return stop(mode == ShutdownMode::SHUTDOWN_DRAIN, std::chrono::steady_clock::time_point::max());
+}
+
+// Let the workers drain the queue until deadline, they exit once they find it empty. After the
+// deadline the remaining workers exit after their current task. Every thread is joined, then the
+// tasks left are discarded. Tasks already running always finish.
+size_t ThreadPool::stop(bool drain, std::chrono::steady_clock::time_point deadline)
+{
+    std::lock_guard<std::mutex> guard(shutdownMtx_);
     std::unique_lock<std::mutex> lock(taskQueMtx_);
-    exitCv_.wait(lock, [&]() -> bool
-                 { return threads_.size() == 0; });
+    if (!isPoolRunning_)
+        return 0;
+
+    auto exited = [&]() -> bool
+    { return curThreadSize_ == 0; };
+    stopping_ = true;
+    if (drain)
+    {
+        notEmpty_.notify_all();
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            exitCv_.wait(lock, exited);
+        else
+            exitCv_.wait_until(lock, deadline, exited);
+    }
+    isPoolRunning_ = false;
+    notEmpty_.notify_all();
+    exitCv_.wait(lock, exited);
+
+    std::vector<std::unique_ptr<Thread>> threads;
+    for (auto &thread : threads_)
+        threads.push_back(std::move(thread.second));
+    threads_.clear();
+    for (auto &thread : retiredThreads_)
+        threads.push_back(std::move(thread));
+    retiredThreads_.clear();
+
+    std::deque<std::shared_ptr<Task>> dropped;
+    dropped.swap(taskQue_);
+    taskSize_ = 0;
+    notFull_.notify_all();
+    lock.unlock();
+
+    for (auto &thread : threads)
+        thread->join();
+
+    size_t count = dropped.size();
+    for (auto &task : dropped)
+    {
+        if (task->claim())
+            task->discard();
+    }
+    return count;
 }
 
 void ThreadPool::setMode(PoolMode mode)
@@ -66,31 +133,176 @@ void ThreadPool::setTaskQueMaxSize(size_t size)
     maxTaskQueSize_ = size;
 }
 
+void ThreadPool::setExceptionHandler(ExceptionHandler handler)
+{
+    if (checkRunningState())
+        return;
+    exceptionHandler_ = std::move(handler);
+}
+
+void ThreadPool::setSubmitTimeout(std::chrono::milliseconds time)
+{
+    if (checkRunningState())
+        return;
+    submitWait_ = time;
+}
+
+void ThreadPool::setRejectPolicy(RejectPolicy policy)
+{
+    if (checkRunningState())
+        return;
+    rejectPolicy_ = policy;
+}
+
+// The handler runs on the submitting thread. It returns false when it drops the task: the Result
+// of submitTask() is then invalid, as with REJECT_DISCARD.
+void ThreadPool::setRejectHandler(RejectHandler handler)
+{
+    if (checkRunningState())
+        return;
+    rejectHandler_ = std::move(handler);
+    rejectPolicy_ = RejectPolicy::REJECT_CUSTOM;
+}
+
+uint64_t ThreadPool::getRejectedCount() const
+{
+    return rejected_;
+}
+
+uint64_t ThreadPool::getEvictedCount() const
+{
+    return evicted_;
+}
+
+uint64_t ThreadPool::getSkippedCount() const
+{
+    return skipped_;
+}
+
 // Users input the task to the thread pool
 Result ThreadPool::submitTask(std::shared_ptr<Task> task)
 {
+    return submitWithin(task, submitWait_);
+}
+
+Result ThreadPool::trySubmit(std::shared_ptr<Task> task)
+{
+    return submitWithin(task, std::chrono::nanoseconds(0));
+}
+
+Result ThreadPool::submitFor(std::shared_ptr<Task> task, std::chrono::milliseconds timeout)
+{
+    return submitWithin(task, timeout);
+}
+
+Result ThreadPool::submitWithin(std::shared_ptr<Task> task, std::chrono::nanoseconds wait)
+{
+    // Link the Result to the task before queuing it: a worker, or a waiting Result::get(), may run it at once
+    Result res(task, true);
+    if (!pushOrReject(task, wait))
+        res.isValid_ = false;
+    return res;
+}
+
+// Fire and forget: no Result, hence no Event is created for the task
+bool ThreadPool::post(std::shared_ptr<Task> task)
+{
+    return pushOrReject(task, submitWait_);
+}
+
+// Queue the task, or apply the reject policy once the queue has stayed full for wait. False if
+// the task was dropped, or the pool has stopped.
+bool ThreadPool::pushOrReject(std::shared_ptr<Task> task, std::chrono::nanoseconds wait)
+{
+    if (pushTask(task, wait))
+        return true;
+    if (stopping_ && !isPoolRunning_)
+        return false;
+    // A worker may be one of those that have to drain the queue, a task it gave up on may be one it
+    // waits for: it runs the task at once instead, like a nested call
+    if (current_ == this)
+    {
+        task->resetClaim();
+        if (task->claim())
+            runTask(task);
+        return true;
+    }
+    rejected_.fetch_add(1);
+
+    switch (rejectPolicy_)
+    {
+    case RejectPolicy::REJECT_THROW:
+        throw QueueFullError();
+    case RejectPolicy::REJECT_CALLER_RUNS:
+        // Never queued this time: a task submitted again is still claimed from its last run
+        task->resetClaim();
+        if (task->claim())
+            runTask(task);
+        return true;
+    case RejectPolicy::REJECT_DISCARD_OLDEST:
+        return evictAndPush(task);
+    case RejectPolicy::REJECT_CUSTOM:
+        return rejectHandler_(task);
+    default:
+        return false;
+    }
+}
+
+// Make room by dropping the task at the front of the queue. Its Result is woken with an empty
+// value outside the lock.
+bool ThreadPool::evictAndPush(std::shared_ptr<Task> task)
+{
+    std::shared_ptr<Task> victim = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(taskQueMtx_);
+        if (taskQue_.size() == 0)
+            return false;
+        victim = taskQue_.front();
+        taskQue_.pop_front();
+        task->resetClaim();
+        taskQue_.emplace_back(task);
+        notEmpty_.notify_one();
+    }
+    evicted_.fetch_add(1);
+    if (victim->claim())
+        victim->discard();
+    return true;
+}
+
+bool ThreadPool::pushTask(std::shared_ptr<Task> task, std::chrono::nanoseconds wait)
+{
+    // A worker never waits for room, see pushOrReject()
+    if (current_ == this)
+        wait = std::chrono::nanoseconds(0);
+
     // 1. lock the task queue
     std::unique_lock<std::mutex> lock(taskQueMtx_);
 
-    // 2. 等待任务队列不满，最多等待1秒
-    if (!notFull_.wait_for(lock, std::chrono::seconds(1),
-                           [&]() -> bool
-                           { return taskQue_.size() < maxTaskQueSize_; }))
+    // 2. 等待任务队列不满，最多等待 wait；线程池已经停止（shutdown() 结束排空）时不再接受任务
+    //    不等待时不经过条件变量：已经超时的 wait_for 仍然要一次系统调用
+    auto stopped = [&]() -> bool
+    { return stopping_ && !isPoolRunning_; };
+    auto ready = [&]() -> bool
+    { return taskQue_.size() < maxTaskQueSize_ || stopped(); };
+    if (!(wait.count() == 0 ? ready() : notFull_.wait_for(lock, wait, ready)) || stopped())
     {
-        std::cerr << "Task queue is full, submit task failed" << std::endl;
-        // 使用移动语义返回Result对象
-        return Result(task, false);
+        return false;
     }
 
     // 3. push the task into the task queue and notify the thread to take the task
-    taskQue_.emplace(task);
+    task->resetClaim();
+    taskQue_.emplace_back(task);
     taskSize_.fetch_add(1);
-    notEmpty_.notify_all();
+    notEmpty_.notify_one(); // one task, one worker
 
     // cached Mode
-    if (poolMode_ == PoolMode::MODE_CACHED && taskSize_ > idleThreadSize_ && curThreadSize_ < maxThreadSize_)
+    if (poolMode_ == PoolMode::MODE_CACHED && !stopping_ && taskSize_ > idleThreadSize_ && curThreadSize_ < maxThreadSize_)
     {
-        std::cout << "Create new thread..." << std::endl;
+        // The threads of workers that went idle have returned from threadFunc() by now
+        for (auto &thread : retiredThreads_)
+            thread->join();
+        retiredThreads_.clear();
+
         auto ptr = std::make_unique<Thread>([this](int threadId)
                                             { this->threadFunc(threadId); });
         int threadId = ptr->getThreadId();
@@ -100,14 +312,15 @@ Result ThreadPool::submitTask(std::shared_ptr<Task> task)
         curThreadSize_.fetch_add(1);
         idleThreadSize_.fetch_add(1);
     }
-
-    // 使用移动语义返回Result对象
-    return Result(task, true);
+    return true;
 }
 
 // Here using fixed numbers of threads to test. But we can get the number of threads from the OS.
+// After shutdown() the pool can be started again: its threads and queue are gone by then.
 void ThreadPool::start(int initThreadSize)
 {
+    stopping_ = false;
+    idleThreadSize_ = 0;
     isPoolRunning_ = true;
     initThreadSize_ = initThreadSize;
     curThreadSize_ = initThreadSize;
@@ -124,29 +337,26 @@ void ThreadPool::start(int initThreadSize)
         idleThreadSize_.fetch_add(1);
     }
 
-    // Start threads
-    for (int i = 0; i < initThreadSize_; ++i)
+    // Start threads, the ids come from a global generator so they do not start at 0 for every pool
+    for (auto &thread : threads_)
     {
-        threads_[i]->start();
+        thread.second->start();
     }
 }
 
 // Thread pool get the task and run it
 void ThreadPool::threadFunc(int threadId)
 {
+    current_ = this;
     auto lastTime = std::chrono::high_resolution_clock().now();
-    // std::cout << "Begin to run the thread function" << std::endl;
-    // std::cout << "Thread ID: " << std::this_thread::get_id() << std::endl;
-    // std::cout << "The end of the thread function" << std::endl;
     while (isPoolRunning_)
     {
         std::shared_ptr<Task> task = nullptr;
         { // 1. get the lock
             std::unique_lock<std::mutex> lock(taskQueMtx_);
 
-            std::cout << "Thread " << std::this_thread::get_id() << " is waiting for the task..." << std::endl;
             // under cached mode, maybe there are many threads. If the idle time > 60s, redundant threads should be over, the part that exceed the initThreadSize.
-            while (taskQue_.size() == 0)
+            while (isPoolRunning_ && !stopping_ && taskQue_.size() == 0)
             {
                 // If the thread pool is in cached mode, the thread should be recycled if it is idle for too long. Otherwise, the thread should wait for the task.
                 if (poolMode_ == PoolMode::MODE_CACHED)
@@ -159,11 +369,12 @@ void ThreadPool::threadFunc(int threadId)
                         if (dur.count() >= THREAD_IDLE_MAX_TIME &&
                             curThreadSize_ > initThreadSize_)
                         {
-                            // recycle current threads
-                            threads_.erase(threadId);
+                            // recycle current threads, the thread cannot join itself: pushTask() or shutdown() does
+                            auto it = threads_.find(threadId);
+                            retiredThreads_.push_back(std::move(it->second));
+                            threads_.erase(it);
                             --curThreadSize_;
                             --idleThreadSize_;
-                            std::cout << "Thread " << threadId << " is idle for too long, recycle..." << std::endl;
                             return;
                         }
                     }
@@ -173,66 +384,185 @@ void ThreadPool::threadFunc(int threadId)
                     // 2. wait until the task queue is not empty
                     notEmpty_.wait(lock);
                 }
-                // 3. When the thread is waked up, check if the thread pool is running, if not, exit the thread
-                if (!isPoolRunning_)
-                {
-                    threads_.erase(threadId);
-                    std::cout << "Thread " << threadId << " is exiting..." << std::endl;
-                    exitCv_.notify_all();
-                    return;
-                }
+            }
+            // 3. The pool is stopping: exit once the queue is drained, at once if the rest is discarded
+            if (!isPoolRunning_ || taskQue_.size() == 0)
+            {
+                break;
             }
             idleThreadSize_.fetch_sub(1);
 
-            std::cout << "Thread " << std::this_thread::get_id() << " get the task successfully." << std::endl;
             // 3. get the task from the task queue
             task = taskQue_.front();
-            taskQue_.pop();
+            taskQue_.pop_front();
             taskSize_.fetch_sub(1);
 
             // if there are still tasks in the task queue, notify the thread to take the task
             if (taskQue_.size() > 0)
             {
-                notEmpty_.notify_all();
+                notEmpty_.notify_one();
             }
 
-            // notify the task queue is not full
-            notFull_.notify_all();
+            // one slot was freed, wake one producer
+            notFull_.notify_one();
         } // 4. End of the critical section, unlock the task queue
 
-        // 5. run the task
-        if (task != nullptr)
-            task->exec();
+        // 5. run the task, unless a waiting Result::get() already ran it
+        if (task != nullptr && task->claim())
+        {
+            runTask(task);
+        }
 
         idleThreadSize_.fetch_add(1);
         lastTime = std::chrono::high_resolution_clock().now();
     }
 
-    // 6. exit the thread, if the thread pool is not running
-    threads_.erase(threadId);
-    std::cout << "Thread " << threadId << " is exiting..." << std::endl;
+    // 6. exit the thread, if the thread pool is stopping. shutdown() joins it.
+    std::lock_guard<std::mutex> lock(taskQueMtx_);
+    --curThreadSize_;
     exitCv_.notify_all();
 }
 
+// Exceptions go to the exception handler instead of terminating the thread
+void ThreadPool::runTask(std::shared_ptr<Task> task)
+{
+    // Cancelled or expired while queued: nobody wants the result any more
+    if (task->isCancelled() || task->isExpired())
+    {
+        skipped_.fetch_add(1);
+        task->discard();
+        return;
+    }
+    try
+    {
+        task->exec();
+    }
+    catch (...)
+    {
+        if (exceptionHandler_)
+            exceptionHandler_(std::current_exception());
+        else
+            std::cerr << "Unhandled exception in task" << std::endl;
+    }
+}
+
+// On a worker, blocking would hold the thread: a fixed pool deadlocks on nested submissions and a
+// cached pool keeps growing. Run the awaited task here if nobody has started it, then other queued
+// tasks until done is set.
+void ThreadPool::await(std::shared_ptr<Task> task, Event &done)
+{
+    ThreadPool *pool = current_;
+    if (pool == nullptr)
+    {
+        done.wait();
+        return;
+    }
+
+    if (task->claim())
+        pool->runTask(task);
+    while (!done.isSet())
+    {
+        if (!pool->helpOnce() && done.waitFor(std::chrono::milliseconds(HELP_WAIT_MS)))
+            break;
+    }
+}
+
+// Called by a worker waiting for a Result, so that it keeps doing useful work. It takes the newest
+// task: most likely a subtask of what it waits for, small, and the queue stays short. Each one adds
+// to the stack of the worker, HELP_MAX_DEPTH bounds the nesting.
+bool ThreadPool::helpOnce()
+{
+    if (helpDepth_ >= HELP_MAX_DEPTH)
+        return false;
+    std::shared_ptr<Task> task = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        if (taskQue_.size() == 0)
+            return false;
+        task = taskQue_.back();
+        taskQue_.pop_back();
+        taskSize_.fetch_sub(1);
+        notFull_.notify_one();
+    }
+    if (task->claim())
+    {
+        ++helpDepth_;
+        runTask(task);
+        --helpDepth_;
+    }
+    return true;
+}
+
 bool ThreadPool::checkRunningState() const
 {
     return isPoolRunning_;
 }
 
-Result::Result(std::shared_ptr<Task> task, bool isValid) : isValid_(isValid), task_(task)
+Result::Result(std::shared_ptr<Task> task, bool isValid) : task_(task), isValid_(isValid), cancelOnDestroy_(false)
 {
     // 一开始没将Result和Task关联起来，导致没有得到打印结果。
     task_->setResult(this);
 }
 
+Result::Result(Result &&other) noexcept
+    : task_(std::move(other.task_)),
+      isValid_(other.isValid_.load()),
+      cancelOnDestroy_(other.cancelOnDestroy_)
+{
+    other.isValid_ = false;
+    other.cancelOnDestroy_ = false;
+    if (task_ != nullptr)
+        task_->moveResult(other, *this);
+}
+
+Result &Result::operator=(Result &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (task_ != nullptr)
+        {
+            if (cancelOnDestroy_)
+                task_->cancel();
+            task_->unsetResult(this);
+        }
+        task_ = std::move(other.task_);
+        isValid_ = other.isValid_.load();
+        other.isValid_ = false;
+        cancelOnDestroy_ = other.cancelOnDestroy_;
+        other.cancelOnDestroy_ = false;
+        if (task_ != nullptr)
+            task_->moveResult(other, *this);
+        else
+            done_ = Event();
+    }
+    return *this;
+}
+
 Result::~Result()
 {
+    if (task_ == nullptr)
+        return;
+    if (cancelOnDestroy_)
+        task_->cancel();
+    // The task may still be queued or running: it must not set a value on a dead Result
+    task_->unsetResult(this);
+}
+
+void Result::cancel()
+{
+    if (task_ != nullptr)
+        task_->cancel();
+}
+
+void Result::cancelOnDestroy()
+{
+    cancelOnDestroy_ = true;
 }
 
 void Result::setVal(Any any)
 {
     this->any_ = std::move(any);
-    sem_.post();
+    done_.set();
 }
 
 Any Result::get()
@@ -242,23 +572,94 @@ Any Result::get()
         return Any();
     }
 
-    sem_.wait();
+    ThreadPool::await(task_, done_);
     return std::move(any_);
 }
 
-Task::Task() : result_(nullptr)
+Task::Task() : result_(nullptr), claimed_(false), cancelled_(false),
+               deadline_(std::chrono::steady_clock::time_point::max())
+{
+}
+
+void Task::cancel()
+{
+    cancelled_ = true;
+}
+
+bool Task::isCancelled() const
+{
+    return cancelled_;
+}
+
+void Task::setDeadline(std::chrono::steady_clock::time_point deadline)
+{
+    deadline_ = deadline;
+}
+
+bool Task::isExpired() const
+{
+    return deadline_ != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline_;
+}
+
+void Task::discard()
 {
+    // Wake up the waiter with an empty value, as if the task had thrown
+    deliver(Any());
 }
 
 void Task::exec()
 {
-    if (result_ != nullptr)
+    // Posted tasks have no Result, deliver() drops their value
+    Any value;
+    try
+    {
+        value = run();
+    }
+    catch (...)
     {
-        result_->setVal(run());
+        // Wake up the waiter with an empty value, then report the exception
+        deliver(Any());
+        throw;
     }
+    deliver(std::move(value));
+}
+
+void Task::deliver(Any any)
+{
+    std::lock_guard<std::mutex> lock(resultMtx_);
+    if (result_ != nullptr)
+        result_->setVal(std::move(any));
 }
 
 void Task::setResult(Result *res)
 {
+    std::lock_guard<std::mutex> lock(resultMtx_);
     result_ = res;
 }
+
+void Task::unsetResult(Result *res)
+{
+    std::lock_guard<std::mutex> lock(resultMtx_);
+    if (result_ == res)
+        result_ = nullptr;
+}
+
+// Under the lock the value is either already in from, and moves with it, or delivered to to later
+void Task::moveResult(Result &from, Result &to)
+{
+    std::lock_guard<std::mutex> lock(resultMtx_);
+    to.any_ = std::move(from.any_);
+    to.done_ = std::move(from.done_);
+    if (result_ == &from)
+        result_ = &to;
+}
+
+bool Task::claim()
+{
+    return !claimed_.exchange(true);
+}
+
+void Task::resetClaim()
+{
+    claimed_ = false;
+}
@@ -0,0 +1,59 @@
+/*
+ * Recursive tasks that wait for their subtasks on the worker must finish on a small pool, whatever
+ * the queue fills up with: a worker never waits for room in the queue.
+ * Build: g++ -std=c++14 -O2 -pthread nested_wait_test.cpp ../src/threadpool.cpp -o nested_wait_test
+ * */
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include "../include/threadpool.h"
+#include "check.h"
+
+static int fibSerial(int n)
+{
+    return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+// Submits both halves and waits for them, as a naive divide and conquer would
+class FibTask : public Task
+{
+public:
+    FibTask(ThreadPool &pool, int n) : pool_(pool), n_(n) {}
+    Any run() override
+    {
+        if (n_ < 2)
+            return n_;
+        Result a = pool_.submitTask(std::make_shared<FibTask>(pool_, n_ - 1));
+        Result b = pool_.submitTask(std::make_shared<FibTask>(pool_, n_ - 2));
+        return a.get().cast_<int>() + b.get().cast_<int>();
+    }
+
+private:
+    ThreadPool &pool_;
+    int n_;
+};
+
+static void checkFib(PoolMode mode, int threads, int depth)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(threads);
+    auto begin = std::chrono::steady_clock::now();
+    int value = pool.submitTask(std::make_shared<FibTask>(pool, depth)).get().cast_<int>();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::printf("mode %d threads %d fib(%d) = %d in %.1f ms, rejected %llu\n", static_cast<int>(mode), threads, depth,
+                value, ms, static_cast<unsigned long long>(pool.getRejectedCount()));
+    CHECK(value == fibSerial(depth));
+    CHECK(pool.getRejectedCount() == 0);
+    // The queue filling up must not stall anyone for the submit timeout
+    CHECK(ms < 1000);
+}
+
+int main()
+{
+    checkFib(PoolMode::MODE_FIXED, 2, 18);
+    checkFib(PoolMode::MODE_FIXED, 4, 18);
+    checkFib(PoolMode::MODE_CACHED, 4, 18);
+    std::printf("ok\n");
+    return 0;
+}
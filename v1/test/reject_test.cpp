@@ -0,0 +1,118 @@
+/*
+ * Reject policies on a full queue, with a task object submitted more than once
+ * Build: g++ -std=c++14 -O2 -pthread reject_test.cpp ../src/threadpool.cpp -o reject_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include "../include/threadpool.h"
+#include "check.h"
+
+class CountTask : public Task
+{
+public:
+    CountTask() : runs_(0) {}
+    Any run() override { return ++runs_; }
+    int runs() const { return runs_; }
+
+private:
+    std::atomic_int runs_;
+};
+
+// Keeps the single worker busy until open_ is set
+class GateTask : public Task
+{
+public:
+    GateTask() : started_(false), open_(false) {}
+    Any run() override
+    {
+        started_ = true;
+        while (!open_)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return Any();
+    }
+
+    std::atomic_bool started_;
+    std::atomic_bool open_;
+};
+
+// A one-slot queue, its only worker blocked and the slot taken
+struct FullPool
+{
+    FullPool(RejectPolicy policy) : gate(std::make_shared<GateTask>())
+    {
+        pool.setTaskQueMaxSize(1);
+        pool.setRejectPolicy(policy);
+        pool.start(1);
+        CHECK(pool.post(gate));
+        while (!gate->started_)
+            std::this_thread::yield();
+        CHECK(pool.post(std::make_shared<CountTask>()));
+    }
+    ~FullPool() { gate->open_ = true; }
+
+    ThreadPool pool;
+    std::shared_ptr<GateTask> gate;
+};
+
+static void checkCallerRuns()
+{
+    FullPool full(RejectPolicy::REJECT_CALLER_RUNS);
+    auto task = std::make_shared<CountTask>();
+    // Every submission runs the task on this thread, the first one as well as the later ones
+    for (int i = 1; i <= 3; ++i)
+    {
+        Result res = full.pool.trySubmit(task);
+        CHECK(res.get().cast_<int>() == i);
+        CHECK(task->runs() == i);
+    }
+    CHECK(full.pool.getRejectedCount() == 3);
+}
+
+static void checkDiscard()
+{
+    FullPool full(RejectPolicy::REJECT_DISCARD);
+    auto task = std::make_shared<CountTask>();
+    Result res = full.pool.trySubmit(task);
+    // Not queued: an invalid Result, get() returns an empty Any at once
+    bool empty = false;
+    try
+    {
+        res.get().cast_<int>();
+    }
+    catch (const std::bad_cast &)
+    {
+        empty = true;
+    }
+    CHECK(empty);
+    CHECK(task->runs() == 0);
+    CHECK(!full.pool.post(task));
+    CHECK(full.pool.getRejectedCount() == 2);
+}
+
+static void checkThrow()
+{
+    FullPool full(RejectPolicy::REJECT_THROW);
+    bool thrown = false;
+    try
+    {
+        full.pool.trySubmit(std::make_shared<CountTask>());
+    }
+    catch (const QueueFullError &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(full.pool.getRejectedCount() == 1);
+}
+
+int main()
+{
+    checkCallerRuns();
+    checkDiscard();
+    checkThrow();
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * shutdown() modes: what runs, what is dropped and reported, and a restart of the stopped pool
+ * Build: g++ -std=c++14 -O2 -pthread shutdown_test.cpp ../src/threadpool.cpp -o shutdown_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+#include "check.h"
+
+const int QUEUED = 10;
+
+class CountTask : public Task
+{
+public:
+    CountTask(std::atomic_int &ran, int value) : ran_(ran), value_(value) {}
+    Any run() override
+    {
+        ++ran_;
+        return value_;
+    }
+
+private:
+    std::atomic_int &ran_;
+    int value_;
+};
+
+// Keeps the single worker busy until open_ is set, so that the next tasks stay queued
+class GateTask : public Task
+{
+public:
+    GateTask() : started_(false), open_(false) {}
+    Any run() override
+    {
+        started_ = true;
+        while (!open_)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return Any();
+    }
+
+    std::atomic_bool started_;
+    std::atomic_bool open_;
+};
+
+// Queue QUEUED tasks behind a gate on a one-thread pool, stop it with stop(), check what ran
+template <typename Stop>
+static void checkStop(bool drains, Stop &&stop)
+{
+    ThreadPool pool;
+    pool.start(1);
+    std::atomic_int ran(0);
+    auto gate = std::make_shared<GateTask>();
+    CHECK(pool.post(gate));
+    while (!gate->started_)
+        std::this_thread::yield();
+    std::vector<Result> results;
+    for (int i = 0; i < QUEUED; ++i)
+        results.push_back(pool.submitTask(std::make_shared<CountTask>(ran, i)));
+
+    std::thread opener([&gate]()
+                       {
+                           std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                           gate->open_ = true; });
+    size_t dropped = stop(pool);
+    opener.join();
+
+    CHECK(dropped == (drains ? 0u : static_cast<size_t>(QUEUED)));
+    CHECK(ran == (drains ? QUEUED : 0));
+    for (int i = 0; i < QUEUED; ++i)
+    {
+        // A dropped task wakes its Result with an empty Any
+        bool empty = false;
+        Any value = results[i].get();
+        try
+        {
+            CHECK(value.cast_<int>() == i);
+        }
+        catch (const std::bad_cast &)
+        {
+            empty = true;
+        }
+        CHECK(empty == !drains);
+    }
+    // Stopped already
+    CHECK(pool.shutdown() == 0);
+}
+
+static void checkRestart(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(2);
+    std::atomic_int ran(0);
+    CHECK(pool.submitTask(std::make_shared<CountTask>(ran, 1)).get().cast_<int>() == 1);
+    CHECK(pool.shutdown() == 0);
+
+    for (int run = 0; run < 3; ++run)
+    {
+        pool.start(3 + run);
+        std::vector<Result> results;
+        for (int i = 0; i < 64; ++i)
+            results.push_back(pool.submitTask(std::make_shared<CountTask>(ran, i)));
+        for (int i = 0; i < 64; ++i)
+            CHECK(results[i].get().cast_<int>() == i);
+        for (int i = 0; i < 100; ++i)
+            CHECK(pool.post(std::make_shared<CountTask>(ran, i)));
+        CHECK(pool.shutdown(ShutdownMode::SHUTDOWN_DRAIN) == 0);
+    }
+    CHECK(ran == 1 + 3 * (64 + 100));
+}
+
+int main()
+{
+    checkStop(true, [](ThreadPool &pool)
+              { return pool.shutdown(ShutdownMode::SHUTDOWN_DRAIN); });
+    checkStop(false, [](ThreadPool &pool)
+              { return pool.shutdown(ShutdownMode::SHUTDOWN_DISCARD); });
+    // The gate opens after the timeout: nothing queued gets to run
+    checkStop(false, [](ThreadPool &pool)
+              { return pool.shutdownFor(std::chrono::milliseconds(10)); });
+    checkRestart(PoolMode::MODE_FIXED);
+    checkRestart(PoolMode::MODE_CACHED);
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Counts heap allocations per submitted task in steady state, then prints the slab allocator report
+ * Build: g++ -std=c++17 -O2 -pthread -I../include alloc_bench.cpp -o alloc_bench
+ * */
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <new>
+#include <vector>
+#include "../include/threadpool.h"
+
+static std::atomic<size_t> g_allocs(0);
+
+// Every form of operator new counts, and every form of operator delete goes to std::free(): the
+// plain, array, sized and aligned overloads are replaced together so that they pair up.
+static void *countedAlloc(size_t size, size_t align = 0)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    size = size == 0 ? 1 : size;
+    void *p = align == 0 ? std::malloc(size) : std::aligned_alloc(align, (size + align - 1) / align * align);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void *operator new(size_t size, std::align_val_t align) { return countedAlloc(size, static_cast<size_t>(align)); }
+void *operator new[](size_t size, std::align_val_t align) { return countedAlloc(size, static_cast<size_t>(align)); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+const int BATCH = 256;
+const int WARMUP_ROUNDS = 50;
+const int ROUNDS = 400;
+
+// Submit BATCH tasks and wait for all of them, ROUNDS times. A big closure does not fit inline
+// in the Task and goes to a ClosurePool: it is made here and released on a worker.
+static void runRounds(ThreadPool &pool, std::vector<Future<int>> &futures, int rounds, bool big)
+{
+    std::array<int, 24> payload{};
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int i = 0; i < BATCH; ++i)
+        {
+            if (big)
+                futures.push_back(pool.submitTask([payload](int a) -> int
+                                                  { return a + payload[0]; }, i));
+            else
+                futures.push_back(pool.submitTask([](int a, int b) -> int
+                                                  { return a + b; }, i, r));
+        }
+        for (auto &f : futures)
+            f.get();
+        futures.clear();
+    }
+}
+
+static void measure(const char *name, PoolMode mode, QueueMode queueMode, bool big = false)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.setQueueMode(queueMode);
+    pool.start(4);
+
+    std::vector<Future<int>> futures;
+    futures.reserve(BATCH);
+    runRounds(pool, futures, WARMUP_ROUNDS, big);
+
+    size_t before = g_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    runRounds(pool, futures, ROUNDS, big);
+    auto end = std::chrono::steady_clock::now();
+    size_t allocs = g_allocs.load() - before;
+
+    double tasks = static_cast<double>(BATCH) * ROUNDS;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::printf("%-28s %10.3f allocs/task %10.1f ns/task\n", name, allocs / tasks, ns / tasks);
+}
+
+// Tasks submitted from inside a worker go to its local deque in work stealing mode
+static void measureNested()
+{
+    ThreadPool pool;
+    pool.setMode(PoolMode::MODE_WORK_STEALING);
+    pool.start(4);
+
+    auto fanOut = [&pool](int rounds)
+    {
+        std::vector<Future<int>> futures;
+        futures.reserve(BATCH);
+        for (int r = 0; r < rounds; ++r)
+        {
+            for (int i = 0; i < BATCH; ++i)
+                futures.push_back(pool.submitTask([](int a) -> int
+                                                  { return a * 2; }, i));
+            for (auto &f : futures)
+            {
+                while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                    std::this_thread::yield();
+                f.get();
+            }
+            futures.clear();
+        }
+        return 0;
+    };
+
+    pool.submitTask(fanOut, WARMUP_ROUNDS).get();
+    size_t before = g_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    pool.submitTask(fanOut, ROUNDS).get();
+    auto end = std::chrono::steady_clock::now();
+    size_t allocs = g_allocs.load() - before;
+
+    double tasks = static_cast<double>(BATCH) * ROUNDS;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::printf("%-28s %10.3f allocs/task %10.1f ns/task\n", "work stealing (nested)", allocs / tasks, ns / tasks);
+}
+
+// One line per SlabPool: memory held, and how the objects were released
+static void report()
+{
+    std::printf("\n%-40s %6s %6s %8s %6s %10s %10s %10s %8s %8s %6s\n", "pool", "size", "slabs", "KB", "heaps",
+                "allocs", "local", "remote", "batches", "reclaims", "live");
+    for (const SlabStats &s : allocatorStats())
+    {
+        int status = 0;
+        char *name = abi::__cxa_demangle(s.type, nullptr, nullptr, &status);
+        std::printf("%-40.40s %6zu %6llu %8llu %6llu %10llu %10llu %10llu %8llu %8llu %6llu\n", status == 0 ? name : s.type,
+                    s.objectSize, static_cast<unsigned long long>(s.slabs), static_cast<unsigned long long>(s.reservedBytes / 1024),
+                    static_cast<unsigned long long>(s.heaps), static_cast<unsigned long long>(s.allocations),
+                    static_cast<unsigned long long>(s.localFrees), static_cast<unsigned long long>(s.remoteFrees),
+                    static_cast<unsigned long long>(s.remoteBatches), static_cast<unsigned long long>(s.reclaims),
+                    static_cast<unsigned long long>(s.live));
+        std::free(name);
+    }
+}
+
+int main()
+{
+    measure("fixed / locked queue", PoolMode::MODE_FIXED, QueueMode::QUEUE_LOCKED);
+    measure("fixed / lock-free queue", PoolMode::MODE_FIXED, QueueMode::QUEUE_LOCK_FREE);
+    measure("fixed / 96-byte closures", PoolMode::MODE_FIXED, QueueMode::QUEUE_LOCKED, true);
+    measure("work stealing (external)", PoolMode::MODE_WORK_STEALING, QueueMode::QUEUE_LOCKED);
+    measureNested();
+    report();
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Requests that each wait for a few sub-tasks: blocked Future::get() against suspended coroutines
+ * With blocking gets a request holds a thread while it waits, so the requests need a pool of their
+ * own, as large as the number of requests in flight. As coroutines they share the workers.
+ * Build: g++ -std=c++20 -O2 -pthread -I../include coro_bench.cpp -o coro_bench
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../include/coroutine.h"
+
+const int THREADS = 4;
+const int REQUESTS = 20000;
+const int INFLIGHT = 64; // Requests in flight at once, threads of the blocking request pool
+const int FANOUT = 4;    // Sub-tasks per request
+const int WORK = 2000;   // Iterations of busy work per sub-task
+
+static int subTask(int seed)
+{
+    int x = seed;
+    for (int i = 0; i < WORK; ++i)
+        x = x * 1103515245 + 12345;
+    return x & 1;
+}
+
+static double blocking()
+{
+    ThreadPool workers;
+    workers.start(THREADS);
+    ThreadPool requests;
+    requests.setTaskQueMaxSize(REQUESTS);
+    requests.start(INFLIGHT);
+
+    int64_t start = nowNs();
+    std::vector<Future<int>> results;
+    results.reserve(REQUESTS);
+    for (int r = 0; r < REQUESTS; ++r)
+    {
+        results.push_back(requests.submitTask([&workers, r]()
+                                              {
+                                                  Future<int> parts[FANOUT];
+                                                  for (int i = 0; i < FANOUT; ++i)
+                                                      parts[i] = workers.submitTask(subTask, r + i);
+                                                  int sum = 0;
+                                                  for (auto &part : parts)
+                                                      sum += part.get();
+                                                  return sum; }));
+    }
+    for (auto &result : results)
+        result.get();
+    return static_cast<double>(nowNs() - start);
+}
+
+static CoTask<int> request(ThreadPool &pool, int r)
+{
+    co_await pool.schedule();
+    Future<int> parts[FANOUT];
+    for (int i = 0; i < FANOUT; ++i)
+        parts[i] = pool.submitTask(subTask, r + i);
+    int sum = 0;
+    for (auto &part : parts)
+        sum += co_await part;
+    co_return sum;
+}
+
+static CoTask<void> allRequests(ThreadPool &pool)
+{
+    std::vector<Future<int>> batch;
+    for (int r = 0; r < REQUESTS; r += INFLIGHT)
+    {
+        batch.clear();
+        for (int i = r; i < r + INFLIGHT && i < REQUESTS; ++i)
+            batch.push_back(spawn(request(pool, i)));
+        for (auto &result : batch)
+            co_await result;
+    }
+}
+
+static double coroutines()
+{
+    ThreadPool pool;
+    pool.start(THREADS);
+    int64_t start = nowNs();
+    sync_wait(allRequests(pool));
+    return static_cast<double>(nowNs() - start);
+}
+
+int main()
+{
+    double blocked = blocking();
+    double suspended = coroutines();
+    std::printf("blocking get   %d threads %8.2f us/request\n", THREADS + INFLIGHT, blocked / REQUESTS / 1000);
+    std::printf("co_await       %d threads %8.2f us/request\n", THREADS, suspended / REQUESTS / 1000);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+ * How fast the cached mode follows a bursty load: bursts of blocking tasks separated by idle phases
+ * During a burst the tasks arrive at a steady rate that needs about RATE_PER_MS * TASK_MS threads.
+ * Reports, for every burst, the time the pool takes to reach 90% of its peak size, the peak, the
+ * resizes while the load is steady, and the time it takes to shrink back once the burst is over.
+ * Build: g++ -std=c++17 -O2 -pthread -I../include elastic_bench.cpp -o elastic_bench
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int MIN_THREADS = 2;
+const int MAX_THREADS = 64;
+const int BURSTS = 3;
+const int BURST_MS = 500;
+const int QUIET_MS = 600;
+const int IDLE_MS = 200;     // setThreadIdleTime()
+const int TASK_MS = 1;       // Every task blocks that long, like a call to another service
+const int RATE_PER_MS = 16;  // Tasks submitted per millisecond during a burst
+const int SAMPLE_MS = 5;
+
+using Clock = std::chrono::steady_clock;
+
+struct Sample
+{
+    double ms;
+    size_t threads;
+};
+
+int main()
+{
+    ThreadPool pool;
+    pool.setMode(PoolMode::MODE_CACHED);
+    pool.setThreadMaxSize(MAX_THREADS);
+    pool.setThreadIdleTime(std::chrono::milliseconds(IDLE_MS));
+    pool.setTaskQueMaxSize(1 << 16);
+    pool.start(MIN_THREADS);
+
+    auto begin = Clock::now();
+    auto elapsedMs = [&]() -> double
+    { return std::chrono::duration<double, std::milli>(Clock::now() - begin).count(); };
+
+    std::atomic_bool sampling(true);
+    std::vector<Sample> samples;
+    std::thread sampler([&]()
+                        {
+                            while (sampling)
+                            {
+                                samples.push_back(Sample{elapsedMs(), pool.getThreadSize()});
+                                std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLE_MS));
+                            } });
+
+    std::vector<double> burstStart;
+    for (int b = 0; b < BURSTS; ++b)
+    {
+        burstStart.push_back(elapsedMs());
+        auto start = Clock::now();
+        for (int tick = 0; tick < BURST_MS; ++tick)
+        {
+            for (int i = 0; i < RATE_PER_MS; ++i)
+            {
+                pool.post([]()
+                          { std::this_thread::sleep_for(std::chrono::milliseconds(TASK_MS)); });
+            }
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(tick + 1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(QUIET_MS));
+    }
+    sampling = false;
+    sampler.join();
+    PoolStats stats = pool.getStats();
+
+    std::printf("%-6s %12s %8s %10s %12s\n", "burst", "converge ms", "peak", "resizes", "shrink ms");
+    for (int b = 0; b < BURSTS; ++b)
+    {
+        double from = burstStart[b];
+        double end = from + BURST_MS;
+        double next = b + 1 < BURSTS ? burstStart[b + 1] : samples.back().ms + 1;
+
+        size_t peak = 0;
+        for (const Sample &s : samples)
+        {
+            if (s.ms >= from && s.ms < end)
+                peak = std::max(peak, s.threads);
+        }
+        double converge = -1;
+        int resizes = 0;
+        size_t last = 0;
+        double shrunk = -1;
+        for (const Sample &s : samples)
+        {
+            if (s.ms >= from && s.ms < end)
+            {
+                if (converge < 0 && s.threads * 10 >= peak * 9)
+                    converge = s.ms - from;
+                // Size changes once converged, an oscillating pool keeps changing
+                if (converge >= 0 && last != 0 && s.threads != last)
+                    ++resizes;
+                last = s.threads;
+            }
+            else if (s.ms >= end && s.ms < next && shrunk < 0 && s.threads <= static_cast<size_t>(MIN_THREADS))
+            {
+                shrunk = s.ms - end;
+            }
+        }
+        std::printf("%-6d %12.1f %8zu %10d %12.1f\n", b, converge, peak, resizes, shrunk);
+    }
+    std::printf("tasks %llu, queue wait p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                static_cast<unsigned long long>(stats.tasks), stats.waitTime.percentile(0.5) / 1000.0,
+                stats.waitTime.percentile(0.99) / 1000.0, stats.waitTime.max() / 1000.0);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * set() -> wait() round trip of a one-shot event between two threads: Event against the mutex +
+ * condition variable pair results used to carry, then Future::get() on a one-thread pool
+ * Each round uses a fresh pair of events, as every result does. With a delay the waiter has gone
+ * to sleep by the time the event is set, so the wakeup path is measured instead of the spin.
+ * Build: g++ -std=c++17 -O2 -pthread -I../include event_bench.cpp -o event_bench
+ * */
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int ROUNDS = 20000;
+const int SLEEP_ROUNDS = 2000;
+
+// The signalling results used before Event
+class MutexEvent
+{
+public:
+    void set()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        set_ = true;
+        cv_.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&]() -> bool
+                 { return set_; });
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool set_ = false;
+};
+
+static void busyWait(std::chrono::microseconds delay)
+{
+    auto until = std::chrono::steady_clock::now() + delay;
+    while (std::chrono::steady_clock::now() < until)
+    {
+    }
+}
+
+static void report(const char *name, const Histogram &h)
+{
+    std::printf("%-32s mean %8.0f ns  p50 %8llu ns  p99 %8llu ns\n", name, h.mean(),
+                static_cast<unsigned long long>(h.percentile(0.5)), static_cast<unsigned long long>(h.percentile(0.99)));
+}
+
+// The main thread sets ping[i] after delay, the other thread waits for it and sets pong[i] back
+template <typename E>
+static void pingPong(const char *name, int rounds, std::chrono::microseconds delay)
+{
+    std::unique_ptr<E[]> ping(new E[rounds]);
+    std::unique_ptr<E[]> pong(new E[rounds]);
+    std::thread peer([&]()
+                     {
+                         for (int i = 0; i < rounds; ++i)
+                         {
+                             ping[i].wait();
+                             pong[i].set();
+                         } });
+
+    Histogram h;
+    for (int i = 0; i < rounds; ++i)
+    {
+        busyWait(delay);
+        int64_t start = nowNs();
+        ping[i].set();
+        pong[i].wait();
+        uint64_t ns = static_cast<uint64_t>(nowNs() - start);
+        h.add(Histogram::bucketOf(ns), 1);
+        h.addTotals(1, ns, ns);
+    }
+    peer.join();
+    report(name, h);
+}
+
+static void futureRoundTrip(int rounds)
+{
+    ThreadPool pool;
+    pool.start(1);
+    Histogram h;
+    for (int i = 0; i < rounds; ++i)
+    {
+        int64_t start = nowNs();
+        pool.submitTask([]() {}).get();
+        uint64_t ns = static_cast<uint64_t>(nowNs() - start);
+        h.add(Histogram::bucketOf(ns), 1);
+        h.addTotals(1, ns, ns);
+    }
+    report("submitTask().get(), 1 worker", h);
+}
+
+int main()
+{
+    pingPong<MutexEvent>("mutex + condvar", ROUNDS, std::chrono::microseconds(0));
+    pingPong<Event>("Event", ROUNDS, std::chrono::microseconds(0));
+    pingPong<MutexEvent>("mutex + condvar, waiter asleep", SLEEP_ROUNDS, std::chrono::microseconds(200));
+    pingPong<Event>("Event, waiter asleep", SLEEP_ROUNDS, std::chrono::microseconds(200));
+    futureRoundTrip(ROUNDS);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Submit-to-start latency of bursty arrivals under each idle mode, and the CPU time it costs
+ * Build: g++ -std=c++17 -O2 -pthread -I../include idle_bench.cpp -o idle_bench
+ * */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int THREADS = 4;
+const int BURSTS = 2000;
+const int BURST_SIZE = 8;
+
+using Clock = std::chrono::steady_clock;
+
+// Gap between two bursts: mostly short, sometimes long, like a request pipeline
+static std::chrono::microseconds burstGap(int burst)
+{
+    return std::chrono::microseconds(burst % 10 == 0 ? 500 : 20);
+}
+
+static void run(const char *name, IdleMode mode)
+{
+    std::vector<int64_t> latencies(BURSTS * BURST_SIZE);
+    std::clock_t cpuStart = std::clock();
+    auto wallStart = Clock::now();
+    ParkingStats stats;
+    {
+        ThreadPool pool;
+        pool.setIdleMode(mode);
+        pool.start(THREADS);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        std::vector<Future<void>> pending;
+        for (int b = 0; b < BURSTS; ++b)
+        {
+            for (int i = 0; i < BURST_SIZE; ++i)
+            {
+                int64_t *slot = &latencies[b * BURST_SIZE + i];
+                auto submitted = Clock::now();
+                pending.push_back(pool.submitTask([slot, submitted]()
+                                                  { *slot = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - submitted).count(); }));
+            }
+            for (auto &f : pending)
+                f.get();
+            pending.clear();
+
+            // Busy wait, sleeping would put the submitting thread itself to sleep for much longer
+            auto until = Clock::now() + burstGap(b);
+            while (Clock::now() < until)
+            {
+            }
+        }
+        stats = pool.getParkingStats();
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(Clock::now() - wallStart).count();
+    double cpuMs = 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("%-10s p50 %7.1f us   p99 %7.1f us   cpu/wall %5.2f   parks %6llu   spin hits %6llu\n", name,
+                latencies[latencies.size() / 2] / 1000.0, latencies[latencies.size() * 99 / 100] / 1000.0,
+                cpuMs / wallMs, static_cast<unsigned long long>(stats.parks),
+                static_cast<unsigned long long>(stats.spinHits));
+}
+
+int main()
+{
+    std::printf("%d workers, %d bursts of %d tasks\n", THREADS, BURSTS, BURST_SIZE);
+    run("park", IdleMode::IDLE_PARK);
+    run("spin", IdleMode::IDLE_SPIN);
+    run("adaptive", IdleMode::IDLE_ADAPTIVE);
+    return 0;
+}
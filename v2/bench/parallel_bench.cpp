@@ -0,0 +1,79 @@
+/*
+ * AddTask-style range summation: serial loop vs std::async vs parallel_reduce
+ * Build: g++ -std=c++17 -O2 -pthread -I../include parallel_bench.cpp -o parallel_bench
+ * */
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+#include "../include/parallel.h"
+
+using ull = unsigned long long;
+const ull RANGE_END = 300000000;
+const int REPEAT = 5;
+volatile ull g_rangeEnd = RANGE_END; // Read at run time so the serial loop is not folded into a constant
+
+static ull sumRange(ull a, ull b)
+{
+    ull sum = 0;
+    for (ull i = a; i <= b; ++i)
+        sum += i;
+    return sum;
+}
+
+// Best of REPEAT runs, in milliseconds
+template <typename F>
+static double bestOf(F &&run, ull &result)
+{
+    double best = 1e100;
+    for (int r = 0; r < REPEAT; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        result = run();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+int main()
+{
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+
+    ull serial = 0, async = 0, reduced = 0;
+    double serialMs = bestOf([]
+                             { return sumRange(1, g_rangeEnd); }, serial);
+
+    // The hand-split version every user writes today, one std::async per core
+    double asyncMs = bestOf([threads]
+                            {
+                                std::vector<std::future<ull>> parts;
+                                ull end = g_rangeEnd;
+                                ull step = end / threads;
+                                for (unsigned t = 0; t < threads; ++t)
+                                {
+                                    ull a = t * step + 1;
+                                    ull b = t + 1 == threads ? end : (t + 1) * step;
+                                    parts.push_back(std::async(std::launch::async, sumRange, a, b));
+                                }
+                                ull sum = 0;
+                                for (auto &p : parts)
+                                    sum += p.get();
+                                return sum; }, async);
+
+    double reduceMs = 0;
+    {
+        ThreadPool pool;
+        pool.start(static_cast<int>(threads) - 1); // The caller is the last participant
+        reduceMs = bestOf([&pool]
+                          { return parallel_reduce(pool, ull(1), g_rangeEnd + 1, 0, ull(0),
+                                                   [](ull i) { return i; }, std::plus<ull>()); }, reduced);
+    }
+
+    std::printf("threads: %u, sum of 1..%llu\n", threads, RANGE_END);
+    std::printf("%-16s %10.2f ms  %llu\n", "serial", serialMs, serial);
+    std::printf("%-16s %10.2f ms  %llu\n", "std::async", asyncMs, async);
+    std::printf("%-16s %10.2f ms  %llu\n", "parallel_reduce", reduceMs, reduced);
+    return serial == async && serial == reduced ? 0 : 1;
+}
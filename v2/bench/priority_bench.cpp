@@ -0,0 +1,82 @@
+/*
+ * p99 submit-to-start latency of urgent tasks while low priority work saturates the pool
+ * Build: g++ -std=c++17 -O2 -pthread -I../include priority_bench.cpp -o priority_bench
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int THREADS = 4;
+const int PROBES = 200;
+const int64_t BULK_TASK_NS = 50000; // Every bulk task keeps a worker busy for 50 us
+const size_t BULK_BACKLOG = 2000;   // Bulk tasks kept queued at all times
+
+static void spinFor(int64_t ns)
+{
+    int64_t until = nowNs() + ns;
+    while (nowNs() < until)
+    {
+    }
+}
+
+// levels = 1: the probes queue behind the bulk work, levels = 2: they jump ahead of it
+static void run(const char *name, size_t levels)
+{
+    ThreadPool pool;
+    pool.setPriorityLevels(levels);
+    pool.setTaskQueMaxSize(4 * BULK_BACKLOG);
+    pool.start(THREADS);
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> queued(0), finished(0);
+    std::thread flood([&]()
+                      {
+                          while (!stop)
+                          {
+                              if (queued - finished < BULK_BACKLOG)
+                              {
+                                  ++queued;
+                                  pool.post(Priority(levels - 1), [&finished]()
+                                            { spinFor(BULK_TASK_NS);
+                                              ++finished; });
+                              }
+                              else
+                              {
+                                  std::this_thread::yield();
+                              }
+                          } });
+
+    while (queued < BULK_BACKLOG)
+        std::this_thread::yield();
+
+    Histogram latency;
+    for (int i = 0; i < PROBES; ++i)
+    {
+        int64_t submitted = nowNs();
+        int64_t started = pool.submitTask(Priority(0), []()
+                                          { return nowNs(); })
+                              .get();
+        uint64_t ns = static_cast<uint64_t>(started - submitted);
+        latency.add(Histogram::bucketOf(ns), 1);
+        latency.addTotals(1, ns, ns);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop = true;
+    flood.join();
+
+    std::printf("%-22s p50 %10.1f us   p99 %10.1f us   max %10.1f us\n", name,
+                latency.percentile(0.5) / 1000.0, latency.percentile(0.99) / 1000.0, latency.max() / 1000.0);
+}
+
+int main()
+{
+    std::printf("%d workers, %zu queued bulk tasks of %lld us, %d urgent probes\n", THREADS, BULK_BACKLOG,
+                static_cast<long long>(BULK_TASK_NS / 1000), PROBES);
+    run("single FIFO", 1);
+    run("2 priority levels", 2);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Submission throughput with 1 to 64 independent producer threads: one locked shared queue (a
+ * single lock for every producer and worker) against the same queue split into shards, see
+ * ThreadPool::start(). Every producer posts tiny tasks as fast as it can; a run ends once all of
+ * them have executed.
+ * Build: g++ -std=c++17 -O2 -pthread -I../include shard_bench.cpp -o shard_bench
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int MAX_PRODUCERS = 64;
+const int TASKS = 1 << 19; // Split among the producers of a run
+
+// Tasks per second of one run
+static double run(unsigned workers, size_t shards, int producers)
+{
+    ThreadPool pool;
+    pool.setTaskQueMaxSize(1 << 16);
+    pool.start(static_cast<int>(workers), shards);
+
+    std::atomic<int> done(0);
+    std::atomic_bool go(false);
+    int perProducer = TASKS / producers;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&]()
+                             {
+                                 while (!go.load(std::memory_order_acquire))
+                                     std::this_thread::yield();
+                                 for (int i = 0; i < perProducer; ++i)
+                                 {
+                                     pool.post([&done]()
+                                               { done.fetch_add(1, std::memory_order_relaxed); });
+                                 } });
+    }
+
+    int64_t start = nowNs();
+    go.store(true, std::memory_order_release);
+    for (auto &thread : threads)
+        thread.join();
+    while (done.load(std::memory_order_relaxed) < perProducer * producers)
+        std::this_thread::yield();
+    int64_t ns = nowNs() - start;
+    return perProducer * producers * 1e9 / static_cast<double>(ns);
+}
+
+int main()
+{
+    unsigned workers = std::max(4u, std::thread::hardware_concurrency());
+    size_t shards = workers;
+    std::printf("%u workers, %zu shards\n", workers, shards);
+    std::printf("%-10s %16s %16s %8s\n", "producers", "1 lock Mtask/s", "sharded Mtask/s", "speedup");
+    for (int producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+    {
+        double single = run(workers, 1, producers);
+        double sharded = run(workers, shards, producers);
+        std::printf("%-10d %16.2f %16.2f %7.2fx\n", producers, single / 1e6, sharded / 1e6, sharded / single);
+    }
+    return 0;
+}
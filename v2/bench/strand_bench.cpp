@@ -0,0 +1,100 @@
+/*
+ * 10,000 strands multiplexed over the workers: producer threads post sequence-numbered tasks to
+ * every strand in turn. Strand against the usual alternative, posting to the pool directly with a
+ * mutex per key, which keeps the tasks of a key apart but not in order. Each task checks that it
+ * sees the previous task of its key; a run ends once all tasks have executed.
+ * Build: g++ -std=c++17 -O2 -pthread -I../include strand_bench.cpp -o strand_bench
+ * */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/strand.h"
+
+const int STRANDS = 10000;
+const int ROUNDS = 50;   // Tasks per strand and producer
+const int PRODUCERS = 4; // Each posts its own sequence to every strand
+
+// Per key state, written only by the tasks of the key
+struct alignas(64) Key
+{
+    std::mutex mtx;
+    int last[PRODUCERS];
+};
+
+struct Result
+{
+    double tasksPerSec;
+    long outOfOrder; // Tasks that did not run right after the previous one of their producer and key
+};
+
+template <typename Post>
+static Result run(unsigned workers, Post post)
+{
+    ThreadPool pool;
+    pool.setTaskQueMaxSize(1 << 16);
+    pool.start(static_cast<int>(workers));
+    std::unique_ptr<Key[]> keys(new Key[STRANDS]);
+    for (int k = 0; k < STRANDS; ++k)
+        std::fill(keys[k].last, keys[k].last + PRODUCERS, -1);
+    std::atomic<long> done(0);
+    std::atomic<long> outOfOrder(0);
+    auto body = [&](int key, int producer, int seq)
+    {
+        if (keys[key].last[producer] != seq - 1)
+            outOfOrder.fetch_add(1, std::memory_order_relaxed);
+        keys[key].last[producer] = seq;
+        done.fetch_add(1, std::memory_order_relaxed);
+    };
+    auto runner = post(pool, keys.get());
+
+    int64_t start = nowNs();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < PRODUCERS; ++p)
+    {
+        threads.emplace_back([&, p]()
+                             {
+                                 for (int r = 0; r < ROUNDS; ++r)
+                                 {
+                                     for (int k = 0; k < STRANDS; ++k)
+                                         runner(k, [&body, k, p, r]()
+                                                { body(k, p, r); });
+                                 } });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    long total = static_cast<long>(STRANDS) * ROUNDS * PRODUCERS;
+    while (done.load(std::memory_order_relaxed) < total)
+        std::this_thread::yield();
+    int64_t ns = nowNs() - start;
+    return Result{total * 1e9 / static_cast<double>(ns), outOfOrder.load()};
+}
+
+int main()
+{
+    unsigned workers = std::max(4u, std::thread::hardware_concurrency());
+    std::printf("%u workers, %d strands, %d producers, %ld tasks\n", workers, STRANDS, PRODUCERS,
+                static_cast<long>(STRANDS) * ROUNDS * PRODUCERS);
+    std::printf("%-24s %12s %14s\n", "", "Mtask/s", "out of order");
+
+    Result strands = run(workers, [](ThreadPool &pool, Key *)
+                         {
+                             auto all = std::make_shared<std::vector<Strand>>();
+                             for (int k = 0; k < STRANDS; ++k)
+                                 all->emplace_back(pool);
+                             return [all](int key, auto &&task)
+                             { (*all)[key].post(std::move(task)); }; });
+    std::printf("%-24s %12.2f %14ld\n", "Strand", strands.tasksPerSec / 1e6, strands.outOfOrder);
+
+    Result locked = run(workers, [](ThreadPool &pool, Key *keys)
+                        { return [&pool, keys](int key, auto &&task)
+                          { pool.post([keys, key, task]()
+                                      {
+                                          std::lock_guard<std::mutex> lock(keys[key].mtx);
+                                          task(); }); }; });
+    std::printf("%-24s %12.2f %14ld\n", "pool.post + key mutex", locked.tasksPerSec / 1e6, locked.outOfOrder);
+    return 0;
+}
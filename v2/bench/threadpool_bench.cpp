@@ -0,0 +1,409 @@
+/*
+ * Benchmark suite of the pool, one run per PoolMode plus a raw std::thread baseline
+ * Build: cmake -S . -B build && cmake --build build --target threadpool_bench
+ * Usage: threadpool_bench [--filter=SUBSTRING] [--reps=N] [--json=FILE]
+ * The table follows Google Benchmark (median of the repetitions), --json writes the same
+ * results in its JSON layout for trend tracking.
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Busy work of about ns nanoseconds
+static void spinFor(int64_t ns)
+{
+    int64_t until = nowNs() + ns;
+    while (nowNs() < until)
+    {
+    }
+}
+
+// Wait until counter reaches target
+static void awaitCount(const std::atomic<size_t> &counter, size_t target)
+{
+    while (counter.load(std::memory_order_acquire) < target)
+        std::this_thread::yield();
+}
+
+static void record(Histogram &hist, int64_t ns)
+{
+    uint64_t v = static_cast<uint64_t>(std::max<int64_t>(ns, 0));
+    hist.add(Histogram::bucketOf(v), 1);
+    hist.addTotals(1, v, v);
+}
+
+// Runs every task on the pool
+class PoolExecutor
+{
+public:
+    PoolExecutor(PoolMode mode, QueueMode queueMode, unsigned threads)
+    {
+        pool_.setMode(mode);
+        pool_.setQueueMode(queueMode);
+        pool_.setTaskQueMaxSize(1 << 16);
+        pool_.setThreadMaxSize(threads * 2);
+        pool_.start(static_cast<int>(threads));
+    }
+
+    template <typename F>
+    void spawn(F &&func)
+    {
+        while (!pool_.post(func))
+        {
+        }
+    }
+
+    void drain() {}
+
+    static constexpr size_t SCALE = 1; // Benchmark sizes are divided by SCALE
+
+private:
+    ThreadPool pool_;
+};
+
+// What the pool replaces: one std::thread per task
+class ThreadExecutor
+{
+public:
+    template <typename F>
+    void spawn(F &&func)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        threads_.emplace_back(std::forward<F>(func));
+    }
+
+    // Join every thread, tasks may still be spawning new ones
+    void drain()
+    {
+        for (;;)
+        {
+            std::vector<std::thread> threads;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                threads.swap(threads_);
+            }
+            if (threads.empty())
+                return;
+            for (auto &t : threads)
+                t.join();
+        }
+    }
+
+    ~ThreadExecutor() { drain(); }
+
+    // A thread per task costs far more than a task, keep the runs of the baseline short
+    static constexpr size_t SCALE = 20;
+
+private:
+    std::mutex mtx_;
+    std::vector<std::thread> threads_;
+};
+
+// One measurement: items processed in a wall time, plus optional latency percentiles
+struct Measurement
+{
+    size_t items = 0;
+    double seconds = 0;
+    Histogram latency; // Empty when the benchmark measures no latency
+};
+
+struct Result
+{
+    std::string name;
+    size_t iterations;
+    double nsPerItem;
+    double itemsPerSecond;
+    double p50Us;
+    double p99Us;
+};
+
+static double elapsed(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Throughput of tasks that do nothing, the pure scheduling overhead
+template <typename Exec>
+Measurement emptyTasks(Exec &exec)
+{
+    size_t n = 100000 / Exec::SCALE;
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i)
+        exec.spawn([&done]()
+                   { done.fetch_add(1, std::memory_order_release); });
+    awaitCount(done, n);
+    exec.drain();
+    Measurement m;
+    m.items = n;
+    m.seconds = elapsed(start);
+    return m;
+}
+
+// One task at a time: submit -> start latency of an otherwise idle executor
+template <typename Exec>
+Measurement submitLatency(Exec &exec)
+{
+    size_t n = 20000 / Exec::SCALE;
+    Measurement m;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i)
+    {
+        std::atomic<size_t> done(0);
+        int64_t startedAt = 0;
+        int64_t submitted = nowNs();
+        exec.spawn([&done, &startedAt]()
+                   { startedAt = nowNs();
+                     done.store(1, std::memory_order_release); });
+        awaitCount(done, 1);
+        record(m.latency, startedAt - submitted);
+        exec.drain();
+    }
+    m.items = n;
+    m.seconds = elapsed(start);
+    return m;
+}
+
+// Rounds of 64 small tasks, each round waited for before the next one starts
+template <typename Exec>
+Measurement fanOutFanIn(Exec &exec)
+{
+    const size_t width = 64;
+    size_t rounds = 1000 / Exec::SCALE;
+    auto start = Clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        std::atomic<size_t> done(0);
+        for (size_t i = 0; i < width; ++i)
+            exec.spawn([&done]()
+                       { spinFor(1000);
+                         done.fetch_add(1, std::memory_order_release); });
+        awaitCount(done, width);
+        exec.drain();
+    }
+    Measurement m;
+    m.items = rounds * width;
+    m.seconds = elapsed(start);
+    return m;
+}
+
+// producers threads submitting empty tasks at the same time
+template <typename Exec>
+Measurement producerContention(Exec &exec, size_t producers)
+{
+    size_t perProducer = 40000 / Exec::SCALE / producers;
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p)
+        threads.emplace_back([&]()
+                             { for (size_t i = 0; i < perProducer; ++i)
+                                   exec.spawn([&done]()
+                                              { done.fetch_add(1, std::memory_order_release); }); });
+    for (auto &t : threads)
+        t.join();
+    awaitCount(done, producers * perProducer);
+    exec.drain();
+    Measurement m;
+    m.items = producers * perProducer;
+    m.seconds = elapsed(start);
+    return m;
+}
+
+// Every node of a binary tree spawns its two children from inside the executor
+template <typename Exec>
+struct TreeNode
+{
+    Exec *exec;
+    std::atomic<size_t> *done;
+    int depth;
+
+    void operator()() const
+    {
+        done->fetch_add(1, std::memory_order_release);
+        if (depth == 0)
+            return;
+        exec->spawn(TreeNode{exec, done, depth - 1});
+        exec->spawn(TreeNode{exec, done, depth - 1});
+    }
+};
+
+template <typename Exec>
+Measurement taskTree(Exec &exec)
+{
+    int depth = Exec::SCALE == 1 ? 15 : 10;
+    size_t nodes = (size_t(1) << (depth + 1)) - 1;
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    exec.spawn(TreeNode<Exec>{&exec, &done, depth});
+    awaitCount(done, nodes);
+    exec.drain();
+    Measurement m;
+    m.items = nodes;
+    m.seconds = elapsed(start);
+    return m;
+}
+
+// One task in 20 runs for 200 us, the others for 1 us; latency is the one of the short tasks
+template <typename Exec>
+Measurement mixedLongShort(Exec &exec)
+{
+    size_t n = 4000 / Exec::SCALE;
+    std::vector<int64_t> started(n, 0), submitted(n, 0);
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i)
+    {
+        int64_t work = i % 20 == 0 ? 200000 : 1000;
+        submitted[i] = nowNs();
+        exec.spawn([&done, &started, i, work]()
+                   { started[i] = nowNs();
+                     spinFor(work);
+                     done.fetch_add(1, std::memory_order_release); });
+    }
+    awaitCount(done, n);
+    exec.drain();
+    Measurement m;
+    m.items = n;
+    m.seconds = elapsed(start);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (i % 20 != 0)
+            record(m.latency, started[i] - submitted[i]);
+    }
+    return m;
+}
+
+class Suite
+{
+public:
+    Suite(std::string filter, int reps) : filter_(std::move(filter)), reps_(reps) {}
+
+    // Run bench reps times on a fresh executor and keep the median
+    template <typename MakeExec, typename Bench>
+    void run(const std::string &name, MakeExec &&makeExec, Bench &&bench)
+    {
+        if (name.find(filter_) == std::string::npos)
+            return;
+        std::vector<Measurement> runs;
+        for (int r = 0; r < reps_; ++r)
+        {
+            auto exec = makeExec();
+            runs.push_back(bench(*exec));
+        }
+        std::sort(runs.begin(), runs.end(), [](const Measurement &a, const Measurement &b)
+                  { return a.seconds / a.items < b.seconds / b.items; });
+        const Measurement &m = runs[runs.size() / 2];
+
+        Result result{name, m.items, 1e9 * m.seconds / m.items, m.items / m.seconds,
+                      m.latency.percentile(0.5) / 1000.0, m.latency.percentile(0.99) / 1000.0};
+        std::printf("%-48s %12.1f ns %10zu %12.3fM/s", result.name.c_str(), result.nsPerItem,
+                    result.iterations, result.itemsPerSecond / 1e6);
+        if (m.latency.count() != 0)
+            std::printf("   p50=%.1fus p99=%.1fus", result.p50Us, result.p99Us);
+        std::printf("\n");
+        std::fflush(stdout);
+        results_.push_back(result);
+    }
+
+    void writeJson(const std::string &path, unsigned threads) const
+    {
+        std::ofstream out(path);
+        out << "{\n  \"context\": {\n    \"num_cpus\": " << std::thread::hardware_concurrency()
+            << ",\n    \"pool_threads\": " << threads << ",\n    \"repetitions\": " << reps_
+            << "\n  },\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results_.size(); ++i)
+        {
+            const Result &r = results_[i];
+            out << "    {\"name\": \"" << r.name << "\", \"run_type\": \"aggregate\", \"aggregate_name\": \"median\", "
+                << "\"iterations\": " << r.iterations << ", \"real_time\": " << r.nsPerItem
+                << ", \"time_unit\": \"ns\", \"items_per_second\": " << r.itemsPerSecond
+                << ", \"p50_us\": " << r.p50Us << ", \"p99_us\": " << r.p99Us << "}"
+                << (i + 1 < results_.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+private:
+    std::string filter_;
+    int reps_;
+    std::vector<Result> results_;
+};
+
+template <typename MakeExec>
+void runAll(Suite &suite, const std::string &executor, MakeExec &&makeExec, unsigned threads)
+{
+    using Exec = typename std::decay_t<decltype(makeExec())>::element_type;
+    suite.run("empty_tasks/" + executor, makeExec, [](Exec &e)
+              { return emptyTasks(e); });
+    suite.run("submit_latency/" + executor, makeExec, [](Exec &e)
+              { return submitLatency(e); });
+    suite.run("fan_out_fan_in/" + executor, makeExec, [](Exec &e)
+              { return fanOutFanIn(e); });
+    for (size_t producers = 1; producers <= 2 * threads; producers *= 2)
+        suite.run("producer_contention/" + executor + "/producers:" + std::to_string(producers), makeExec,
+                  [producers](Exec &e)
+                  { return producerContention(e, producers); });
+    suite.run("task_tree/" + executor, makeExec, [](Exec &e)
+              { return taskTree(e); });
+    suite.run("mixed_long_short/" + executor, makeExec, [](Exec &e)
+              { return mixedLongShort(e); });
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter, json;
+    int reps = 3;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "--filter=", 9) == 0)
+            filter = argv[i] + 9;
+        else if (std::strncmp(argv[i], "--reps=", 7) == 0)
+            reps = std::max(1, std::atoi(argv[i] + 7));
+        else if (std::strncmp(argv[i], "--json=", 7) == 0)
+            json = argv[i] + 7;
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--filter=SUBSTRING] [--reps=N] [--json=FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    std::printf("%u pool threads, median of %d runs\n", threads, reps);
+    std::printf("%-48s %15s %10s %14s\n", "Benchmark", "Time/item", "Items", "Throughput");
+
+    Suite suite(filter, reps);
+    const struct
+    {
+        const char *name;
+        PoolMode mode;
+        QueueMode queueMode;
+    } pools[] = {
+        {"fixed", PoolMode::MODE_FIXED, QueueMode::QUEUE_LOCKED},
+        {"fixed_lockfree", PoolMode::MODE_FIXED, QueueMode::QUEUE_LOCK_FREE},
+        {"cached", PoolMode::MODE_CACHED, QueueMode::QUEUE_LOCKED},
+        {"work_stealing", PoolMode::MODE_WORK_STEALING, QueueMode::QUEUE_LOCKED},
+    };
+    for (auto &pool : pools)
+        runAll(suite, pool.name, [&]()
+               { return std::make_unique<PoolExecutor>(pool.mode, pool.queueMode, threads); }, threads);
+    runAll(suite, "std_thread", []()
+           { return std::make_unique<ThreadExecutor>(); }, threads);
+
+    if (!json.empty())
+        suite.writeJson(json, threads);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Cost of arming and cancelling a large number of timers, and how late they fire
+ * Build: g++ -std=c++17 -O2 -pthread -I../include timer_bench.cpp -o timer_bench
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+
+const int THREADS = 4;
+const int TIMERS = 500000;  // Armed at once
+const int SPREAD_MS = 1000; // Delays are spread over this range, starting one second from now
+const int PROBES = 2000;    // Timers whose lateness is measured
+
+int main()
+{
+    ThreadPool pool;
+    pool.start(THREADS);
+
+    // Arm, then cancel every other timer
+    std::atomic<int> fired(0);
+    std::vector<TimerHandle> handles;
+    handles.reserve(TIMERS);
+    int64_t start = nowNs();
+    for (int i = 0; i < TIMERS; ++i)
+    {
+        handles.push_back(pool.scheduleAfter(std::chrono::milliseconds(1000 + i % SPREAD_MS), [&fired]()
+                                             { ++fired; }));
+    }
+    int64_t armed = nowNs();
+    for (int i = 0; i < TIMERS; i += 2)
+        handles[i].cancel();
+    int64_t cancelled = nowNs();
+    std::printf("arm    %8.1f ns/timer\n", static_cast<double>(armed - start) / TIMERS);
+    std::printf("cancel %8.1f ns/timer\n", static_cast<double>(cancelled - armed) / (TIMERS / 2));
+
+    // Lateness of one-shot timers while the others expire around them
+    std::vector<int64_t> lateness(PROBES);
+    std::atomic<int> done(0);
+    for (int i = 0; i < PROBES; ++i)
+    {
+        int64_t delay = 1000000 * (1 + i % SPREAD_MS);
+        int64_t due = nowNs() + delay;
+        int64_t *slot = &lateness[i];
+        pool.scheduleAfter(std::chrono::nanoseconds(delay), [slot, &done, due]()
+                           { *slot = nowNs() - due;
+                             ++done; });
+    }
+    while (done < PROBES || fired < TIMERS / 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::printf("fired  %d of %d\n", fired.load(), TIMERS / 2);
+    std::sort(lateness.begin(), lateness.end());
+    std::printf("late   p50 %8.1f us   p99 %8.1f us   max %8.1f us\n", lateness[PROBES / 2] / 1000.0,
+                lateness[PROBES * 99 / 100] / 1000.0, lateness.back() / 1000.0);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,196 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Where the workers run, see ThreadPool::setAffinity()
+enum class AffinityMode
+{
+    AFFINITY_NONE,    // Let the scheduler place and migrate the workers
+    AFFINITY_COMPACT, // Worker i on the i-th CPU, filling a NUMA node before moving to the next
+    AFFINITY_SPREAD,  // Worker i on NUMA node i % nodes, round-robin over the nodes
+    AFFINITY_CPUSET,  // Worker i on the (i % n)-th of n CPUs supplied by the user
+};
+
+/*
+ * CPUs and NUMA nodes the process may run on
+ * Read from sysfs on Linux and restricted to the affinity mask of the process. Elsewhere, or when
+ * sysfs is not there, a single node holding hardware_concurrency() CPUs.
+ * */
+class CpuTopology
+{
+public:
+    // Detected once per process
+    static const CpuTopology &instance()
+    {
+        static const CpuTopology topology(detect());
+        return topology;
+    }
+
+    // nodes[k] lists the CPUs of node k, empty nodes are dropped
+    explicit CpuTopology(std::vector<std::vector<int>> nodes)
+    {
+        for (auto &cpus : nodes)
+        {
+            if (cpus.empty())
+                continue;
+            for (int cpu : cpus)
+            {
+                if (cpu >= static_cast<int>(nodeOfCpu_.size()))
+                    nodeOfCpu_.resize(cpu + 1, 0);
+                nodeOfCpu_[cpu] = nodes_.size();
+            }
+            nodes_.push_back(std::move(cpus));
+        }
+        if (nodes_.empty())
+            nodes_.push_back({0});
+    }
+
+    size_t nodeCount() const { return nodes_.size(); }
+    const std::vector<int> &cpusOf(size_t node) const { return nodes_[node]; }
+
+    // Node of a CPU, 0 when the CPU is unknown
+    size_t nodeOf(int cpu) const
+    {
+        return cpu >= 0 && cpu < static_cast<int>(nodeOfCpu_.size()) ? nodeOfCpu_[cpu] : 0;
+    }
+
+    // CPU worker i is pinned to under mode, -1 for no pinning. cpuset is only used by AFFINITY_CPUSET.
+    int place(AffinityMode mode, const std::vector<int> &cpuset, size_t i) const
+    {
+        switch (mode)
+        {
+        case AffinityMode::AFFINITY_COMPACT:
+        {
+            size_t total = 0;
+            for (auto &cpus : nodes_)
+                total += cpus.size();
+            i %= total;
+            for (auto &cpus : nodes_)
+            {
+                if (i < cpus.size())
+                    return cpus[i];
+                i -= cpus.size();
+            }
+            return -1;
+        }
+        case AffinityMode::AFFINITY_SPREAD:
+        {
+            const std::vector<int> &cpus = nodes_[i % nodes_.size()];
+            return cpus[(i / nodes_.size()) % cpus.size()];
+        }
+        case AffinityMode::AFFINITY_CPUSET:
+            return cpuset.empty() ? -1 : cpuset[i % cpuset.size()];
+        default:
+            return -1;
+        }
+    }
+
+    // CPU the calling thread runs on right now, -1 when it cannot be told
+    static int currentCpu()
+    {
+#ifdef __linux__
+        return sched_getcpu();
+#else
+        return -1;
+#endif
+    }
+
+    // Parse a sysfs CPU list such as "0-3,8-11"
+    static std::vector<int> parseList(const std::string &list)
+    {
+        std::vector<int> ids;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            if (range.empty() || range == "\n")
+                continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int id = first; id <= last; ++id)
+                ids.push_back(id);
+        }
+        return ids;
+    }
+
+private:
+    static std::vector<std::vector<int>> detect()
+    {
+        std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        std::string line;
+        std::ifstream online("/sys/devices/system/node/online");
+        if (online && std::getline(online, line))
+        {
+            for (int node : parseList(line))
+            {
+                std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::vector<int> cpus;
+                if (file && std::getline(file, line))
+                {
+                    for (int cpu : parseList(line))
+                    {
+                        if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                            cpus.push_back(cpu);
+                    }
+                }
+                nodes.push_back(std::move(cpus));
+            }
+        }
+        if (nodes.empty() && masked)
+        {
+            nodes.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                    nodes.back().push_back(cpu);
+            }
+        }
+#endif
+        if (nodes.empty())
+        {
+            nodes.emplace_back();
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                nodes.back().push_back(static_cast<int>(cpu));
+        }
+        return nodes;
+    }
+
+private:
+    std::vector<std::vector<int>> nodes_; // CPUs of every node
+    std::vector<size_t> nodeOfCpu_;       // Node of every CPU
+};
+
+// Pin the calling thread to one CPU, false when the platform does not support it or the CPU is not allowed
+inline bool pinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,234 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <utility>
+#include "event.h"
+#include "future.h"
+#include "slabpool.h"
+
+/*
+ * Completion state shared by all tasks of one batch
+ * One counter replaces the N shared states that N separate futures would need.
+ * The body call(body, i) is kept here, not in the tasks: a queued task runs the next index nobody
+ * has taken yet, so a worker waiting for the batch can take the rest itself, as a worker waiting
+ * for a future runs its pending body.
+ * Owned by the TaskBatch handle plus one reference per queued task.
+ * */
+class BatchState
+{
+public:
+    using Call = void (*)(void *body, size_t index);
+
+    static BatchState *create(size_t count, std::shared_ptr<void> body, Call call, Executor executor = Executor())
+    {
+        return SlabPool<BatchState>::instance().create(count, std::move(body), call, executor);
+    }
+
+    BatchState(size_t count, std::shared_ptr<void> body, Call call, Executor executor = Executor())
+        : refs_(count + 1), remaining_(count), size_(count), rejected_(0), next_(0), end_(count), failed_(false),
+          body_(std::move(body)), call_(call), executor_(executor)
+    {
+        if (count == 0)
+            done_.set();
+    }
+
+    // Run the next index nobody has taken, false once they are all taken
+    bool runNext()
+    {
+        size_t index = claim();
+        if (index == size_)
+            return false;
+        std::exception_ptr error;
+        try
+        {
+            call_(body_.get(), index);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        complete(std::move(error));
+        return true;
+    }
+
+    // A queued task was destroyed unrun: the index it would have taken counts as rejected
+    void drop()
+    {
+        if (claim() == size_)
+            return;
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        finish(1);
+    }
+
+    // One task finished, error is null when it succeeded
+    void complete(std::exception_ptr error)
+    {
+        if (error && !failed_.exchange(true))
+            error_ = std::move(error);
+        finish(1);
+    }
+
+    // The last count tasks were never queued: their indices never run and their references go
+    void reject(size_t count)
+    {
+        end_.fetch_sub(count, std::memory_order_relaxed);
+        rejected_.fetch_add(count, std::memory_order_relaxed);
+        finish(count);
+        if (refs_.fetch_sub(count, std::memory_order_acq_rel) == count)
+            SlabPool<BatchState>::instance().destroy(this);
+    }
+
+    bool isDone() const { return done_.isSet(); }
+
+    // On a worker of the pool, run the indices nobody has taken, then other queued tasks until the
+    // batch is done, as FutureState::wait() does. What it still waits for runs on other threads.
+    void wait()
+    {
+        if (!isDone() && executor_.isWorker())
+        {
+            while (runNext())
+            {
+            }
+            while (!isDone() && executor_.help())
+            {
+            }
+        }
+        done_.wait();
+    }
+
+    template <typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        return done_.waitFor(timeout);
+    }
+
+    size_t size() const { return size_; }
+    size_t rejected() const { return rejected_.load(std::memory_order_relaxed); }
+    std::exception_ptr error() const { return failed_ ? error_ : nullptr; }
+
+    void release()
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            SlabPool<BatchState>::instance().destroy(this);
+    }
+
+private:
+    // The next index to run, size_ when none is left
+    size_t claim()
+    {
+        size_t index = next_.fetch_add(1, std::memory_order_relaxed);
+        return index < end_.load(std::memory_order_relaxed) ? index : size_;
+    }
+
+    void finish(size_t count)
+    {
+        if (remaining_.fetch_sub(count, std::memory_order_acq_rel) == count)
+            done_.set();
+    }
+
+private:
+    std::atomic<size_t> refs_;
+    std::atomic<size_t> remaining_; // Tasks that have neither finished nor been rejected
+    size_t size_;
+    std::atomic<size_t> rejected_;
+    std::atomic<size_t> next_;     // Next index to claim, may run past end_
+    std::atomic<size_t> end_;      // Indices of the tasks that were queued, reject() lowers it
+    std::atomic_bool failed_;  // Set by the first task that threw
+    std::exception_ptr error_; // Exception of that task
+    std::shared_ptr<void> body_;
+    Call call_;
+    Event done_;               // Set when remaining_ drops to 0
+    Executor executor_;        // Pool the tasks were queued on, helped while waiting
+};
+
+/*
+ * Reference to the batch held by every task of it
+ * A task destroyed without running (e.g. the pool shuts down) counts as rejected, unless a waiting
+ * worker has already run every index.
+ * */
+class BatchTicket
+{
+public:
+    explicit BatchTicket(BatchState *state) : state_(state) {}
+    BatchTicket(BatchTicket &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    BatchTicket &operator=(BatchTicket &&) = delete;
+    BatchTicket(const BatchTicket &) = delete;
+
+    ~BatchTicket()
+    {
+        if (state_ != nullptr)
+        {
+            state_->drop();
+            state_->release();
+        }
+    }
+
+    void run()
+    {
+        BatchState *state = std::exchange(state_, nullptr);
+        state->runNext();
+        state->release();
+    }
+
+private:
+    BatchState *state_;
+};
+
+// Handle returned by ThreadPool::submitBatch()/submitBulk(), waits for the whole batch at once
+class TaskBatch
+{
+public:
+    TaskBatch() : state_(nullptr) {}
+    explicit TaskBatch(BatchState *state) : state_(state) {}
+    TaskBatch(TaskBatch &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    TaskBatch &operator=(TaskBatch &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            state_ = std::exchange(other.state_, nullptr);
+        }
+        return *this;
+    }
+    TaskBatch(const TaskBatch &) = delete;
+    TaskBatch &operator=(const TaskBatch &) = delete;
+    ~TaskBatch() { reset(); }
+
+    bool valid() const { return state_ != nullptr; }
+    bool done() const { return state_->isDone(); }
+    size_t size() const { return state_->size(); }
+
+    // Tasks that never ran because the queue stayed full or the pool shut down, they count as finished
+    size_t rejected() const { return state_->rejected(); }
+
+    // Wait for every task, then rethrow the first exception thrown by one of them
+    void wait() const
+    {
+        state_->wait();
+        if (std::exception_ptr error = state_->error())
+            std::rethrow_exception(error);
+    }
+
+    template <typename Rep, typename Period>
+    bool wait_for(const std::chrono::duration<Rep, Period> &timeout) const
+    {
+        return state_->waitFor(timeout);
+    }
+
+private:
+    void reset()
+    {
+        if (state_ != nullptr)
+            std::exchange(state_, nullptr)->release();
+    }
+
+private:
+    BatchState *state_;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef CANCEL_H
+#define CANCEL_H
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+#include "future.h"
+#include "slabpool.h"
+
+// Thrown by the future of a task that was cancelled, or whose deadline passed, before a worker started it
+class TaskCancelledError : public std::runtime_error
+{
+public:
+    explicit TaskCancelledError(const char *what) : std::runtime_error(what) {}
+};
+
+/*
+ * Flag shared by a CancellationSource and its tokens
+ * States come from a SlabPool, and are owned by every source and token that refers to them.
+ * */
+class CancelState
+{
+public:
+    static CancelState *create() { return SlabPool<CancelState>::instance().create(); }
+
+    CancelState() : refs_(1), cancelled_(false) {}
+
+    void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void release()
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            SlabPool<CancelState>::instance().destroy(this);
+    }
+
+    // false if it was already cancelled
+    bool cancel() { return !cancelled_.exchange(true, std::memory_order_release); }
+
+    bool isCancelled() const { return cancelled_.load(std::memory_order_acquire); }
+
+private:
+    std::atomic_int refs_;
+    std::atomic_bool cancelled_;
+};
+
+/*
+ * Observer side of a cancellation, passed to ThreadPool::submitTask() or polled by a task that
+ * wants to stop early. A default-constructed token is never cancelled.
+ * */
+class CancellationToken
+{
+public:
+    CancellationToken() : state_(nullptr) {}
+    explicit CancellationToken(CancelState *state) : state_(state)
+    {
+        if (state_ != nullptr)
+            state_->retain();
+    }
+    CancellationToken(const CancellationToken &other) : CancellationToken(other.state_) {}
+    CancellationToken(CancellationToken &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    CancellationToken &operator=(CancellationToken other) noexcept
+    {
+        std::swap(state_, other.state_);
+        return *this;
+    }
+    ~CancellationToken()
+    {
+        if (state_ != nullptr)
+            state_->release();
+    }
+
+    // Whether a source can cancel this token at all
+    bool valid() const { return state_ != nullptr; }
+
+    bool isCancelled() const { return state_ != nullptr && state_->isCancelled(); }
+
+private:
+    CancelState *state_;
+};
+
+/*
+ * Owner side of a cancellation: cancel() flags every token made by token()
+ * Cancelling is cooperative. A queued task is dropped by the worker that dequeues it, a running
+ * task is not interrupted and only stops if it polls its token.
+ * A moved-from source cancels nothing and hands out tokens that are never cancelled.
+ * */
+class CancellationSource
+{
+public:
+    CancellationSource() : state_(CancelState::create()) {}
+    CancellationSource(const CancellationSource &other) : state_(other.state_)
+    {
+        if (state_ != nullptr)
+            state_->retain();
+    }
+    CancellationSource(CancellationSource &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    CancellationSource &operator=(const CancellationSource &) = delete;
+    ~CancellationSource()
+    {
+        if (state_ != nullptr)
+            state_->release();
+    }
+
+    CancellationToken token() const { return CancellationToken(state_); }
+
+    // false if it was already cancelled, or if there is nothing to cancel
+    bool cancel() { return state_ != nullptr && state_->cancel(); }
+
+    bool isCancelled() const { return state_ != nullptr && state_->isCancelled(); }
+
+private:
+    CancelState *state_;
+};
+
+/*
+ * Future of ThreadPool::submitCancellable() that cancels its task when dropped
+ * Nobody is left to take the result of a dropped handle, so a task still queued by then is never
+ * run. get() consumes the handle like Future::get(), after which dropping it cancels nothing.
+ * */
+template <typename T>
+class CancellableFuture
+{
+public:
+    CancellableFuture(Future<T> future, const CancellationSource &source)
+        : future_(std::move(future)), source_(source) {}
+    CancellableFuture(CancellableFuture &&other) noexcept
+        : future_(std::move(other.future_)), source_(std::move(other.source_)) {}
+    CancellableFuture &operator=(CancellableFuture &&) = delete;
+    CancellableFuture(const CancellableFuture &) = delete;
+    CancellableFuture &operator=(const CancellableFuture &) = delete;
+
+    ~CancellableFuture()
+    {
+        if (future_.valid())
+            source_.cancel();
+    }
+
+    bool valid() const { return future_.valid(); }
+
+    // The task is dropped if no worker has started it yet, get() then throws TaskCancelledError
+    // once a worker has dequeued it. False if it was already cancelled.
+    bool cancel() { return source_.cancel(); }
+
+    CancellationToken token() const { return source_.token(); }
+
+    void wait() const { future_.wait(); }
+
+    template <typename Rep, typename Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period> &timeout) const
+    {
+        return future_.wait_for(timeout);
+    }
+
+    T get() { return future_.get(); }
+
+    // Keep the task alive without the handle: the plain future does not cancel when dropped
+    Future<T> detach() { return std::move(future_); }
+
+private:
+    Future<T> future_;
+    CancellationSource source_;
+};
+
+#endif
\ No newline at end of file
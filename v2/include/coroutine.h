@@ -0,0 +1,232 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// Coroutine support needs C++20, the rest of the pool builds with C++17
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "threadpool.h"
+
+/*
+ * Coroutines on top of ThreadPool
+ * CoTask<T> is a lazily started coroutine returning T. co_await on it runs it on the awaiting
+ * thread until it suspends, and when it finishes the awaiter is resumed inline on the same thread
+ * by symmetric transfer, so deep call chains neither queue tasks nor grow the stack.
+ * co_await pool.schedule() moves the coroutine onto a worker, co_await future suspends it until
+ * the result is ready. spawn() starts a CoTask without waiting for it, sync_wait() drives one from
+ * code that is not a coroutine.
+ * A suspended coroutine holds no thread: the pool only needs as many threads as cores.
+ * */
+
+template <typename T = void>
+class CoTask;
+
+// Continuation and exception of a CoTask, the parts that do not depend on T
+class CoTaskPromiseBase
+{
+public:
+    // Resume the awaiter, if any, in place of the finished coroutine
+    class FinalAwaiter
+    {
+    public:
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> next = handle.promise().continuation();
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error_ = std::current_exception(); }
+
+    std::coroutine_handle<> continuation() const noexcept { return continuation_; }
+    void setContinuation(std::coroutine_handle<> continuation) noexcept { continuation_ = continuation; }
+
+protected:
+    void rethrowIfFailed()
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+private:
+    std::coroutine_handle<> continuation_; // Coroutine awaiting this one
+    std::exception_ptr error_;
+};
+
+template <typename T>
+class CoTaskPromise : public CoTaskPromiseBase
+{
+public:
+    CoTask<T> get_return_object() noexcept;
+
+    template <typename V>
+    void return_value(V &&value) { value_.emplace(std::forward<V>(value)); }
+
+    T result()
+    {
+        rethrowIfFailed();
+        return static_cast<T>(std::move(*value_));
+    }
+
+private:
+    // References are kept as reference_wrapper, as in FutureState
+    using Stored = std::conditional_t<std::is_reference<T>::value,
+                                      std::reference_wrapper<std::remove_reference_t<T>>, T>;
+
+    std::optional<Stored> value_;
+};
+
+template <>
+class CoTaskPromise<void> : public CoTaskPromiseBase
+{
+public:
+    CoTask<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void result() { rethrowIfFailed(); }
+};
+
+// Move-only owner of a coroutine frame, destroying the CoTask destroys the frame
+template <typename T>
+class [[nodiscard]] CoTask
+{
+public:
+    using promise_type = CoTaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    CoTask() noexcept : handle_(nullptr) {}
+    explicit CoTask(Handle handle) noexcept : handle_(handle) {}
+    CoTask(CoTask &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+    ~CoTask() { reset(); }
+
+    bool valid() const noexcept { return static_cast<bool>(handle_); }
+
+    // Start the coroutine on the awaiting thread, the awaiter goes on where it finishes
+    class Awaiter
+    {
+    public:
+        explicit Awaiter(Handle handle) noexcept : handle_(handle) {}
+
+        bool await_ready() const noexcept { return handle_.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle_.promise().setContinuation(awaiting);
+            return handle_;
+        }
+
+        T await_resume() { return handle_.promise().result(); }
+
+    private:
+        Handle handle_;
+    };
+
+    Awaiter operator co_await() const noexcept { return Awaiter(handle_); }
+
+private:
+    void reset() noexcept
+    {
+        if (handle_)
+            std::exchange(handle_, nullptr).destroy();
+    }
+
+private:
+    Handle handle_;
+};
+
+template <typename T>
+CoTask<T> CoTaskPromise<T>::get_return_object() noexcept
+{
+    return CoTask<T>(std::coroutine_handle<CoTaskPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoTaskPromise<void>::get_return_object() noexcept
+{
+    return CoTask<void>(std::coroutine_handle<CoTaskPromise<void>>::from_promise(*this));
+}
+
+// Coroutine that starts at once and frees its frame when it ends, nobody awaits it
+class DetachedCoroutine
+{
+public:
+    class promise_type
+    {
+    public:
+        DetachedCoroutine get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+// Run task to completion and publish its result to state, the bridge used by spawn()
+template <typename T>
+DetachedCoroutine publishCoTask(CoTask<T> task, FutureState<T> *state)
+{
+    try
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await task;
+            state->setValue();
+        }
+        else
+        {
+            state->setValue(co_await task);
+        }
+    }
+    catch (...)
+    {
+        state->setException(std::current_exception());
+    }
+    state->release();
+}
+
+// Start task now on the calling thread, it goes on wherever it is resumed. co_await'ing a CoTask
+// runs one at a time, spawn() several of them and co_await their futures to run them at once.
+template <typename T>
+Future<T> spawn(CoTask<T> task)
+{
+    FutureState<T> *state = FutureState<T>::create();
+    Future<T> result(state);
+    publishCoTask(std::move(task), state);
+    return result;
+}
+
+// Run task and block the calling thread until it is done, for the top level of a program.
+// Its result is returned and its exception rethrown. Never call it on a worker of the pool the
+// task needs: use co_await there.
+template <typename T>
+T sync_wait(CoTask<T> task)
+{
+    return spawn(std::move(task)).get();
+}
+
+#endif
+
+#endif
\ No newline at end of file
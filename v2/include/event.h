@@ -0,0 +1,171 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+const int EVENT_SPIN_ROUNDS = 100; // Checks a waiter makes, with a pause in between, before it sleeps
+
+// Hint to the CPU that we are busy waiting
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * One-shot event: set() once, any number of threads wait()
+ * The whole state is one 32-bit word. A waiter first spins for a short while, since results are
+ * often set within microseconds. Then it marks the word as waited on and sleeps on it: with a
+ * futex on Linux, elsewhere on a condition variable picked by address from a small shared table.
+ * set() is a single exchange, and a system call only when somebody sleeps.
+ * */
+class Event
+{
+public:
+    Event() noexcept : state_(UNSET) {}
+
+    // Moving is for owners that move before the event is shared, e.g. a Result returned by value
+    Event(Event &&other) noexcept : state_(other.state_.load(std::memory_order_relaxed)) {}
+    Event &operator=(Event &&other) noexcept
+    {
+        state_.store(other.state_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+    Event(const Event &) = delete;
+    Event &operator=(const Event &) = delete;
+
+    bool isSet() const noexcept { return state_.load(std::memory_order_acquire) == SET; }
+
+    void set()
+    {
+        if (state_.exchange(SET, std::memory_order_acq_rel) == WAITED)
+            wakeAll();
+    }
+
+    void wait()
+    {
+        if (spin())
+            return;
+        while (prepareSleep())
+            sleep(nullptr);
+    }
+
+    // false if the event was not set within timeout
+    template <typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        if (spin())
+            return true;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (prepareSleep())
+        {
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::steady_clock::duration::zero())
+                return isSet();
+            sleep(&left);
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint32_t UNSET = 0;
+    static constexpr uint32_t WAITED = 1; // Not set, somebody sleeps or is about to
+    static constexpr uint32_t SET = 2;
+
+    bool spin() const
+    {
+        // On a single CPU the thread that would set the event cannot run while we spin
+        static const bool multiCore = std::thread::hardware_concurrency() > 1;
+        for (int i = 0; multiCore && i < EVENT_SPIN_ROUNDS; ++i)
+        {
+            if (isSet())
+                return true;
+            cpuRelax();
+        }
+        return isSet();
+    }
+
+    // Mark the event as waited on, false if it is set meanwhile
+    bool prepareSleep()
+    {
+        uint32_t state = UNSET;
+        return state_.compare_exchange_strong(state, WAITED, std::memory_order_acq_rel) || state != SET;
+    }
+
+#if defined(__linux__)
+    // Sleep while the word is still WAITED, spurious returns are fine: the caller checks again
+    void sleep(const std::chrono::steady_clock::duration *timeout)
+    {
+        timespec ts;
+        if (timeout != nullptr)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(*timeout).count();
+            ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+            ts.tv_nsec = static_cast<long>(ns % 1000000000);
+        }
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAIT_PRIVATE, WAITED,
+                timeout != nullptr ? &ts : nullptr, nullptr, 0);
+    }
+
+    void wakeAll()
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+#else
+    // Sleepers share a few condition variables, so that the event itself stays one word
+    struct Bucket
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+
+    Bucket &bucket() const
+    {
+        static Bucket buckets[64];
+        return buckets[(reinterpret_cast<uintptr_t>(this) >> 4) % 64];
+    }
+
+    void sleep(const std::chrono::steady_clock::duration *timeout)
+    {
+        Bucket &b = bucket();
+        std::unique_lock<std::mutex> lock(b.mtx);
+        if (state_.load(std::memory_order_acquire) != WAITED)
+            return;
+        if (timeout != nullptr)
+            b.cv.wait_for(lock, *timeout);
+        else
+            b.cv.wait(lock);
+    }
+
+    void wakeAll()
+    {
+        Bucket &b = bucket();
+        std::lock_guard<std::mutex> lock(b.mtx);
+        b.cv.notify_all();
+    }
+#endif
+
+private:
+    std::atomic<uint32_t> state_;
+};
+
+#endif
\ No newline at end of file
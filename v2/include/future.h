@@ -0,0 +1,541 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "event.h"
+#include "slabpool.h"
+#include "task.h"
+
+/*
+ * Where the continuations of a future run, see Future::then()
+ * A type-erased pointer to the pool that made the future, so that futures do not depend on the pool.
+ * Without one, continuations run on the thread that completes the future.
+ * */
+class Executor
+{
+public:
+    // Operations of the owner, one static table per owner type
+    struct Ops
+    {
+        void (*submit)(void *owner, Task &&task);
+        bool (*help)(void *owner);
+        bool (*isWorker)(void *owner);
+    };
+
+    Executor() : owner_(nullptr), ops_(nullptr) {}
+    Executor(void *owner, const Ops *ops) : owner_(owner), ops_(ops) {}
+
+    void execute(Task &&task) const
+    {
+        if (ops_ != nullptr)
+            ops_->submit(owner_, std::move(task));
+        else
+            task();
+    }
+
+    // Run one queued task on the calling thread if it is a worker of the pool, false otherwise or
+    // when nothing is queued. Lets a worker waiting for a future keep working instead of blocking.
+    bool help() const { return ops_ != nullptr && ops_->help(owner_); }
+
+    // Whether the calling thread is a worker of the pool
+    bool isWorker() const { return ops_ != nullptr && ops_->isWorker(owner_); }
+
+private:
+    void *owner_;
+    const Ops *ops_;
+};
+
+/*
+ * Shared state between a submitted task and its Future
+ * States come from a SlabPool, so submitting a task does not allocate one from the heap.
+ * The state is owned by two references, the Promise inside the task and the Future.
+ * */
+template <typename T>
+class FutureState
+{
+public:
+    static FutureState *create(Executor executor = Executor()) { return SlabPool<FutureState>::instance().create(executor); }
+
+    explicit FutureState(Executor executor = Executor())
+        : refs_(2), callbackState_(CallbackState::NONE), post_(false), claimed_(true), executor_(executor) {}
+
+    // The task producing the result, see ThreadPool::submitTask(). The pool queues a PendingRun and
+    // a worker waiting for the result may run the body itself first, whoever claims it first runs it.
+    void setPending(Task &&body)
+    {
+        body_ = std::move(body);
+        claimed_.store(false, std::memory_order_release);
+    }
+
+    // Run the body if nobody has claimed it yet
+    void runPending()
+    {
+        if (claimed_.load(std::memory_order_relaxed) || claimed_.exchange(true, std::memory_order_acq_rel))
+            return;
+        Task body = std::move(body_);
+        body();
+    }
+
+    // Destroy the body if nobody has claimed it, breaking its promise
+    void dropPending()
+    {
+        if (claimed_.load(std::memory_order_relaxed) || claimed_.exchange(true, std::memory_order_acq_rel))
+            return;
+        Task body = std::move(body_);
+    }
+
+    void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    template <typename... V>
+    void setValue(V &&...value)
+    {
+        if constexpr (!std::is_void<T>::value)
+            value_.emplace(std::forward<V>(value)...);
+        markReady();
+    }
+
+    void setException(std::exception_ptr error)
+    {
+        error_ = std::move(error);
+        markReady();
+    }
+
+    bool isReady() const { return ready_.isSet(); }
+
+    const Executor &executor() const { return executor_; }
+
+    // Call func once the state is ready, at once if it already is. With post, func is queued on the
+    // executor, otherwise it runs on the thread that completes the state. One callback per state.
+    void onReady(Task &&func, bool post)
+    {
+        if (!isReady())
+        {
+            callback_ = std::move(func);
+            post_ = post;
+            CallbackState expected = CallbackState::NONE;
+            if (callbackState_.compare_exchange_strong(expected, CallbackState::SET, std::memory_order_acq_rel))
+                return;
+            // markReady() got there first, it leaves the callback to us
+            func = std::move(callback_);
+        }
+        dispatch(std::move(func), post, executor_);
+    }
+
+    // A worker of the pool does not just block, which would deadlock a pool whose workers all wait
+    // for nested tasks: it runs the awaited task itself if nobody has started it, then other queued
+    // tasks until the result is ready. What it still waits for is running on another thread.
+    void wait()
+    {
+        if (!isReady() && executor_.isWorker())
+        {
+            runPending();
+            while (!isReady() && executor_.help())
+            {
+            }
+        }
+        ready_.wait();
+    }
+
+    template <typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        return ready_.waitFor(timeout);
+    }
+
+    // Move the result out, rethrowing the task's exception if it failed
+    T take()
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+        if constexpr (!std::is_void<T>::value)
+            return static_cast<T>(std::move(*value_));
+    }
+
+    void release()
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            SlabPool<FutureState>::instance().destroy(this);
+    }
+
+private:
+    // The producer still holds its reference here, so the state outlives the callback dispatch
+    void markReady()
+    {
+        ready_.set();
+        if (callbackState_.exchange(CallbackState::READY, std::memory_order_acq_rel) == CallbackState::SET)
+            dispatch(std::move(callback_), post_, executor_);
+    }
+
+    static void dispatch(Task &&func, bool post, const Executor &executor)
+    {
+        if (post)
+            executor.execute(std::move(func));
+        else
+            func();
+    }
+
+    // References are kept as reference_wrapper, void results store nothing
+    using Stored = std::conditional_t<std::is_reference<T>::value,
+                                      std::reference_wrapper<std::remove_reference_t<T>>,
+                                      std::conditional_t<std::is_void<T>::value, bool, T>>;
+
+private:
+    // Handshake between onReady() and markReady(): whoever moves it second runs the callback
+    enum class CallbackState : uint8_t
+    {
+        NONE,  // No callback, not ready
+        SET,   // callback_ is set, not ready
+        READY, // Ready, a callback set from now on runs at once
+    };
+
+    std::atomic_int refs_;
+    Event ready_;
+    std::optional<Stored> value_;
+    std::exception_ptr error_;
+    std::atomic<CallbackState> callbackState_;
+    Task callback_;           // Set by onReady() before the state is ready
+    bool post_;               // Queue callback_ on executor_ rather than run it inline
+    Task body_;               // Set by setPending(), taken by the thread that claims it
+    std::atomic_bool claimed_; // body_ is empty or taken
+    Executor executor_;
+};
+
+// Queued in place of a submitted task, runs the body kept in the state unless a waiter already did
+template <typename T>
+class PendingRun
+{
+public:
+    explicit PendingRun(FutureState<T> *state) : state_(state) { state_->retain(); }
+    PendingRun(PendingRun &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    PendingRun &operator=(PendingRun &&) = delete;
+    PendingRun(const PendingRun &) = delete;
+
+    ~PendingRun()
+    {
+        if (state_ != nullptr)
+        {
+            state_->dropPending();
+            state_->release();
+        }
+    }
+
+    void operator()() { state_->runPending(); }
+
+private:
+    FutureState<T> *state_;
+};
+
+// Result of a continuation taking the value of a Future<T>, or nothing for Future<void>
+template <typename T, typename F>
+struct ThenResult
+{
+    using type = std::invoke_result_t<F, T>;
+};
+
+template <typename F>
+struct ThenResult<void, F>
+{
+    using type = std::invoke_result_t<F>;
+};
+
+template <typename T>
+class FutureJoin;
+
+/*
+ * Producer side of a FutureState, carried inside the task
+ * If the task is destroyed without running (e.g. the pool shuts down), the Future receives
+ * std::future_error(broken_promise), the same as with std::packaged_task.
+ * */
+template <typename T>
+class Promise
+{
+public:
+    explicit Promise(FutureState<T> *state) : state_(state) {}
+    Promise(Promise &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    Promise &operator=(Promise &&) = delete;
+    Promise(const Promise &) = delete;
+
+    ~Promise()
+    {
+        if (state_ != nullptr)
+        {
+            state_->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            state_->release();
+        }
+    }
+
+    // Run func and publish its result or its exception
+    template <typename F>
+    void run(F &&func)
+    {
+        try
+        {
+            if constexpr (std::is_void<T>::value)
+            {
+                func();
+                state_->setValue();
+            }
+            else
+            {
+                state_->setValue(func());
+            }
+        }
+        catch (...)
+        {
+            state_->setException(std::current_exception());
+        }
+        std::exchange(state_, nullptr)->release();
+    }
+
+    // Publish error without running anything, e.g. for a task dropped by its worker
+    void fail(std::exception_ptr error)
+    {
+        state_->setException(std::move(error));
+        std::exchange(state_, nullptr)->release();
+    }
+
+private:
+    FutureState<T> *state_;
+};
+
+// Consumer side of a FutureState, a move-only replacement for std::future
+template <typename T>
+class Future
+{
+public:
+    Future() : state_(nullptr) {}
+    explicit Future(FutureState<T> *state) : state_(state) {}
+    Future(Future &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+    Future &operator=(Future &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            state_ = std::exchange(other.state_, nullptr);
+        }
+        return *this;
+    }
+    Future(const Future &) = delete;
+    Future &operator=(const Future &) = delete;
+    ~Future() { reset(); }
+
+    bool valid() const { return state_ != nullptr; }
+
+    void wait() const { state_->wait(); }
+
+    template <typename Rep, typename Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period> &timeout) const
+    {
+        return state_->waitFor(timeout) ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    // Run func on the result once it is ready, as a new task on the pool that made this future. The
+    // worker that completes the future queues it, nobody blocks waiting. When the future holds an
+    // exception func is skipped and the exception goes to the returned future. This Future is
+    // invalid afterwards, and the pool must still exist when func gets queued.
+    template <typename F>
+    auto then(F &&func) -> Future<typename ThenResult<T, std::decay_t<F> &>::type>
+    {
+        using U = typename ThenResult<T, std::decay_t<F> &>::type;
+        if (!valid())
+            throw std::future_error(std::future_errc::no_state);
+        FutureState<T> *state = state_;
+        FutureState<U> *next = FutureState<U>::create(state->executor());
+        Future<U> result(next);
+        state->onReady([upstream = std::move(*this), promise = Promise<U>(next), func = std::forward<F>(func)]() mutable
+                       { promise.run([&]() -> U
+                                     {
+                                         if constexpr (std::is_void<T>::value)
+                                         {
+                                             upstream.get();
+                                             return func();
+                                         }
+                                         else
+                                         {
+                                             return func(upstream.get());
+                                         } }); },
+                       true);
+        return result;
+    }
+
+    // Wait for the result and move it out, the Future is invalid afterwards
+    T get()
+    {
+        if (!valid())
+            throw std::future_error(std::future_errc::no_state);
+        state_->wait();
+        FutureState<T> *state = std::exchange(state_, nullptr);
+        struct Release
+        {
+            FutureState<T> *state;
+            ~Release() { state->release(); }
+        } guard{state};
+        return state->take();
+    }
+
+    // A Future can be co_await'ed (see coroutine.h): the coroutine is resumed on the pool that made
+    // the future once the result is ready, instead of blocking a thread in get()
+    bool await_ready() const { return state_->isReady(); }
+
+    template <typename Handle>
+    void await_suspend(Handle handle)
+    {
+        state_->onReady([handle]() mutable
+                        { handle.resume(); },
+                        true);
+    }
+
+    T await_resume() { return get(); }
+
+private:
+    template <typename U>
+    friend class FutureJoin;
+
+    void reset()
+    {
+        if (state_ != nullptr)
+            std::exchange(state_, nullptr)->release();
+    }
+
+private:
+    FutureState<T> *state_;
+};
+
+// A Future that already holds value, used when a task could not be queued
+template <typename T, typename... V>
+Future<T> makeReadyFuture(V &&...value)
+{
+    FutureState<T> *state = FutureState<T>::create();
+    Promise<T> promise(state);
+    promise.run([&]() -> T
+                { return T(std::forward<V>(value)...); });
+    return Future<T>(state);
+}
+
+/*
+ * Combinators of when_all() and when_any()
+ * Every input future gets a callback run inline by the thread that completes it: the last one
+ * (when_all) or the first one (when_any) completes the combined future. No thread waits.
+ * */
+template <typename T>
+class FutureJoin
+{
+public:
+    using AllResult = std::conditional_t<std::is_void<T>::value, void, std::vector<T>>;
+    using AnyResult = std::conditional_t<std::is_void<T>::value, size_t, std::pair<size_t, T>>;
+
+    static Future<AllResult> all(std::vector<Future<T>> futures)
+    {
+        FutureState<AllResult> *state = FutureState<AllResult>::create(executorOf(futures));
+        Future<AllResult> result(state);
+        auto join = std::make_shared<Join<AllResult>>(std::move(futures), state);
+        if (join->futures.empty())
+        {
+            complete(*join);
+            return result;
+        }
+        for (auto &future : join->futures)
+        {
+            future.state_->onReady([join]()
+                                   {
+                                       if (join->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                                           complete(*join); },
+                                   false);
+        }
+        return result;
+    }
+
+    static Future<AnyResult> any(std::vector<Future<T>> futures)
+    {
+        if (futures.empty())
+            throw std::invalid_argument("when_any needs at least one future");
+        FutureState<AnyResult> *state = FutureState<AnyResult>::create(executorOf(futures));
+        Future<AnyResult> result(state);
+        auto join = std::make_shared<Join<AnyResult>>(std::move(futures), state);
+        for (size_t i = 0; i < join->futures.size(); ++i)
+        {
+            join->futures[i].state_->onReady([join, i]()
+                                             {
+                                                 // Only the first one to complete counts
+                                                 if (join->remaining.exchange(0, std::memory_order_acq_rel) != 0)
+                                                     join->promise.run([&]() -> AnyResult
+                                                                       {
+                                                                           if constexpr (std::is_void<T>::value)
+                                                                           {
+                                                                               join->futures[i].get();
+                                                                               return i;
+                                                                           }
+                                                                           else
+                                                                           {
+                                                                               return AnyResult(i, join->futures[i].get());
+                                                                           } }); },
+                                             false);
+        }
+        return result;
+    }
+
+private:
+    // The inputs, kept until the callbacks have all run
+    template <typename R>
+    struct Join
+    {
+        Join(std::vector<Future<T>> &&f, FutureState<R> *state)
+            : futures(std::move(f)), remaining(futures.size()), promise(state) {}
+
+        std::vector<Future<T>> futures;
+        std::atomic<size_t> remaining;
+        Promise<R> promise;
+    };
+
+    // Continuations of the combined future run where those of the inputs would
+    static Executor executorOf(const std::vector<Future<T>> &futures)
+    {
+        return futures.empty() || !futures.front().valid() ? Executor() : futures.front().state_->executor();
+    }
+
+    // Every input is ready: collect the values, the first input that failed makes the whole fail
+    static void complete(Join<AllResult> &join)
+    {
+        join.promise.run([&]() -> AllResult
+                         {
+                             if constexpr (std::is_void<T>::value)
+                             {
+                                 for (auto &future : join.futures)
+                                     future.get();
+                             }
+                             else
+                             {
+                                 AllResult values;
+                                 values.reserve(join.futures.size());
+                                 for (auto &future : join.futures)
+                                     values.push_back(future.get());
+                                 return values;
+                             } });
+    }
+};
+
+// A future of every result, in the order of the inputs, ready once all the inputs are
+template <typename T>
+Future<typename FutureJoin<T>::AllResult> when_all(std::vector<Future<T>> futures)
+{
+    return FutureJoin<T>::all(std::move(futures));
+}
+
+// A future of the index (and the result) of the first input to be ready
+template <typename T>
+Future<typename FutureJoin<T>::AnyResult> when_any(std::vector<Future<T>> futures)
+{
+    return FutureJoin<T>::any(std::move(futures));
+}
+
+#endif
\ No newline at end of file
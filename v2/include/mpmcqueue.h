@@ -0,0 +1,128 @@
+#ifndef MPMCQUEUE_H
+#define MPMCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/*
+ * Bounded lock-free multi-producer multi-consumer ring buffer (D. Vyukov's design)
+ * Every slot carries a sequence number that tells producers and consumers whose turn it is,
+ * so a push or a pop costs one CAS on the shared position and no lock.
+ * The capacity is rounded up to a power of two.
+ * */
+template <typename T>
+class MpmcQueue
+{
+public:
+    explicit MpmcQueue(size_t capacity)
+        : capacity_(roundUp(capacity)),
+          mask_(capacity_ - 1),
+          slots_(new Slot[capacity_]),
+          enqueuePos_(0),
+          dequeuePos_(0)
+    {
+        for (size_t i = 0; i < capacity_; ++i)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    // Returns false when the queue is full, item is only moved from on success
+    bool push(T &&item)
+    {
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &slots_[pos & mask_];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // The slot still holds an item from the previous lap
+            }
+            else
+            {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->data = std::move(item);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false when the queue is empty
+    bool pop(T &item)
+    {
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &slots_[pos & mask_];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // No producer has filled this slot yet
+            }
+            else
+            {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(slot->data);
+        slot->data = T();
+        slot->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate number of items, only exact when the queue is quiescent
+    size_t size() const
+    {
+        size_t enq = enqueuePos_.load(std::memory_order_relaxed);
+        size_t deq = dequeuePos_.load(std::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return capacity_; }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    static size_t roundUp(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+private:
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> enqueuePos_; // Producers claim slots here
+    alignas(64) std::atomic<size_t> dequeuePos_; // Consumers claim slots here
+    char pad_[64 - sizeof(std::atomic<size_t>)]; // Keep whatever follows off the consumers' line
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,273 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+#include "threadpool.h"
+
+/*
+ * Parallel algorithms on top of ThreadPool
+ * The range is cut into contiguous chunks. The calling thread and up to one helper task per
+ * pool thread claim chunks from a shared cursor with guided self-scheduling: chunks start at
+ * remaining / (2 * participants) elements and shrink down to the grain size towards the end,
+ * which keeps the claims few while still balancing uneven work.
+ * The caller only waits for chunks that were claimed, never for helpers that have not started,
+ * so the algorithms can be used from inside a task without deadlocking a busy pool.
+ * grain = 0 picks a grain from the range size, with at least PARALLEL_AUTO_GRAIN elements per
+ * chunk. Pass an explicit grain (e.g. 1) for expensive elements.
+ * */
+
+const size_t PARALLEL_AUTO_GRAIN = 1024;
+
+// State shared by the caller and the helper tasks of one parallel loop
+class ParallelLoop
+{
+public:
+    ParallelLoop(size_t size, size_t grain, size_t participants)
+        : next_(0), size_(size), grain_(grain), participants_(participants), pending_(size), failed_(false) {}
+
+    // Claim the next chunk [first, last), false once the range is exhausted
+    bool claim(size_t &first, size_t &last)
+    {
+        size_t cur = next_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (cur >= size_)
+                return false;
+            size_t chunk = std::max(grain_, (size_ - cur) / (2 * participants_));
+            size_t end = std::min(size_, cur + chunk);
+            if (next_.compare_exchange_weak(cur, end, std::memory_order_relaxed))
+            {
+                first = cur;
+                last = end;
+                return true;
+            }
+        }
+    }
+
+    // A chunk threw: keep the first exception and give up the chunks nobody claimed yet
+    void fail(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!failed_)
+            {
+                failed_ = true;
+                error_ = std::move(error);
+            }
+        }
+        size_t cur = next_.exchange(size_, std::memory_order_relaxed);
+        if (cur < size_)
+            finish(size_ - cur);
+    }
+
+    // count elements were processed (or skipped after a failure)
+    void finish(size_t count)
+    {
+        if (count == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        pending_ -= count;
+        if (pending_ == 0)
+            cv_.notify_all();
+    }
+
+    // Wait for every claimed chunk, then rethrow the first exception
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&]() -> bool
+                 { return pending_ == 0; });
+        if (failed_)
+            std::rethrow_exception(error_);
+    }
+
+private:
+    std::atomic<size_t> next_; // First element nobody has claimed
+    const size_t size_;
+    const size_t grain_;
+    const size_t participants_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    size_t pending_; // Elements not processed yet
+    bool failed_;
+    std::exception_ptr error_;
+};
+
+/*
+ * Run body(first, last, slot) over [0, size) split in chunks
+ * slot identifies the participant (0 is the caller), so bodies can keep per-participant state
+ * in an array of participantCount() entries.
+ * */
+template <typename Body>
+void parallelRun(ThreadPool &pool, size_t size, size_t grain, size_t participants, Body &body)
+{
+    if (participants <= 1)
+    {
+        if (size > 0)
+            body(size_t(0), size, size_t(0));
+        return;
+    }
+
+    auto loop = std::make_shared<ParallelLoop>(size, grain, participants);
+    // Helpers that start after the range is exhausted only touch loop, never body
+    auto work = [loop, &body](size_t slot)
+    {
+        size_t first = 0, last = 0;
+        while (loop->claim(first, last))
+        {
+            try
+            {
+                body(first, last, slot);
+            }
+            catch (...)
+            {
+                loop->fail(std::current_exception());
+            }
+            loop->finish(last - first);
+        }
+    };
+
+    pool.submitBulk(participants - 1, [work](size_t i)
+                    { work(i + 1); });
+    work(0);
+    loop->wait();
+}
+
+// Grain actually used and number of participants (caller included) for a range of size elements
+inline size_t parallelGrain(ThreadPool &pool, size_t size, size_t grain)
+{
+    if (grain != 0)
+        return grain;
+    size_t threads = pool.getThreadSize() + 1;
+    return std::max(PARALLEL_AUTO_GRAIN, size / (threads * 16));
+}
+
+inline size_t participantCount(ThreadPool &pool, size_t size, size_t grain)
+{
+    // Tiny ranges are not worth a single helper task
+    size_t chunks = (size + grain - 1) / grain;
+    return std::min(pool.getThreadSize() + 1, chunks);
+}
+
+// fn(i) for every i in [begin, end)
+template <typename Index, typename Func>
+void parallel_for(ThreadPool &pool, Index begin, Index end, size_t grain, Func &&fn)
+{
+    static_assert(std::is_integral<Index>::value, "parallel_for iterates over an integer range");
+    if (end <= begin)
+        return;
+    size_t size = static_cast<size_t>(end - begin);
+    grain = parallelGrain(pool, size, grain);
+
+    auto body = [&](size_t first, size_t last, size_t)
+    {
+        for (size_t i = first; i < last; ++i)
+            fn(static_cast<Index>(begin + static_cast<Index>(i)));
+    };
+    parallelRun(pool, size, grain, participantCount(pool, size, grain), body);
+}
+
+/*
+ * Fold map(i) for every i in [begin, end) with reduce, starting from identity
+ * Partial results are combined in an unspecified order, so reduce must be associative
+ * and commutative, and identity must be its neutral element.
+ * */
+template <typename Index, typename T, typename Map, typename Reduce>
+T parallel_reduce(ThreadPool &pool, Index begin, Index end, size_t grain, T identity, Map &&map, Reduce &&reduce)
+{
+    static_assert(std::is_integral<Index>::value, "parallel_reduce iterates over an integer range");
+    if (end <= begin)
+        return identity;
+    size_t size = static_cast<size_t>(end - begin);
+    grain = parallelGrain(pool, size, grain);
+    size_t participants = participantCount(pool, size, grain);
+
+    // One partial per participant, each on its own cache line
+    struct alignas(64) Partial
+    {
+        T value;
+    };
+    std::vector<Partial> partials(participants, Partial{identity});
+
+    auto body = [&](size_t first, size_t last, size_t slot)
+    {
+        T acc = partials[slot].value;
+        for (size_t i = first; i < last; ++i)
+            acc = reduce(acc, map(static_cast<Index>(begin + static_cast<Index>(i))));
+        partials[slot].value = acc;
+    };
+    parallelRun(pool, size, grain, participants, body);
+
+    T result = identity;
+    for (auto &partial : partials)
+        result = reduce(result, partial.value);
+    return result;
+}
+
+// d_first[i] = op(first[i]) for every element of [first, last), returns the end of the output
+template <typename InputIt, typename OutputIt, typename UnaryOp>
+OutputIt parallel_transform(ThreadPool &pool, InputIt first, InputIt last, OutputIt d_first, UnaryOp &&op, size_t grain = 0)
+{
+    size_t size = static_cast<size_t>(std::distance(first, last));
+    grain = parallelGrain(pool, size, grain);
+
+    auto body = [&](size_t lo, size_t hi, size_t)
+    {
+        InputIt in = first + lo;
+        OutputIt out = d_first + lo;
+        for (size_t i = lo; i < hi; ++i)
+            *out++ = op(*in++);
+    };
+    parallelRun(pool, size, grain, participantCount(pool, size, grain), body);
+    return d_first + size;
+}
+
+/*
+ * Sort [first, last): every participant sorts a contiguous block, then the blocks are merged
+ * pairwise, each round of merges running in parallel
+ * */
+template <typename RandomIt, typename Compare = std::less<>>
+void parallel_sort(ThreadPool &pool, RandomIt first, RandomIt last, Compare comp = Compare())
+{
+    size_t size = static_cast<size_t>(std::distance(first, last));
+    size_t grain = parallelGrain(pool, size, 0);
+    size_t blocks = participantCount(pool, size, grain);
+    if (blocks <= 1)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    // Block i is [bounds[i], bounds[i + 1])
+    std::vector<size_t> bounds(blocks + 1);
+    for (size_t i = 0; i <= blocks; ++i)
+        bounds[i] = size * i / blocks;
+
+    parallel_for(pool, size_t(0), blocks, 1, [&](size_t i)
+                 { std::sort(first + bounds[i], first + bounds[i + 1], comp); });
+
+    for (size_t width = 1; width < blocks; width *= 2)
+    {
+        size_t merges = (blocks + 2 * width - 1) / (2 * width);
+        parallel_for(pool, size_t(0), merges, 1, [&](size_t m)
+                     {
+                         size_t lo = m * 2 * width;
+                         size_t mid = std::min(lo + width, blocks);
+                         size_t hi = std::min(lo + 2 * width, blocks);
+                         if (mid < hi)
+                             std::inplace_merge(first + bounds[lo], first + bounds[mid], first + bounds[hi], comp); });
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+#ifndef PRIORITYQUEUE_H
+#define PRIORITYQUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "mpmcqueue.h"
+#include "task.h"
+
+const size_t PRIORITY_MAX_LEVELS = 64;
+const unsigned PRIORITY_AGING_ROUNDS = 32;
+
+/*
+ * Anti-starvation rule shared by the multi-level queues
+ * The most urgent non-empty level is served first. Every time a level with tasks is passed
+ * over it earns a credit; after agingRounds credits it is served once ahead of the more
+ * urgent levels, so a waiting level gets at least one task out of every agingRounds + 1 pops.
+ * Credits are relaxed atomics: consumers of the lock-free queue may race on them, which only
+ * shifts an aged pop by a round or so.
+ * */
+class PriorityAging
+{
+public:
+    PriorityAging(size_t levels, unsigned agingRounds)
+        : credits_(new std::atomic<unsigned>[levels]), levels_(levels), agingRounds_(agingRounds)
+    {
+        for (size_t i = 0; i < levels; ++i)
+            credits_[i].store(0, std::memory_order_relaxed);
+    }
+
+    // Level to serve among the non-empty levels of mask (bit i = level i), mask must not be 0
+    size_t choose(uint64_t mask)
+    {
+        size_t top = static_cast<size_t>(__builtin_ctzll(mask));
+        credits_[top].store(0, std::memory_order_relaxed);
+        // At most PRIORITY_MAX_LEVELS levels to walk, so a pop stays constant time
+        for (uint64_t rest = mask & (mask - 1); rest != 0; rest &= rest - 1)
+        {
+            size_t level = static_cast<size_t>(__builtin_ctzll(rest));
+            if (credits_[level].fetch_add(1, std::memory_order_relaxed) >= agingRounds_)
+            {
+                credits_[level].store(0, std::memory_order_relaxed);
+                return level;
+            }
+        }
+        return top;
+    }
+
+    size_t levels() const { return levels_; }
+
+private:
+    std::unique_ptr<std::atomic<unsigned>[]> credits_; // Times each level was passed over
+    size_t levels_;
+    unsigned agingRounds_;
+};
+
+/*
+ * FIFO per priority level, level 0 is the most urgent
+ * Not synchronized, the pool guards it with the lock of its shard. nonEmpty() may be read without the lock.
+ * */
+template <typename T>
+class MultiLevelQueue
+{
+public:
+    MultiLevelQueue(size_t levels, unsigned agingRounds)
+        : queues_(levels), aging_(levels, agingRounds), mask_(0), size_(0) {}
+
+    void push(size_t level, T &&item)
+    {
+        queues_[level].push_back(std::move(item));
+        mask_.store(mask_.load(std::memory_order_relaxed) | (uint64_t(1) << level), std::memory_order_relaxed);
+        ++size_;
+    }
+
+    template <typename... Args>
+    void emplace(size_t level, Args &&...args)
+    {
+        queues_[level].emplace_back(std::forward<Args>(args)...);
+        mask_.store(mask_.load(std::memory_order_relaxed) | (uint64_t(1) << level), std::memory_order_relaxed);
+        ++size_;
+    }
+
+    bool pop(T &item)
+    {
+        uint64_t mask = mask_.load(std::memory_order_relaxed);
+        if (mask == 0)
+            return false;
+        size_t level = aging_.choose(mask);
+        auto &queue = queues_[level];
+        item = std::move(queue.front());
+        queue.pop_front();
+        if (queue.empty())
+            mask_.store(mask & ~(uint64_t(1) << level), std::memory_order_relaxed);
+        --size_;
+        return true;
+    }
+
+    // Take the newest item of the most urgent level, ignoring aging. A worker waiting for a result
+    // helps with it: the newest items are the ones its own nested submissions queued last.
+    bool popNewest(T &item)
+    {
+        uint64_t mask = mask_.load(std::memory_order_relaxed);
+        if (mask == 0)
+            return false;
+        size_t level = static_cast<size_t>(__builtin_ctzll(mask));
+        auto &queue = queues_[level];
+        item = std::move(queue.back());
+        queue.pop_back();
+        if (queue.empty())
+            mask_.store(mask & ~(uint64_t(1) << level), std::memory_order_relaxed);
+        --size_;
+        return true;
+    }
+
+    // Take the oldest item of the least urgent level that is not more urgent than level
+    bool evict(size_t level, T &item)
+    {
+        uint64_t mask = mask_.load(std::memory_order_relaxed) >> level << level;
+        if (mask == 0)
+            return false;
+        size_t victim = 63 - static_cast<size_t>(__builtin_clzll(mask));
+        auto &queue = queues_[victim];
+        item = std::move(queue.front());
+        queue.pop_front();
+        if (queue.empty())
+            mask_.store(mask_.load(std::memory_order_relaxed) & ~(uint64_t(1) << victim), std::memory_order_relaxed);
+        --size_;
+        return true;
+    }
+
+    // Bit i is set when level i has tasks
+    uint64_t nonEmpty() const { return mask_.load(std::memory_order_relaxed); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    std::vector<CircularBuffer<T>> queues_;
+    PriorityAging aging_;
+    std::atomic<uint64_t> mask_;
+    size_t size_;
+};
+
+/*
+ * Lock-free ring per priority level, level 0 is the most urgent
+ * Each level is a bounded MpmcQueue of the given capacity.
+ * */
+template <typename T>
+class MultiLevelRing
+{
+public:
+    MultiLevelRing(size_t levels, size_t capacity, unsigned agingRounds)
+        : aging_(levels, agingRounds)
+    {
+        for (size_t i = 0; i < levels; ++i)
+            rings_.emplace_back(std::make_unique<MpmcQueue<T>>(capacity));
+    }
+
+    // Returns false when the ring of level is full, item is only moved from on success
+    bool push(size_t level, T &&item) { return rings_[level]->push(std::move(item)); }
+
+    bool pop(T &item)
+    {
+        uint64_t mask = nonEmpty();
+        if (mask == 0)
+            return false;
+        if (rings_[aging_.choose(mask)]->pop(item))
+            return true;
+        // Another consumer emptied the chosen level first, take whatever is most urgent
+        for (auto &ring : rings_)
+        {
+            if (ring->pop(item))
+                return true;
+        }
+        return false;
+    }
+
+    // Take the oldest item of the least urgent level that is not more urgent than level
+    bool evict(size_t level, T &item)
+    {
+        for (size_t i = rings_.size(); i-- > level;)
+        {
+            if (rings_[i]->pop(item))
+                return true;
+        }
+        return false;
+    }
+
+    uint64_t nonEmpty() const
+    {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < rings_.size(); ++i)
+        {
+            if (!rings_[i]->empty())
+                mask |= uint64_t(1) << i;
+        }
+        return mask;
+    }
+
+    size_t size() const
+    {
+        size_t size = 0;
+        for (auto &ring : rings_)
+            size += ring->size();
+        return size;
+    }
+
+    bool empty() const
+    {
+        for (auto &ring : rings_)
+        {
+            if (!ring->empty())
+                return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::unique_ptr<MpmcQueue<T>>> rings_;
+    PriorityAging aging_;
+};
+
+#endif
\ No newline at end of file
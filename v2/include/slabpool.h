@@ -0,0 +1,402 @@
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include "stats.h"
+
+// Counters of one SlabPool, see SlabPool::stats() and allocatorStats()
+struct SlabStats
+{
+    const char *type;       // typeid name of the pooled type
+    size_t objectSize;      // Bytes taken by one object in a slab
+    uint64_t slabs;         // Slabs allocated, they are kept until the process exits
+    uint64_t reservedBytes; // Memory held by those slabs
+    uint64_t heaps;         // Per-thread heaps, a heap outlives its thread and is adopted by a later one
+    uint64_t allocations;   // Objects handed out
+    uint64_t localFrees;    // Objects released on the thread that owns their slab
+    uint64_t remoteFrees;   // Objects released on another thread, handed back to the owner in batches
+    uint64_t remoteBatches; // Batches pushed to an owning heap
+    uint64_t reclaims;      // Times a heap took back the objects other threads had freed
+    uint64_t live;          // Objects handed out and not released yet
+};
+
+// Every SlabPool registers itself here, so that allocatorStats() can report all of them
+class SlabPoolBase
+{
+public:
+    virtual SlabStats stats() const = 0;
+
+    // Never destroyed, like the pools themselves
+    static std::mutex &registryMtx()
+    {
+        static std::mutex *mtx = new std::mutex();
+        return *mtx;
+    }
+
+    static std::vector<SlabPoolBase *> &registry()
+    {
+        static std::vector<SlabPoolBase *> *pools = new std::vector<SlabPoolBase *>();
+        return *pools;
+    }
+
+protected:
+    SlabPoolBase()
+    {
+        std::lock_guard<std::mutex> lock(registryMtx());
+        registry().push_back(this);
+    }
+    ~SlabPoolBase() = default;
+};
+
+// Counters of every SlabPool in use: task nodes, closures, future and batch states
+inline std::vector<SlabStats> allocatorStats()
+{
+    std::lock_guard<std::mutex> lock(SlabPoolBase::registryMtx());
+    std::vector<SlabStats> all;
+    for (SlabPoolBase *pool : SlabPoolBase::registry())
+        all.push_back(pool->stats());
+    return all;
+}
+
+/*
+ * Fixed-size object pool for objects of type T, with one heap per thread
+ * Memory is carved out of slabs, each owned by the heap of the thread that allocated it. A thread
+ * allocates from and frees to its own heap without any atomic operation. An object freed on
+ * another thread, typically a task made by a producer and released by a worker, is batched with
+ * the other objects that thread frees for the same owner, and the batch is pushed onto the
+ * owner's remote list with one CAS. The owner takes the whole list back with one exchange when
+ * its own free list runs dry. A heap whose thread exits is kept and adopted by the next thread,
+ * so the threads a cached pool adds and retires reuse the same memory.
+ * Once the heaps have grown to the working set, allocating and releasing never call malloc.
+ * */
+template <typename T>
+class SlabPool : public SlabPoolBase
+{
+public:
+    static constexpr size_t REMOTE_BATCH = 32; // Remote frees gathered before they are pushed to the owner
+
+    // One pool per type. It is never destroyed, detached workers may still release objects at exit.
+    static SlabPool &instance()
+    {
+        static SlabPool *pool = new SlabPool();
+        return *pool;
+    }
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        void *p = allocate();
+        try
+        {
+            return new (p) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            deallocate(p);
+            throw;
+        }
+    }
+
+    void destroy(T *obj)
+    {
+        obj->~T();
+        deallocate(obj);
+    }
+
+    // Uninitialized storage for one T, for callers that construct something else in it
+    void *allocate()
+    {
+        Heap *heap = localHeap();
+        if (heap == nullptr)
+        {
+            // The thread is exiting and has given its heap up: borrow one for this object
+            heap = adopt();
+            void *p = allocateFrom(*heap);
+            abandon(heap);
+            return p;
+        }
+        return allocateFrom(*heap);
+    }
+
+    void deallocate(void *p)
+    {
+        Node *node = static_cast<Node *>(p);
+        Heap *owner = slabOf(node)->owner;
+        Heap *heap = localHeap();
+        if (heap == owner)
+        {
+            node->next = heap->local;
+            heap->local = node;
+            addRelaxed(heap->localFrees, 1);
+            return;
+        }
+        if (heap == nullptr)
+        {
+            exitFrees_.fetch_add(1, std::memory_order_relaxed);
+            pushRemote(*owner, node, node);
+            return;
+        }
+
+        addRelaxed(heap->remoteFrees, 1);
+        if (heap->batchOwner != owner)
+        {
+            flushBatch(*heap);
+            heap->batchOwner = owner;
+        }
+        node->next = heap->batchHead;
+        heap->batchHead = node;
+        if (heap->batchTail == nullptr)
+            heap->batchTail = node;
+        if (++heap->batchSize == REMOTE_BATCH)
+            flushBatch(*heap);
+    }
+
+    SlabStats stats() const override
+    {
+        SlabStats stats{typeid(T).name(), sizeof(Node), 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        std::lock_guard<std::mutex> lock(mtx_);
+        stats.heaps = heaps_.size();
+        for (const Heap *heap : heaps_)
+        {
+            stats.slabs += heap->slabs.load(std::memory_order_relaxed);
+            stats.allocations += heap->allocations.load(std::memory_order_relaxed);
+            stats.localFrees += heap->localFrees.load(std::memory_order_relaxed);
+            stats.remoteFrees += heap->remoteFrees.load(std::memory_order_relaxed);
+            stats.remoteBatches += heap->remoteBatches.load(std::memory_order_relaxed);
+            stats.reclaims += heap->reclaims.load(std::memory_order_relaxed);
+        }
+        stats.remoteFrees += exitFrees_.load(std::memory_order_relaxed);
+        stats.reservedBytes = stats.slabs * SLAB_BYTES;
+        uint64_t freed = stats.localFrees + stats.remoteFrees;
+        stats.live = stats.allocations > freed ? stats.allocations - freed : 0;
+        return stats;
+    }
+
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+private:
+    SlabPool() : abandoned_(nullptr), exitFrees_(0) {}
+
+    union Node
+    {
+        Node *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Heap;
+
+    // Start of every slab, found from any of its objects by masking the address
+    struct Slab
+    {
+        Heap *owner;
+    };
+
+    static constexpr size_t roundUp(size_t n, size_t to) { return (n + to - 1) / to * to; }
+    static constexpr size_t pow2AtLeast(size_t n) { return n <= 1 ? 1 : 2 * pow2AtLeast((n + 1) / 2); }
+
+    static constexpr size_t SLAB_HEADER = roundUp(sizeof(Slab), std::max<size_t>(alignof(Node), 64));
+    // Slabs are aligned to their size, a power of two, and hold at least 32 objects
+    static constexpr size_t SLAB_BYTES = std::max<size_t>(16384, pow2AtLeast(SLAB_HEADER + 32 * sizeof(Node)));
+    static constexpr size_t SLAB_OBJECTS = (SLAB_BYTES - SLAB_HEADER) / sizeof(Node);
+
+    // The heap of one thread. Counters are written by the owner only, read by stats().
+    struct alignas(64) Heap
+    {
+        Heap() : local(nullptr), remote(nullptr), batchOwner(nullptr), batchHead(nullptr), batchTail(nullptr),
+                 batchSize(0), nextAbandoned(nullptr), slabs(0), allocations(0), localFrees(0), remoteFrees(0),
+                 remoteBatches(0), reclaims(0) {}
+
+        Node *local;                // Free objects, owner only
+        std::atomic<Node *> remote; // Objects freed by other threads, pushed in batches
+        Heap *batchOwner;           // Heap the pending batch goes to, owner only
+        Node *batchHead;            // Pending batch of objects freed here for batchOwner, owner only
+        Node *batchTail;
+        size_t batchSize;
+        Heap *nextAbandoned; // Next heap without a thread, protected by mtx_
+
+        std::atomic<uint64_t> slabs;
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> localFrees;
+        std::atomic<uint64_t> remoteFrees;
+        std::atomic<uint64_t> remoteBatches;
+        std::atomic<uint64_t> reclaims;
+    };
+
+    // Gives the heap back to the pool when its thread exits
+    struct HeapRef
+    {
+        HeapRef() : heap(nullptr), exited(false) {}
+        ~HeapRef()
+        {
+            if (heap != nullptr)
+                instance().abandon(heap);
+            heap = nullptr;
+            exited = true;
+        }
+
+        Heap *heap;
+        bool exited;
+    };
+
+    // Heap of the calling thread, nullptr once the thread has started to exit
+    Heap *localHeap()
+    {
+        static thread_local HeapRef ref;
+        if (ref.heap == nullptr && !ref.exited)
+            ref.heap = adopt();
+        return ref.heap;
+    }
+
+    static Slab *slabOf(Node *node)
+    {
+        return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(node) & ~(SLAB_BYTES - 1));
+    }
+
+    void *allocateFrom(Heap &heap)
+    {
+        if (heap.local == nullptr)
+        {
+            heap.local = heap.remote.exchange(nullptr, std::memory_order_acquire);
+            if (heap.local != nullptr)
+                addRelaxed(heap.reclaims, 1);
+            else
+                addSlab(heap);
+        }
+        Node *node = heap.local;
+        heap.local = node->next;
+        addRelaxed(heap.allocations, 1);
+        return node->storage;
+    }
+
+    void addSlab(Heap &heap)
+    {
+        void *memory = ::operator new(SLAB_BYTES, std::align_val_t(SLAB_BYTES));
+        Slab *slab = new (memory) Slab{&heap};
+        Node *nodes = reinterpret_cast<Node *>(reinterpret_cast<unsigned char *>(slab) + SLAB_HEADER);
+        for (size_t i = SLAB_OBJECTS; i > 0; --i)
+        {
+            nodes[i - 1].next = heap.local;
+            heap.local = &nodes[i - 1];
+        }
+        addRelaxed(heap.slabs, 1);
+    }
+
+    void flushBatch(Heap &heap)
+    {
+        if (heap.batchHead == nullptr)
+            return;
+        pushRemote(*heap.batchOwner, heap.batchHead, heap.batchTail);
+        addRelaxed(heap.remoteBatches, 1);
+        heap.batchHead = nullptr;
+        heap.batchTail = nullptr;
+        heap.batchSize = 0;
+    }
+
+    // Push the chain first..last onto the remote list of owner. The owner only ever takes the
+    // whole list, so there is no ABA problem.
+    static void pushRemote(Heap &owner, Node *first, Node *last)
+    {
+        Node *head = owner.remote.load(std::memory_order_relaxed);
+        do
+        {
+            last->next = head;
+        } while (!owner.remote.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // A heap given up by an exited thread, or a new one
+    Heap *adopt()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (abandoned_ != nullptr)
+        {
+            Heap *heap = abandoned_;
+            abandoned_ = heap->nextAbandoned;
+            return heap;
+        }
+        heaps_.push_back(new Heap());
+        return heaps_.back();
+    }
+
+    // The thread of heap exits: its pending batch goes to its owner, its free objects wait for the next thread
+    void abandon(Heap *heap)
+    {
+        flushBatch(*heap);
+        heap->batchOwner = nullptr;
+        std::lock_guard<std::mutex> lock(mtx_);
+        heap->nextAbandoned = abandoned_;
+        abandoned_ = heap;
+    }
+
+private:
+    mutable std::mutex mtx_;      // Protects heaps_ and abandoned_
+    std::vector<Heap *> heaps_;   // Every heap ever made, they are never freed
+    Heap *abandoned_;             // Heaps without a thread, linked through nextAbandoned
+    std::atomic<uint64_t> exitFrees_; // Objects freed by exiting threads, pushed one by one
+};
+
+/*
+ * Pooled storage for callables that do not fit inline in a Task
+ * Sizes are rounded up to a few classes, each served by its own SlabPool, so a closure made by
+ * the producer and released by the worker goes back to the producer's heap instead of through malloc.
+ * */
+template <size_t Size>
+struct ClosureBlock
+{
+    alignas(std::max_align_t) unsigned char bytes[Size];
+};
+
+template <typename Fn>
+class ClosurePool
+{
+public:
+    // Callables bigger than the largest class, or over-aligned ones, still use the heap
+    static constexpr bool POOLED = sizeof(Fn) <= 512 && alignof(Fn) <= alignof(std::max_align_t);
+    static constexpr size_t BLOCK_SIZE = sizeof(Fn) <= 128 ? 128 : sizeof(Fn) <= 256 ? 256 : 512;
+
+    template <typename F>
+    static Fn *create(F &&func)
+    {
+        if constexpr (!POOLED)
+        {
+            return new Fn(std::forward<F>(func));
+        }
+        else
+        {
+            auto &pool = SlabPool<ClosureBlock<BLOCK_SIZE>>::instance();
+            void *p = pool.allocate();
+            try
+            {
+                return new (p) Fn(std::forward<F>(func));
+            }
+            catch (...)
+            {
+                pool.deallocate(p);
+                throw;
+            }
+        }
+    }
+
+    static void destroy(Fn *fn)
+    {
+        if constexpr (!POOLED)
+        {
+            delete fn;
+        }
+        else
+        {
+            fn->~Fn();
+            SlabPool<ClosureBlock<BLOCK_SIZE>>::instance().deallocate(fn);
+        }
+    }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,164 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Add to a counter that only one thread writes: a plain load + store, no locked instruction
+inline void addRelaxed(std::atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*
+ * Log-linear latency histogram in nanoseconds, in the spirit of HdrHistogram
+ * Every power of two is split into SUB_COUNT linear buckets, so any recorded value is known
+ * within 1 / SUB_COUNT (12.5%) of its size, from 1 ns to centuries, in a fixed 4 KB array.
+ * */
+class Histogram
+{
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    Histogram() : counts_{}, total_(0), sum_(0), max_(0) {}
+
+    static int bucketOf(uint64_t ns)
+    {
+        if (ns < SUB_COUNT)
+            return static_cast<int>(ns);
+        int exp = 63 - __builtin_clzll(ns);
+        int sub = static_cast<int>(ns >> (exp - SUB_BITS)) & (SUB_COUNT - 1);
+        return (exp - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t bucketMax(int bucket)
+    {
+        if (bucket < SUB_COUNT)
+            return static_cast<uint64_t>(bucket);
+        int exp = bucket / SUB_COUNT + SUB_BITS - 1;
+        uint64_t sub = static_cast<uint64_t>(bucket % SUB_COUNT);
+        uint64_t low = (SUB_COUNT + sub) << (exp - SUB_BITS);
+        return low + (uint64_t(1) << (exp - SUB_BITS)) - 1;
+    }
+
+    void add(int bucket, uint64_t count) { counts_[bucket] += count; }
+    void addTotals(uint64_t count, uint64_t sum, uint64_t max)
+    {
+        total_ += count;
+        sum_ += sum;
+        max_ = std::max(max_, max);
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (int i = 0; i < BUCKETS; ++i)
+            counts_[i] += other.counts_[i];
+        addTotals(other.total_, other.sum_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ == 0 ? 0.0 : static_cast<double>(sum_) / total_; }
+
+    // Value below which a fraction q (0..1) of the samples fall, e.g. percentile(0.99)
+    uint64_t percentile(double q) const
+    {
+        if (total_ == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (total_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts_[i];
+            if (seen >= rank)
+                return std::min(bucketMax(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    std::array<uint64_t, BUCKETS> counts_;
+    uint64_t total_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+/*
+ * Histogram written by a single thread and read by any
+ * Readers get a copy from snapshot() that may miss the samples being recorded meanwhile.
+ * */
+class LatencyRecorder
+{
+public:
+    LatencyRecorder() : counts_{}, total_(0), sum_(0), max_(0) {}
+
+    void record(uint64_t ns)
+    {
+        addRelaxed(counts_[Histogram::bucketOf(ns)], 1);
+        addRelaxed(total_, 1);
+        addRelaxed(sum_, ns);
+        if (ns > max_.load(std::memory_order_relaxed))
+            max_.store(ns, std::memory_order_relaxed);
+    }
+
+    void snapshot(Histogram &out) const
+    {
+        for (int i = 0; i < Histogram::BUCKETS; ++i)
+        {
+            uint64_t n = counts_[i].load(std::memory_order_relaxed);
+            if (n != 0)
+                out.add(i, n);
+        }
+        out.addTotals(total_.load(std::memory_order_relaxed), sum_.load(std::memory_order_relaxed),
+                      max_.load(std::memory_order_relaxed));
+    }
+
+    uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+private:
+    std::array<std::atomic<uint64_t>, Histogram::BUCKETS> counts_;
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+// Monotonic time in nanoseconds, the unit of every duration the pool records
+inline int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Counters of one worker thread, written only by that worker
+ * Each worker has its own copy on its own cache lines, so recording never contends.
+ * */
+struct alignas(64) WorkerCounters
+{
+    WorkerCounters() : tasks(0), busyNs(0), idleNs(0) {}
+
+    std::atomic<uint64_t> tasks;  // Tasks executed
+    std::atomic<uint64_t> busyNs; // Time spent running tasks
+    std::atomic<uint64_t> idleNs; // Time spent between tasks, searching, spinning or parked
+    LatencyRecorder waitTime;     // Queued -> started
+    LatencyRecorder execTime;     // Started -> finished
+};
+
+// Snapshot of one worker, see ThreadPool::getStats()
+struct WorkerStats
+{
+    int threadId;
+    uint64_t tasks;
+    uint64_t busyNs;
+    uint64_t idleNs;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,233 @@
+#ifndef STRAND_H
+#define STRAND_H
+
+#include <atomic>
+#include <exception>
+#include <tuple>
+#include <utility>
+#include "threadpool.h"
+
+const int STRAND_BATCH = 64; // Tasks a strand runs in a row before it hands the worker back to the pool
+
+/*
+ * Shared state of a Strand: a lock-free queue of tasks and the count of those not yet run
+ * The queue is Vyukov's intrusive MPSC list: a producer exchanges the head and then links the old
+ * head to its node, the one consumer follows the links from the tail. Nodes come from a SlabPool.
+ * pending_ decides who drains: the post that takes it from 0 to 1 queues a drain on the pool, the
+ * drain keeps going until it takes it back to 0. So at most one drain exists at a time, which is
+ * what makes the strand serial, and an idle strand costs nothing but its memory.
+ * */
+class StrandState
+{
+public:
+    static StrandState *create(Executor executor) { return SlabPool<StrandState>::instance().create(executor); }
+
+    explicit StrandState(Executor executor)
+        : refs_(1), pending_(0), head_(&stub_), tail_(&stub_), executor_(executor) {}
+
+    // Tasks still queued when the last reference goes are destroyed unrun, breaking their promises
+    ~StrandState()
+    {
+        Node *node = tail_->next.load(std::memory_order_acquire);
+        freeNode(tail_);
+        while (node != nullptr)
+        {
+            Node *next = node->next.load(std::memory_order_acquire);
+            freeNode(node);
+            node = next;
+        }
+    }
+
+    void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void release()
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            SlabPool<StrandState>::instance().destroy(this);
+    }
+
+    const Executor &executor() const { return executor_; }
+
+    // Any thread
+    void push(Task &&task)
+    {
+        Node *node = SlabPool<Node>::instance().create(std::move(task));
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+        if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0)
+            schedule();
+    }
+
+    // The strand whose task the calling thread is running, nullptr outside of one
+    static StrandState *&current()
+    {
+        static thread_local StrandState *strand = nullptr;
+        return strand;
+    }
+
+private:
+    struct Node
+    {
+        Node() : next(nullptr) {}
+        explicit Node(Task &&t) : next(nullptr), task(std::move(t)) {}
+
+        std::atomic<Node *> next;
+        Task task;
+    };
+
+    // The queued drain holds a reference. If the pool drops it unrun, e.g. on a discarding shutdown,
+    // a reject or an eviction, the tasks it owed are dropped with it: otherwise pending_ would never
+    // come back to 0 and no later post would queue a drain again.
+    class DrainRun
+    {
+    public:
+        explicit DrainRun(StrandState *strand) : strand_(strand), ran_(false) { strand_->retain(); }
+        DrainRun(DrainRun &&other) noexcept : strand_(std::exchange(other.strand_, nullptr)), ran_(other.ran_) {}
+        DrainRun(const DrainRun &) = delete;
+        ~DrainRun()
+        {
+            if (strand_ == nullptr)
+                return;
+            if (!ran_)
+                strand_->abandon();
+            strand_->release();
+        }
+
+        void operator()()
+        {
+            ran_ = true;
+            strand_->drain();
+        }
+
+    private:
+        StrandState *strand_;
+        bool ran_;
+    };
+
+    void schedule() { executor_.execute(DrainRun(this)); }
+
+    // Run up to STRAND_BATCH tasks, then queue the drain again so that a busy strand shares the
+    // workers with the others. An exception stops the batch and is rethrown once the strand is back
+    // in order, the pool reports it like one from any posted task.
+    void drain()
+    {
+        StrandState *outer = std::exchange(current(), this);
+        std::exception_ptr error;
+        bool more = true;
+        for (int i = 0; more && !error && i < STRAND_BATCH; ++i)
+        {
+            {
+                Task task = pop();
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+            more = pending_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+        current() = outer;
+        if (more)
+            schedule();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // The drain was dropped unrun: destroy the tasks it owed, breaking their promises, until
+    // pending_ is back to 0. A task posted meanwhile is dropped along with them.
+    void abandon()
+    {
+        do
+        {
+            Task task = pop();
+        } while (pending_.fetch_sub(1, std::memory_order_acq_rel) != 1);
+    }
+
+    // Only called while pending_ counts a task, so the head has moved past the tail. The producer
+    // that moved it may not have linked its node yet: that is a few instructions away.
+    Task pop()
+    {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        while (next == nullptr)
+        {
+            cpuRelax();
+            next = tail->next.load(std::memory_order_acquire);
+        }
+        tail_ = next;
+        freeNode(tail);
+        return std::move(next->task);
+    }
+
+    void freeNode(Node *node)
+    {
+        if (node != &stub_)
+            SlabPool<Node>::instance().destroy(node);
+    }
+
+private:
+    std::atomic_int refs_;
+    std::atomic_int pending_;     // Tasks pushed and not yet run or dropped, the drain is queued while it is > 0
+    alignas(64) std::atomic<Node *> head_; // Producers
+    alignas(64) Node *tail_;               // The drain only, its task has been taken
+    Node stub_;
+    Executor executor_;
+};
+
+/*
+ * Serial executor on top of a ThreadPool
+ * Tasks posted to the same strand run one at a time, in the order they were posted, on whichever
+ * worker is free: ordering per connection or per key without a thread or a lock per key.
+ * Ten thousand strands share the workers, an idle one queues nothing on the pool.
+ * A Strand is a handle, copies refer to the same strand. Tasks still queued when the last handle
+ * goes away are run all the same, the pool must outlive them. If the pool drops the strand's
+ * queued turn (SHUTDOWN_DISCARD, a reject or an eviction), the tasks waiting in it are dropped and
+ * their futures break; the strand takes new posts as before.
+ * A task must not wait for a later task of its own strand, that task cannot start before it ends.
+ * */
+class Strand
+{
+public:
+    explicit Strand(ThreadPool &pool) : state_(StrandState::create(pool.executor())) {}
+    Strand(const Strand &other) : state_(other.state_) { state_->retain(); }
+    Strand &operator=(Strand other) noexcept
+    {
+        std::swap(state_, other.state_);
+        return *this;
+    }
+    ~Strand() { state_->release(); }
+
+    // Queue func(args...) behind the tasks already posted to this strand. A full pool queue or a
+    // stopped pool runs the strand on the calling thread, as for continuations.
+    template <typename Func, typename... Args>
+    void post(Func &&func, Args &&...args)
+    {
+        state_->push([func = std::forward<Func>(func), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                     { std::apply(func, args); });
+    }
+
+    // post() with a Future of the result
+    template <typename Func, typename... Args>
+    auto submit(Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        using RType = decltype(func(args...));
+        FutureState<RType> *state = FutureState<RType>::create(state_->executor());
+        Future<RType> res(state);
+        state_->push([promise = Promise<RType>(state), func = std::forward<Func>(func),
+                      args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                     { promise.run([&]() -> RType
+                                   { return std::apply(func, args); }); });
+        return res;
+    }
+
+    // Whether the calling thread is running a task of this strand
+    bool runningInThisThread() const { return StrandState::current() == state_; }
+
+private:
+    StrandState *state_;
+};
+
+#endif
\ No newline at end of file
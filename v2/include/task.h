@@ -0,0 +1,217 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "slabpool.h"
+
+/*
+ * Move-only type-erased callable void()
+ * Callables up to INLINE_SIZE bytes are stored inside the object, so wrapping the usual
+ * "state pointer + function + a few arguments" closure does not touch the allocator.
+ * Bigger callables spill to a ClosurePool, the heap only for very big ones.
+ * A task also carries the time it was queued at, for the pool's queue wait statistics.
+ * */
+class Task
+{
+public:
+    static constexpr size_t INLINE_SIZE = 64 - sizeof(void *) - sizeof(int64_t); // Task is exactly one cache line
+
+    Task() noexcept : ops_(nullptr), queuedAt_(0) {}
+
+    template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F &&func) : ops_(&OpsFor<std::decay_t<F>>::ops), queuedAt_(0)
+    {
+        using Fn = std::decay_t<F>;
+        if constexpr (isInline<Fn>())
+            new (&storage_) Fn(std::forward<F>(func));
+        else
+            *reinterpret_cast<Fn **>(&storage_) = ClosurePool<Fn>::create(std::forward<F>(func));
+    }
+
+    Task(Task &&other) noexcept : ops_(other.ops_), queuedAt_(other.queuedAt_)
+    {
+        if (ops_ != nullptr)
+        {
+            ops_->move(&storage_, &other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            ops_ = other.ops_;
+            queuedAt_ = other.queuedAt_;
+            if (ops_ != nullptr)
+            {
+                ops_->move(&storage_, &other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    void operator()() { ops_->invoke(&storage_); }
+
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    int64_t queuedAt() const noexcept { return queuedAt_; }
+    void setQueuedAt(int64_t ns) noexcept { queuedAt_ = ns; }
+
+    void reset() noexcept
+    {
+        if (ops_ != nullptr)
+        {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    // Operations of the stored callable, one static table per callable type
+    struct Ops
+    {
+        void (*invoke)(void *self);
+        void (*move)(void *dst, void *src); // move construct dst from src, then destroy src
+        void (*destroy)(void *self);
+    };
+
+    using Storage = std::aligned_storage_t<INLINE_SIZE, alignof(std::max_align_t)>;
+
+    template <typename Fn>
+    static constexpr bool isInline()
+    {
+        return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(Storage) &&
+               std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template <typename Fn, bool Inline = isInline<Fn>()>
+    struct OpsFor
+    {
+        static void invoke(void *self) { (*static_cast<Fn *>(self))(); }
+        static void move(void *dst, void *src)
+        {
+            new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+            static_cast<Fn *>(src)->~Fn();
+        }
+        static void destroy(void *self) { static_cast<Fn *>(self)->~Fn(); }
+        static constexpr Ops ops{&invoke, &move, &destroy};
+    };
+
+    // Spilled callable: the storage only holds a pointer to it
+    template <typename Fn>
+    struct OpsFor<Fn, false>
+    {
+        static Fn *&ptr(void *self) { return *static_cast<Fn **>(self); }
+        static void invoke(void *self) { (*ptr(self))(); }
+        static void move(void *dst, void *src) { *static_cast<Fn **>(dst) = ptr(src); }
+        static void destroy(void *self) { ClosurePool<Fn>::destroy(ptr(self)); }
+        static constexpr Ops ops{&invoke, &move, &destroy};
+    };
+
+private:
+    const Ops *ops_;
+    int64_t queuedAt_; // steady clock nanoseconds, set when the pool queues the task
+    Storage storage_;
+};
+
+/*
+ * Growable circular buffer with the interface std::queue expects from its container, and pop_back()
+ * Unlike std::deque it keeps its memory when drained, so a queue that has reached its
+ * working size stops allocating.
+ * */
+template <typename T>
+class CircularBuffer
+{
+public:
+    using value_type = T;
+    using reference = T &;
+    using const_reference = const T &;
+    using size_type = size_t;
+
+    CircularBuffer() : buffer_(nullptr), capacity_(0), head_(0), size_(0) {}
+    ~CircularBuffer()
+    {
+        clear();
+        ::operator delete(buffer_);
+    }
+
+    CircularBuffer(const CircularBuffer &) = delete;
+    CircularBuffer &operator=(const CircularBuffer &) = delete;
+
+    T &front() { return buffer_[head_]; }
+    const T &front() const { return buffer_[head_]; }
+    T &back() { return buffer_[index(size_ - 1)]; }
+    const T &back() const { return buffer_[index(size_ - 1)]; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    void push_back(T &&item) { emplace_back(std::move(item)); }
+    void push_back(const T &item) { emplace_back(item); }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args)
+    {
+        if (size_ == capacity_)
+            grow();
+        T *slot = new (&buffer_[index(size_)]) T(std::forward<Args>(args)...);
+        ++size_;
+        return *slot;
+    }
+
+    void pop_front()
+    {
+        buffer_[head_].~T();
+        head_ = index(1);
+        --size_;
+    }
+
+    void pop_back()
+    {
+        buffer_[index(size_ - 1)].~T();
+        --size_;
+    }
+
+    void clear()
+    {
+        while (size_ > 0)
+            pop_front();
+    }
+
+private:
+    size_t index(size_t i) const { return (head_ + i) & (capacity_ - 1); }
+
+    void grow()
+    {
+        size_t capacity = capacity_ == 0 ? 16 : capacity_ * 2;
+        T *buffer = static_cast<T *>(::operator new(capacity * sizeof(T)));
+        for (size_t i = 0; i < size_; ++i)
+        {
+            new (&buffer[i]) T(std::move(buffer_[index(i)]));
+            buffer_[index(i)].~T();
+        }
+        ::operator delete(buffer_);
+        buffer_ = buffer;
+        capacity_ = capacity;
+        head_ = 0;
+    }
+
+private:
+    T *buffer_;
+    size_t capacity_; // Always zero or a power of two
+    size_t head_;
+    size_t size_;
+};
+
+#endif
\ No newline at end of file
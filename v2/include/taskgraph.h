@@ -0,0 +1,169 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "threadpool.h"
+
+/*
+ * A directed acyclic graph of tasks run on a ThreadPool
+ * emplace() adds a node, precede(a, b) makes b wait for a. run() queues the nodes without
+ * predecessors; the worker that finishes a node queues the successors it made ready and goes on
+ * with the last of them itself, so no thread ever blocks waiting for a dependency.
+ * If a node throws, the nodes that have not started are skipped and the first exception is
+ * rethrown by the Future returned by run().
+ * The graph may be run again once a run is over, it must not be modified while running.
+ * */
+class TaskGraph
+{
+public:
+    using Node = size_t;
+
+    TaskGraph() : nodes_(std::make_shared<std::vector<NodeData>>()) {}
+
+    template <typename Func>
+    Node emplace(Func &&func)
+    {
+        nodes_->push_back(NodeData{Task(std::forward<Func>(func)), {}, 0});
+        return nodes_->size() - 1;
+    }
+
+    // to starts after from has finished
+    void precede(Node from, Node to)
+    {
+        if (from >= nodes_->size() || to >= nodes_->size())
+            throw std::out_of_range("TaskGraph node does not exist");
+        (*nodes_)[from].successors.push_back(to);
+        ++(*nodes_)[to].predecessors;
+    }
+
+    size_t size() const { return nodes_->size(); }
+
+    // Start the graph on pool, throws std::invalid_argument if the dependencies have a cycle
+    Future<void> run(ThreadPool &pool)
+    {
+        checkAcyclic();
+        if (nodes_->empty())
+            return makeReadyFuture<void>();
+
+        FutureState<void> *state = FutureState<void>::create(pool.executor());
+        Future<void> res(state);
+        auto run = std::make_shared<Run>(nodes_, state, pool.executor());
+        for (Node i = 0; i < nodes_->size(); ++i)
+        {
+            if ((*nodes_)[i].predecessors == 0)
+                run->executor.execute(Task([run, i]()
+                                           { execute(run, i); }));
+        }
+        return res;
+    }
+
+private:
+    struct NodeData
+    {
+        Task body;
+        std::vector<Node> successors;
+        size_t predecessors;
+    };
+
+    // State of one run, shared by the tasks of its nodes
+    struct Run
+    {
+        Run(std::shared_ptr<std::vector<NodeData>> n, FutureState<void> *state, Executor e)
+            : nodes(std::move(n)), pending(new std::atomic<size_t>[nodes->size()]), remaining(nodes->size()),
+              failed(false), promise(state), executor(e)
+        {
+            for (size_t i = 0; i < nodes->size(); ++i)
+                pending[i].store((*nodes)[i].predecessors, std::memory_order_relaxed);
+        }
+
+        std::shared_ptr<std::vector<NodeData>> nodes;
+        std::unique_ptr<std::atomic<size_t>[]> pending; // Predecessors of every node still to finish
+        std::atomic<size_t> remaining;                 // Nodes still to finish or be skipped
+        std::atomic_bool failed;
+        std::exception_ptr error; // First exception, written by the node that set failed
+        Promise<void> promise;
+        Executor executor;
+    };
+
+    // Run node i, then every node it made ready: all but one are queued, this worker keeps the last
+    static void execute(const std::shared_ptr<Run> &run, Node i)
+    {
+        for (;;)
+        {
+            NodeData &node = (*run->nodes)[i];
+            if (!run->failed.load(std::memory_order_acquire))
+            {
+                try
+                {
+                    node.body();
+                }
+                catch (...)
+                {
+                    if (!run->failed.exchange(true, std::memory_order_acq_rel))
+                        run->error = std::current_exception();
+                }
+            }
+
+            size_t next = run->nodes->size();
+            for (Node succ : node.successors)
+            {
+                if (run->pending[succ].fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    continue;
+                if (next != run->nodes->size())
+                    run->executor.execute(Task([run, next]()
+                                               { execute(run, next); }));
+                next = succ;
+            }
+
+            if (run->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                run->promise.run([&]()
+                                 {
+                                     if (run->error)
+                                         std::rethrow_exception(run->error); });
+                return;
+            }
+            if (next == run->nodes->size())
+                return;
+            i = next;
+        }
+    }
+
+    // Kahn's algorithm: every node can be ordered only if there is no cycle
+    void checkAcyclic() const
+    {
+        std::vector<size_t> pending(nodes_->size());
+        std::vector<Node> ready;
+        for (Node i = 0; i < nodes_->size(); ++i)
+        {
+            pending[i] = (*nodes_)[i].predecessors;
+            if (pending[i] == 0)
+                ready.push_back(i);
+        }
+        size_t ordered = 0;
+        while (!ready.empty())
+        {
+            Node i = ready.back();
+            ready.pop_back();
+            ++ordered;
+            for (Node succ : (*nodes_)[i].successors)
+            {
+                if (--pending[succ] == 0)
+                    ready.push_back(succ);
+            }
+        }
+        if (ordered != nodes_->size())
+            throw std::invalid_argument("TaskGraph has a cycle");
+    }
+
+private:
+    std::shared_ptr<std::vector<NodeData>> nodes_;
+};
+
+#endif
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define THREADPOOL_H
 
 #include <iostream>
+#include <algorithm>
+#include <iterator>
 #include <queue>
 #include <memory>
 #include <atomic>
@@ -12,15 +14,85 @@
 #include <unordered_map>
 #include <future>
 #include <chrono>
+#include <cmath>
+#include <exception>
+#include <tuple>
+#include <vector>
+#include "affinity.h"
+#include "wsdeque.h"
+#include "mpmcqueue.h"
+#include "priorityqueue.h"
+#include "task.h"
+#include "slabpool.h"
+#include "future.h"
+#include "batch.h"
+#include "cancel.h"
+#include "stats.h"
+#include "timerwheel.h"
 
 const int TASK_MAX_THRESHOLD = 1024;
 const int THREAD_MAX_SIZE = 10;
-const int THREAD_IDLE_MAX_TIME = 5;
+const int THREAD_IDLE_MAX_TIME = 5; // Default time the cached pool must stay underused before it shrinks (seconds)
+const int CACHED_CONTROL_MS = 10;     // Sampling period of the cached pool controller (milliseconds)
+const int CACHED_GROW_WAIT_US = 1000; // Default queue wait above which the cached pool grows (microseconds)
+const double CACHED_SHRINK_UTILIZATION = 0.5; // Busy share of the threads under which the cached pool may shrink
+const double CACHED_TARGET_UTILIZATION = 0.75; // Busy share of the threads the cached pool shrinks to
+const int IDLE_SPIN_MAX_US = 50;  // Default spin window of the spinning idle modes (microseconds)
+const int IDLE_YIELD_ROUNDS = 16; // sched_yield() calls between spinning and parking
+const int HELP_MAX_DEPTH = 32;    // Nested waits a worker helps in before it blocks, bounds its stack
+const int SUBMIT_WAIT_MS = 1000;  // Default time a submission waits for room in a full queue (milliseconds)
 // Supporting Mode
 enum class PoolMode
 {
     MODE_FIXED,
     MODE_CACHED,
+    MODE_WORK_STEALING, // Per-worker deques, idle workers steal from peers
+};
+
+// Backend of the shared task queue
+enum class QueueMode
+{
+    QUEUE_LOCKED,    // std::queue guarded by a mutex, see ThreadPool::start() for sharding
+    QUEUE_LOCK_FREE, // Bounded MPMC ring, the mutex is only taken to sleep or to wait for space
+};
+
+// What a worker does when it runs out of tasks
+enum class IdleMode
+{
+    IDLE_PARK,     // Park at once, no CPU is burnt while idle
+    IDLE_SPIN,     // Spin for the whole spin window, then yield, then park
+    IDLE_ADAPTIVE, // Spin window follows the time the worker usually waits for its next task
+};
+
+// What shutdown() does with the tasks still queued
+enum class ShutdownMode
+{
+    SHUTDOWN_DRAIN,   // Run them, and the tasks they queue meanwhile, then stop
+    SHUTDOWN_DISCARD, // Drop them, only the tasks already running finish
+};
+
+// What a submission does with its task when the queue stays full, see ThreadPool::setRejectPolicy()
+enum class RejectPolicy
+{
+    REJECT_DISCARD,        // Drop the task: post() returns false, the future is broken
+    REJECT_THROW,          // Drop the task and throw QueueFullError to the submitter
+    REJECT_CALLER_RUNS,    // Run the task on the submitting thread, which slows the producer down
+    REJECT_DISCARD_OLDEST, // Drop the oldest queued task of the least urgent level instead
+    REJECT_CUSTOM,         // Hand the task to the handler of ThreadPool::setRejectHandler()
+};
+
+// Thrown by the submissions of a pool with RejectPolicy::REJECT_THROW
+class QueueFullError : public std::runtime_error
+{
+public:
+    QueueFullError() : std::runtime_error("ThreadPool task queue is full") {}
+};
+
+// Priority of a task, level 0 is the most urgent, see ThreadPool::setPriorityLevels()
+struct Priority
+{
+    explicit Priority(size_t l) : level(l) {}
+    size_t level;
 };
 
 // The Class Thread
@@ -29,23 +101,53 @@ class Thread
 public:
     using ThreadFunc = std::function<void(int)>; // Thread function type
     Thread(ThreadFunc func) : threadFunc_(func), threadId_(generateId_++) {}
-    ~Thread() = default;
+    ~Thread() { join(); }
+
+    void start() { thread_ = std::thread(threadFunc_, threadId_); }
 
-    void start()
+    // Wait for the thread function to return, never called by the thread itself
+    void join()
     {
-        std::thread t(threadFunc_, threadId_);
-        t.detach();
+        if (thread_.joinable())
+            thread_.join();
     }
 
     int getThreadId() const { return threadId_; }
 
 private:
     ThreadFunc threadFunc_; // Thread function
-    static int generateId_; // Used to generate the thread id
-    int threadId_;          // Used to index the current thread
+    std::thread thread_;    // Owned by the pool, which joins it
+    static inline std::atomic_int generateId_{0}; // Used to generate the thread id, shared by every pool
+    int threadId_;                                // Used to index the current thread
 };
 
-int Thread::generateId_ = 0;
+// Counters of the worker parking subsystem, see ThreadPool::getParkingStats()
+struct ParkingStats
+{
+    uint64_t parks;            // Times a worker blocked, i.e. voluntary context switches
+    uint64_t unparks;          // Targeted wakeups, each one reaches a single worker
+    uint64_t futileWakeups;    // Wakeups after which the worker found no task
+    uint64_t wakeLatencyNs;    // Sum of the delays between unpark and the worker running again
+    uint64_t maxWakeLatencyNs; // Longest of those delays
+    uint64_t spinHits;         // Idle periods that ended while spinning or yielding, without parking
+};
+
+// Snapshot of the pool counters, see ThreadPool::getStats()
+struct PoolStats
+{
+    std::vector<WorkerStats> workers; // Running workers
+    uint64_t tasks;                   // Tasks executed, workers that have exited included
+    uint64_t busyNs;                  // Time spent running tasks, summed over the workers
+    uint64_t idleNs;                  // Time spent waiting for tasks, summed over the workers
+    uint64_t queueHighWater;          // Deepest a task queue has been
+    uint64_t rejected;                // Submissions the full queue refused, whatever the reject policy did then
+    uint64_t evicted;                 // Queued tasks dropped by RejectPolicy::REJECT_DISCARD_OLDEST
+    uint64_t skipped;                 // Tasks dropped unrun when dequeued: cancelled, or past their deadline
+    uint64_t unhandled;               // Exceptions that escaped a task while no exception handler was set
+    Histogram waitTime;               // Queued -> started, in nanoseconds
+    Histogram execTime;               // Started -> finished, in nanoseconds
+    ParkingStats parking;
+};
 
 // The Class ThreadPool
 class ThreadPool
@@ -53,27 +155,112 @@ class ThreadPool
 public:
     ThreadPool() : initThreadSize_(0),
                    maxThreadSize_(THREAD_MAX_SIZE),
+                   minThreadSize_(0),
+                   minThreadSizeSet_(false),
                    curThreadSize_(0),
                    idleThreadSize_(0),
                    taskSize_(0),
                    maxTaskQueSize_(TASK_MAX_THRESHOLD),
+                   readyWorkers_(0),
+                   waitingProducers_(0),
+                   affinityMode_(AffinityMode::AFFINITY_NONE),
+                   queueNodes_(1),
+                   queueShards_(1),
+                   parkedSize_(0),
+                   searching_(0),
+                   parks_(0),
+                   unparks_(0),
+                   futileWakeups_(0),
+                   wakeLatencyNs_(0),
+                   maxWakeLatencyNs_(0),
+                   spinHits_(0),
+                   timers_(nowNs()),
+                   keeper_(nullptr),
+                   keeperDueNs_(TimerWheel::NEVER),
+                   spinTimeNs_(IDLE_SPIN_MAX_US * 1000),
+                   spinWindowNs_(0),
+                   threadIdleNs_(static_cast<int64_t>(THREAD_IDLE_MAX_TIME) * 1000000000),
+                   growWaitNs_(static_cast<int64_t>(CACHED_GROW_WAIT_US) * 1000),
+                   growKick_(false),
+                   queueHighWater_(0),
+                   rejected_(0),
+                   evicted_(0),
+                   skipped_(0),
+                   unhandled_(0),
+                   submitWaitNs_(static_cast<int64_t>(SUBMIT_WAIT_MS) * 1000000),
+                   rejectPolicy_(RejectPolicy::REJECT_DISCARD),
+                   priorityLevels_(1),
+                   agingRounds_(PRIORITY_AGING_ROUNDS),
                    poolMode_(PoolMode::MODE_FIXED),
+                   queueMode_(QueueMode::QUEUE_LOCKED),
+                   idleMode_(IdleMode::IDLE_PARK),
+                   stopping_(false),
                    isPoolRunning_(false) {}
-    ~ThreadPool()
+    ~ThreadPool() { shutdown(ShutdownMode::SHUTDOWN_DISCARD); }
+
+    void setMode(PoolMode mode)
     {
-        isPoolRunning_ = false;
+        if (checkRunningState())
+            return;
+        poolMode_ = mode;
+    }
 
-        std::unique_lock<std::mutex> lock(taskQueMtx_);
-        notEmpty_.notify_all();
-        exitCv_.wait(lock, [&]() -> bool
-                     { return threads_.size() == 0; });
+    void setQueueMode(QueueMode mode)
+    {
+        if (checkRunningState())
+            return;
+        queueMode_ = mode;
     }
 
-    void setMode(PoolMode mode)
+    void setIdleMode(IdleMode mode)
     {
         if (checkRunningState())
             return;
-        poolMode_ = mode;
+        idleMode_ = mode;
+    }
+
+    // Longest a worker spins before yielding and parking, the whole window in IDLE_SPIN mode
+    void setSpinTime(std::chrono::microseconds time)
+    {
+        if (checkRunningState())
+            return;
+        spinTimeNs_ = static_cast<int64_t>(time.count()) * 1000;
+    }
+
+    // Number of priority levels, 1 (no priorities) by default. Tasks submitted without a Priority
+    // go to the middle level (levels - 1) / 2, so there is room above and below them.
+    void setPriorityLevels(size_t levels)
+    {
+        if (checkRunningState())
+            return;
+        priorityLevels_ = std::max<size_t>(1, std::min(levels, PRIORITY_MAX_LEVELS));
+    }
+
+    // A level with tasks is served ahead of the more urgent ones after being passed over rounds times
+    void setPriorityAging(unsigned rounds)
+    {
+        if (checkRunningState())
+            return;
+        agingRounds_ = std::max(1u, rounds);
+    }
+
+    // Pin the workers created by start() to CPUs, see AffinityMode. When they end up on several NUMA
+    // nodes, every node gets its own shared queue: a task goes to the queue of the node it is
+    // submitted from, and workers only take tasks of other nodes when their own queue is empty.
+    void setAffinity(AffinityMode mode)
+    {
+        if (checkRunningState())
+            return;
+        affinityMode_ = mode;
+    }
+
+    // AFFINITY_CPUSET: worker i runs on cpus[i % cpus.size()]
+    void setAffinity(std::vector<int> cpus)
+    {
+        if (checkRunningState())
+            return;
+        affinityMode_ = AffinityMode::AFFINITY_CPUSET;
+        cpuset_ = std::move(cpus);
     }
 
     void setThreadMaxSize(size_t size)
@@ -83,6 +270,31 @@ public:
         maxThreadSize_ = size;
     }
 
+    // cached mode: the pool never shrinks below size threads, by default the size it was started with
+    void setThreadMinSize(size_t size)
+    {
+        if (checkRunningState())
+            return;
+        minThreadSize_ = size;
+        minThreadSizeSet_ = true;
+    }
+
+    // cached mode: how long the threads must stay mostly idle before the pool shrinks
+    void setThreadIdleTime(std::chrono::milliseconds time)
+    {
+        if (checkRunningState())
+            return;
+        threadIdleNs_ = static_cast<int64_t>(time.count()) * 1000000;
+    }
+
+    // cached mode: the pool grows while tasks wait longer than this in the queue
+    void setGrowWaitTime(std::chrono::microseconds time)
+    {
+        if (checkRunningState())
+            return;
+        growWaitNs_ = static_cast<int64_t>(time.count()) * 1000;
+    }
+
     void setTaskQueMaxSize(size_t size)
     {
         if (checkRunningState())
@@ -90,168 +302,1945 @@ public:
         maxTaskQueSize_ = size;
     }
 
+    // How long submitTask(), post() and the batches wait for room in a full queue before the task
+    // is rejected, trySubmit() and submitFor() bring their own
+    void setSubmitTimeout(std::chrono::milliseconds time)
+    {
+        if (checkRunningState())
+            return;
+        submitWaitNs_ = static_cast<int64_t>(time.count()) * 1000000;
+    }
+
+    // What happens to a task the full queue refused. Batches always drop their rejected tasks and
+    // count them in TaskBatch::rejected(). A worker of the pool is never refused: it runs the task
+    // itself instead of waiting for room, see pushOrReject().
+    void setRejectPolicy(RejectPolicy policy)
+    {
+        if (checkRunningState())
+            return;
+        rejectPolicy_ = policy;
+    }
+
+    // Receives the tasks the full queue refused, on the submitting thread. A task the handler moves
+    // away counts as taken, e.g. to run it or to queue it elsewhere; one it leaves is dropped, which
+    // breaks its future. Sets RejectPolicy::REJECT_CUSTOM.
+    using RejectHandler = std::function<void(Task &)>;
+    void setRejectHandler(RejectHandler handler)
+    {
+        if (checkRunningState())
+            return;
+        rejectHandler_ = std::move(handler);
+        rejectPolicy_ = RejectPolicy::REJECT_CUSTOM;
+    }
+
+    // Queue n calls func(0) ... func(n - 1) as one batch: one lock and one round of wakeups for all of them
+    template <typename Func>
+    TaskBatch submitBulk(size_t n, Func &&func)
+    {
+        using Body = std::decay_t<Func>;
+        // Shared by every task of the batch instead of being copied into each of them
+        return queueBatch(n, std::make_shared<Body>(std::forward<Func>(func)), [](void *body, size_t i)
+                          { (*static_cast<Body *>(body))(i); });
+    }
+
+    // Queue every callable of [begin, end) as one batch
+    template <typename Iterator>
+    TaskBatch submitBatch(Iterator begin, Iterator end)
+    {
+        using Body = std::vector<std::decay_t<decltype(*begin)>>;
+        size_t n = static_cast<size_t>(std::distance(begin, end));
+        return queueBatch(n, std::make_shared<Body>(begin, end), [](void *body, size_t i)
+                          { (*static_cast<Body *>(body))[i](); });
+    }
+
+    // Receives the exceptions escaping the tasks that have no Future to hold them: post(), timers
+    // and strands. Without a handler they are written to std::cerr and counted in PoolStats::unhandled.
+    using ExceptionHandler = std::function<void(std::exception_ptr)>;
+    void setExceptionHandler(ExceptionHandler handler)
+    {
+        if (checkRunningState())
+            return;
+        exceptionHandler_ = std::move(handler);
+    }
+
+    // Fire and forget: queue the call without a Future or any shared state, false if the task was
+    // rejected and dropped
     template <typename Func, typename... Args>
-    auto submitTask(Func &&func, Args &&...args) -> std::future<decltype(func(args...))>
+    bool post(Func &&func, Args &&...args)
+    {
+        return post(Priority(defaultLevel()), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    template <typename Func, typename... Args>
+    bool post(Priority priority, Func &&func, Args &&...args)
     {
         if (!checkRunningState())
             throw std::runtime_error("ThreadPool is not running");
-        using RType = decltype(func(args...));
-        auto task = std::make_shared<std::packaged_task<RType()>>(
-            std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
-        std::future<RType> res = task->get_future();
 
-        std::unique_lock<std::mutex> lock(taskQueMtx_);
-        if (!notFull_.wait_for(lock, std::chrono::seconds(1),
-                               [&]() -> bool
-                               { return taskSize_ < maxTaskQueSize_; }))
-        {
-            // throw std::runtime_error("Task queue is full");
-            std::cerr << "Task queue is full, submit task failed" << std::endl;
-            auto temp = std::make_shared<std::packaged_task<RType()>>(
-                []() -> RType
-                { return RType(); });
-            (*temp)();
-            return temp->get_future();
-        }
-
-        // using Task = std::function<void()>;
-        // taskQue_.emplace([task, args = std::make_tuple(std::forward<Args>(args)...)]()
-        //                  { std::apply([&task](auto&&... params) { (*task)(std::forward<decltype(params)>(params)...); }, args); });
-        taskQue_.emplace([task]()
-                         { (*task)(); });
-
-        ++taskSize_;
-        notEmpty_.notify_all();
-
-        // cached Mode
-        if (poolMode_ == PoolMode::MODE_CACHED && taskSize_ > idleThreadSize_ && curThreadSize_ < maxThreadSize_)
-        {
-            std::cout << "Create new thread..." << std::endl;
-            auto ptr = std::make_unique<Thread>([this](int threadId)
-                                                { this->threadFunc(threadId); });
-            int threadId = ptr->getThreadId();
-            threads_.emplace(threadId, std::move(ptr));
-            threads_[threadId]->start();
-            ++curThreadSize_;
-            ++idleThreadSize_;
-        }
-        return res;
+        return pushOrReject([func = std::forward<Func>(func),
+                             args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                            { std::apply(func, args); },
+                            levelOf(priority), submitWaitNs_);
+    }
+
+    // Run func(args...) once, delay from now. There is no timer thread: workers check the timers
+    // between tasks, and one parked worker sleeps only until the next one is due.
+    template <typename Rep, typename Period, typename Func, typename... Args>
+    TimerHandle scheduleAfter(std::chrono::duration<Rep, Period> delay, Func &&func, Args &&...args)
+    {
+        int64_t delayNs = std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+        return scheduleTimer(nowNs() + delayNs, 0, std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Run func(args...) every period, the first time one period from now. The schedule is kept at a
+    // fixed rate; a firing due while the previous one still runs is skipped.
+    template <typename Rep, typename Period, typename Func, typename... Args>
+    TimerHandle scheduleEvery(std::chrono::duration<Rep, Period> period, Func &&func, Args &&...args)
+    {
+        int64_t periodNs = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+        return scheduleTimer(nowNs() + periodNs, periodNs, std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    template <typename Func, typename... Args>
+    auto submitTask(Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        return submitTask(Priority(defaultLevel()), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Queue the task at a priority level, it runs before the tasks queued at less urgent levels
+    template <typename Func, typename... Args>
+    auto submitTask(Priority priority, Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        return submitWithin(submitWaitNs_, levelOf(priority), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Never waits for room in a full queue: the reject policy applies at once
+    template <typename Func, typename... Args>
+    auto trySubmit(Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        return submitWithin(0, defaultLevel(), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Waits at most timeout for room in a full queue, then the reject policy applies
+    template <typename Rep, typename Period, typename Func, typename... Args>
+    auto submitFor(std::chrono::duration<Rep, Period> timeout, Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        int64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        return submitWithin(std::max<int64_t>(0, waitNs), defaultLevel(), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Queue the task with a cancellation token. Once the token is cancelled, the worker that
+    // dequeues the task drops it without running it and the future throws TaskCancelledError.
+    // A task that has already started runs on, it can poll the token to stop early.
+    template <typename Func, typename... Args>
+    auto submitTask(CancellationToken token, Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        return submitGuarded(std::move(token), TimerWheel::NEVER, std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Queue the task only for as long as it is useful: a worker dequeuing it after deadline drops
+    // it like a cancelled task. Nothing is dropped once it runs.
+    template <typename Duration, typename Func, typename... Args>
+    auto submitBefore(std::chrono::time_point<std::chrono::steady_clock, Duration> deadline, Func &&func, Args &&...args)
+        -> Future<decltype(func(args...))>
+    {
+        return submitBefore(deadline, CancellationToken(), std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    template <typename Duration, typename Func, typename... Args>
+    auto submitBefore(std::chrono::time_point<std::chrono::steady_clock, Duration> deadline, CancellationToken token,
+                      Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        int64_t deadlineNs = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        return submitGuarded(std::move(token), deadlineNs, std::forward<Func>(func), std::forward<Args>(args)...);
     }
 
-    void start(int initThreadSize = std::thread::hardware_concurrency())
+    // Queue the task behind a handle that cancels it when dropped, e.g. when the request that
+    // wanted the result has timed out and unwinds
+    template <typename Func, typename... Args>
+    auto submitCancellable(Func &&func, Args &&...args) -> CancellableFuture<decltype(func(args...))>
+    {
+        CancellationSource source;
+        auto future = submitGuarded(source.token(), TimerWheel::NEVER, std::forward<Func>(func), std::forward<Args>(args)...);
+        return CancellableFuture<decltype(func(args...))>(std::move(future), source);
+    }
+
+    // Queues the continuations of the futures of this pool, see Future::then()
+    Executor executor()
+    {
+        static const Executor::Ops ops{&ThreadPool::submitContinuation, &ThreadPool::helpWhileWaiting, &ThreadPool::isWorker};
+        return Executor(this, &ops);
+    }
+
+    // Awaitable returned by schedule(), works with any coroutine handle so it does not need C++20
+    class ScheduleAwaiter
+    {
+    public:
+        explicit ScheduleAwaiter(ThreadPool *pool) : pool_(pool) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        // Keep running on this thread when the pool cannot take the coroutine right now
+        template <typename Handle>
+        bool await_suspend(Handle handle) { return pool_->queueResume(handle); }
+
+        void await_resume() const noexcept {}
+
+    private:
+        ThreadPool *pool_;
+    };
+
+    // co_await pool.schedule() suspends the coroutine and resumes it on a worker, see coroutine.h
+    ScheduleAwaiter schedule() { return ScheduleAwaiter(this); }
+
+    // queueShards > 1 splits the shared queue (of every NUMA node) into that many shards, each with
+    // its own lock and condition variable: a producer thread always uses the same shard, a worker
+    // serves its home shard first and then the fuller of two random ones. Meant for many independent
+    // producers, which would all meet on one lock otherwise. The queue capacity is split evenly
+    // across the shards. The lock-free rings have no lock to split and ignore it.
+    // After shutdown() the pool can be started again, with other settings if need be: the workers,
+    // queues and timers of the last run are gone by then. The statistics keep adding up.
+    void start(int initThreadSize = std::thread::hardware_concurrency(), size_t queueShards = 1)
     {
+        // Left over from the last run, see stop()
+        stopping_ = false;
+        readyWorkers_ = 0;
+        idleThreadSize_ = 0;
+        searching_ = 0;
+        growKick_ = false;
+        keeper_ = nullptr;
+        keeperDueNs_ = TimerWheel::NEVER;
         isPoolRunning_ = true;
         initThreadSize_ = initThreadSize;
         curThreadSize_ = initThreadSize;
+        // Unless set, follows the size of each run
+        if (!minThreadSizeSet_)
+        {
+            minThreadSize_ = initThreadSize_;
+        }
 
-        // Create threads
-        for (int i = 0; i < initThreadSize_; ++i)
+        queueShards_ = queueMode_ == QueueMode::QUEUE_LOCK_FREE ? 1 : std::max<size_t>(1, queueShards);
+        placeWorkers();
+        taskQues_.resize(queueNodes_ * queueShards_);
+        ringQues_.resize(queueNodes_);
+
+        // On a single CPU a spinning worker only delays the thread that would submit the task, just yield
+        spinWindowNs_ = std::thread::hardware_concurrency() <= 1 ? 0 : spinTimeNs_;
+
+        // Create threads, each one allocates its deque itself, see setupWorker()
+        if (poolMode_ == PoolMode::MODE_WORK_STEALING)
+        {
+            deques_.resize(initThreadSize_);
+        }
+        for (size_t i = 0; i < initThreadSize_; ++i)
         {
-            auto ptr = std::make_unique<Thread>([this](int threadId)
-                                                { this->threadFunc(threadId); });
+            auto ptr = std::make_unique<Thread>([this, i](int threadId)
+                                                { this->threadFunc(threadId, i, true); });
             threads_.emplace(ptr->getThreadId(), std::move(ptr));
             idleThreadSize_.fetch_add(1);
         }
 
-        // Start threads
-        for (int i = 0; i < initThreadSize_; ++i)
+        // Start threads, the ids come from a global generator so they do not start at 0 for every pool
+        for (auto &thread : threads_)
+        {
+            thread.second->start();
+        }
+
+        // Nothing may be queued before every queue exists
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        readyCv_.wait(lock, [&]() -> bool
+                      { return readyWorkers_ == initThreadSize_; });
+        for (size_t node = 0; node < queueNodes_; ++node)
+        {
+            if (!taskQues_[node * queueShards_] && !ringQues_[node])
+                createQueue(node);
+        }
+        lock.unlock();
+
+        // cached mode: threads are added and removed by a controller, never by the submitters
+        if (poolMode_ == PoolMode::MODE_CACHED)
+        {
+            controller_ = std::thread([this]()
+                                      { this->controlLoop(); });
+        }
+    }
+
+    // Stop the pool and join its threads. Tasks already running always finish. Returns the number
+    // of tasks dropped: the queued ones with SHUTDOWN_DISCARD, and the timers that have not fired.
+    // Once stopped, later calls and the destructor return 0 at once.
+    size_t shutdown(ShutdownMode mode = ShutdownMode::SHUTDOWN_DRAIN)
+    {
+        return stop(mode == ShutdownMode::SHUTDOWN_DRAIN, std::chrono::steady_clock::time_point::max());
+    }
+
+    // Drain the queues for at most timeout, then drop what is left
+    template <typename Rep, typename Period>
+    size_t shutdownFor(std::chrono::duration<Rep, Period> timeout)
+    {
+        return stop(true, std::chrono::steady_clock::now() + timeout);
+    }
+
+    size_t getThreadSize() const { return static_cast<size_t>(curThreadSize_); } // Current number of threads
+
+    ParkingStats getParkingStats() const
+    {
+        return ParkingStats{parks_.load(), unparks_.load(), futileWakeups_.load(),
+                            wakeLatencyNs_.load(), maxWakeLatencyNs_.load(), spinHits_.load()};
+    }
+
+    // Counters of every worker, queue depth high-water mark, rejected tasks and latency histograms
+    PoolStats getStats() const
+    {
+        PoolStats stats;
+        stats.queueHighWater = queueHighWater_.load(std::memory_order_relaxed);
+        stats.rejected = rejected_.load(std::memory_order_relaxed);
+        stats.evicted = evicted_.load(std::memory_order_relaxed);
+        stats.skipped = skipped_.load(std::memory_order_relaxed);
+        stats.unhandled = unhandled_.load(std::memory_order_relaxed);
+        stats.parking = getParkingStats();
+
+        std::lock_guard<std::mutex> lock(statsMtx_);
+        stats.tasks = exited_.tasks;
+        stats.busyNs = exited_.busyNs;
+        stats.idleNs = exited_.idleNs;
+        stats.waitTime = exited_.waitTime;
+        stats.execTime = exited_.execTime;
+        for (Worker *worker : liveWorkers_)
         {
-            threads_[i]->start();
+            const WorkerCounters &counters = worker->counters;
+            WorkerStats ws{worker->threadId, counters.tasks.load(std::memory_order_relaxed),
+                           counters.busyNs.load(std::memory_order_relaxed), counters.idleNs.load(std::memory_order_relaxed)};
+            stats.workers.push_back(ws);
+            stats.tasks += ws.tasks;
+            stats.busyNs += ws.busyNs;
+            stats.idleNs += ws.idleNs;
+            counters.waitTime.snapshot(stats.waitTime);
+            counters.execTime.snapshot(stats.execTime);
         }
+        return stats;
     }
 
     ThreadPool(const ThreadPool &) = delete;
     ThreadPool &operator=(const ThreadPool &) = delete;
 
 private:
-    void threadFunc(int threadId)
+    // Per-thread state of a worker, it lives on the worker's own stack
+    struct Worker
+    {
+        Worker(ThreadPool *p, int id, size_t i)
+            : pool(p), threadId(id), index(i), node(0), queue(0), seed(static_cast<uint32_t>(i) * 2654435761u + 1),
+              notified(false), parked(false), woken(false), retiring(false), timerKick(false), idle(false), idleSince(0),
+              avgIdleNs(0), helpDepth(0) {}
+
+        ThreadPool *pool;
+        int threadId;
+        size_t index;  // Deque index in work stealing mode
+        size_t node;   // NUMA node of the shared queue the worker serves first
+        size_t queue;  // Shard of that queue the worker serves first, an index of taskQues_
+        uint32_t seed; // xorshift state used to pick steal victims
+
+        // Parking spot: every worker sleeps on its own condition variable, so a wakeup reaches exactly one thread
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool notified;                                    // Permit set by unpark(), protected by mtx
+        bool parked;                                      // Listed in idleWorkers_, protected by idleMtx_
+        bool woken;                                       // Unparked and still searching for a task, owner only
+        bool retiring;                                    // Unparked by the controller to exit, protected by mtx
+        std::chrono::steady_clock::time_point unparkTime; // Set by unpark(), protected by mtx
+        bool timerKick;                                   // An earlier timer was armed while keeping time, protected by mtx
+        std::vector<Task> expired;                        // Firings collected from the timer wheel, owner only
+
+        // Adaptive idle mode, owner only
+        bool idle;         // Out of tasks since idleSince
+        int64_t idleSince; // When the worker last ran out of tasks, see nowNs()
+        int64_t avgIdleNs; // Moving average of the time it took to get the next task
+
+        int helpDepth; // Tasks run by helpWhileWaiting() on the stack, owner only
+
+        WorkerCounters counters; // Read by getStats()
+    };
+
+    static Worker *&currentWorker()
+    {
+        static thread_local Worker *worker = nullptr;
+        return worker;
+    }
+
+    // One shard of a locked shared queue, see start(). Each one sits on its own cache lines.
+    struct alignas(64) QueueShard
+    {
+        QueueShard(size_t levels, unsigned agingRounds, size_t cap) : que(levels, agingRounds), capacity(cap), size(0) {}
+
+        std::mutex mtx;                  // Protects que
+        std::condition_variable notFull; // Producers waiting for room in this shard
+        MultiLevelQueue<Task> que;       // One FIFO per priority level
+        size_t capacity;                 // Share of maxTaskQueSize_
+        std::atomic_int size;            // Tasks in que, readable without mtx
+    };
+
+    // Shard a producer thread that is not a worker submits to, node * queueShards_ + shard. A
+    // ticket handed out in turn rather than a hash of the thread id, so the producers spread evenly.
+    size_t producerShard() const
     {
-        auto lastTime = std::chrono::high_resolution_clock().now();
-        //
-        for (;;)
+        static std::atomic<size_t> tickets(0);
+        static thread_local const size_t ticket = tickets.fetch_add(1, std::memory_order_relaxed);
+        return ticket % queueShards_;
+    }
+
+    static uint32_t nextRandom(Worker &self)
+    {
+        self.seed ^= self.seed << 13;
+        self.seed ^= self.seed >> 17;
+        self.seed ^= self.seed << 5;
+        return self.seed;
+    }
+
+    size_t defaultLevel() const { return (priorityLevels_ - 1) / 2; }
+    size_t levelOf(Priority priority) const { return std::min(priority.level, priorityLevels_ - 1); }
+
+    // Whether the shared queue holds tasks more urgent than the default level
+    bool hasUrgentTask() const
+    {
+        uint64_t urgent = (uint64_t(1) << defaultLevel()) - 1;
+        if (urgent == 0)
+            return false;
+        for (size_t node = 0; node < queueNodes_; ++node)
         {
-            std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(taskQueMtx_);
+            if ((nonEmpty(node) & urgent) != 0)
+                return true;
+        }
+        return false;
+    }
 
-                std::cout << "Thread " << std::this_thread::get_id() << " is waiting for the task..." << std::endl;
-                while (taskSize_ == 0 && isPoolRunning_)
-                {
-                    if (poolMode_ == PoolMode::MODE_CACHED)
-                    {
-                        if (std::cv_status::timeout == notEmpty_.wait_for(lock, std::chrono::seconds(1)))
-                        {
-                            auto now = std::chrono::high_resolution_clock().now();
-                            auto dur = std::chrono::duration_cast<std::chrono::seconds>(now - lastTime);
-                            if (dur.count() >= THREAD_IDLE_MAX_TIME && curThreadSize_ > initThreadSize_)
-                            {
-                                threads_.erase(threadId);
-                                --curThreadSize_;
-                                --idleThreadSize_;
-                                std::cout << "Thread " << threadId << " is idle for too long, recycle..." << std::endl;
-                                return;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        notEmpty_.wait(lock);
-                    }
-                }
-                if (!isPoolRunning_)
-                {
-                    threads_.erase(threadId);
-                    std::cout << "Thread " << threadId << " is exiting..." << std::endl;
-                    exitCv_.notify_all();
-                    return;
-                }
-                // Get the task from the task queue
-                task = taskQue_.front();
-                taskQue_.pop();
-                --taskSize_;
-                --idleThreadSize_;
-                std::cout << "Thread " << threadId << " get the task successfully." << std::endl;
-                notFull_.notify_all();
-
-                // if there are still tasks in the task queue, notify the thread to take the task
-                if (taskSize_ > 0)
-                {
-                    notEmpty_.notify_all();
-                }
+    // Bit i is set when level i of the shared queue of node has tasks, readable without the lock
+    uint64_t nonEmpty(size_t node) const
+    {
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+            return ringQues_[node]->nonEmpty();
+        uint64_t mask = 0;
+        for (size_t q = node * queueShards_; q < (node + 1) * queueShards_; ++q)
+            mask |= taskQues_[q]->que.nonEmpty();
+        return mask;
+    }
+
+    // Pick the CPU of every initial worker and number the NUMA nodes they end up on
+    void placeWorkers()
+    {
+        const CpuTopology &topology = CpuTopology::instance();
+        const size_t NONE = static_cast<size_t>(-1);
+        queueNodeOf_.assign(topology.nodeCount(), NONE);
+        queueNodes_ = 0;
+        workerCpus_.clear();
+        workerNodes_.clear();
+        nodeLeaders_.clear();
+        for (size_t i = 0; i < initThreadSize_; ++i)
+        {
+            int cpu = topology.place(affinityMode_, cpuset_, i);
+            size_t &node = queueNodeOf_[topology.nodeOf(cpu)];
+            if (node == NONE)
+            {
+                node = queueNodes_++;
+                nodeLeaders_.push_back(i);
             }
-            // Execute the task
-            if (task)
-                task();
-            idleThreadSize_.fetch_add(1);
-            lastTime = std::chrono::high_resolution_clock().now();
+            workerCpus_.push_back(cpu);
+            workerNodes_.push_back(node);
         }
-    } // Thread function
 
-    bool checkRunningState() const
+        // Unpinned workers move around: a single queue
+        if (affinityMode_ == AffinityMode::AFFINITY_NONE || queueNodes_ == 0)
+        {
+            queueNodes_ = 1;
+            nodeLeaders_.assign(1, 0);
+            workerNodes_.assign(initThreadSize_, 0);
+            queueNodeOf_.assign(topology.nodeCount(), 0);
+        }
+        // Submitters on a node without workers use the queues in turn
+        for (size_t node = 0; node < queueNodeOf_.size(); ++node)
+        {
+            if (queueNodeOf_[node] == NONE)
+                queueNodeOf_[node] = node % queueNodes_;
+        }
+    }
+
+    void createQueue(size_t node)
     {
-        return isPoolRunning_;
-    }; // Check the state of the poo
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+        {
+            ringQues_[node] = std::make_unique<MultiLevelRing<Task>>(priorityLevels_, maxTaskQueSize_, agingRounds_);
+        }
+        else
+        {
+            size_t shards = queueNodes_ * queueShards_;
+            size_t capacity = std::max<size_t>(1, (maxTaskQueSize_ + shards - 1) / shards);
+            for (size_t q = node * queueShards_; q < (node + 1) * queueShards_; ++q)
+                taskQues_[q] = std::make_unique<QueueShard>(priorityLevels_, agingRounds_, capacity);
+        }
+    }
 
-private:
-    std::unordered_map<int, std::unique_ptr<Thread>> threads_; // Threads
-    size_t initThreadSize_;                                    // Thread Size
-    size_t maxThreadSize_;                                     // Max Thread Size
-    std::atomic_int curThreadSize_;                            // current number of threads
-    std::atomic_int idleThreadSize_;                           // Number of idle threads
+    // First thing an initial worker does, right after moving to its CPU: allocate its deque and,
+    // for the first worker of a node, the shared queue of the node. Linux places a page on the node
+    // of the thread that touches it first, so they end up in memory local to the workers using them.
+    void setupWorker(Worker &self)
+    {
+        self.node = workerNodes_[self.index];
+        if (poolMode_ == PoolMode::MODE_WORK_STEALING)
+        {
+            deques_[self.index] = std::make_unique<WorkStealingDeque<Task *>>();
+        }
+        if (nodeLeaders_[self.node] == self.index)
+        {
+            createQueue(self.node);
+        }
 
-    // Users may input temporary task which we need to consider the lifetime of the task
-    // so we use intelligent pointer to manage the task
-    using Task = std::function<void()>;
-    std::queue<Task> taskQue_; // Task Queue
-    std::atomic_int taskSize_; // Task Size
-    size_t maxTaskQueSize_;    // Max Task Queue Size
+        // Do not touch the deques and queues of the others before they exist
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        ++readyWorkers_;
+        readyCv_.notify_all();
+        readyCv_.wait(lock, [&]() -> bool
+                      { return readyWorkers_ == initThreadSize_; });
+    }
+
+    // Shared queue of the node the calling thread runs on
+    size_t submitNode() const
+    {
+        if (queueNodes_ == 1)
+            return 0;
+        Worker *self = currentWorker();
+        if (self != nullptr && self->pool == this)
+            return self->node;
+        const CpuTopology &topology = CpuTopology::instance();
+        return queueNodeOf_[topology.nodeOf(CpuTopology::currentCpu())];
+    }
+
+    // Shard of the shared queue of submitNode() a task submitted by the calling thread goes to: a
+    // worker's home shard, or the one of the producer thread
+    size_t submitQueue() const
+    {
+        if (queueShards_ == 1)
+            return submitNode();
+        Worker *self = currentWorker();
+        if (self != nullptr && self->pool == this)
+            return self->queue;
+        return submitNode() * queueShards_ + producerShard();
+    }
+
+    // Shard a worker pops from, within the node pickNode() chose: with priorities the one with the
+    // most urgent tasks, else its home shard, or when that is empty the fuller of two random shards
+    // (power of two choices), which keeps the shards even without looking at all of them.
+    size_t pickQueue(Worker &self)
+    {
+        size_t node = pickNode(self.node);
+        if (queueShards_ == 1)
+            return node;
+        size_t first = node * queueShards_;
+        size_t home = node == self.node ? self.queue : first + nextRandom(self) % queueShards_;
+        if (priorityLevels_ > 1)
+        {
+            size_t best = home;
+            uint64_t bestMask = taskQues_[home]->que.nonEmpty();
+            for (size_t q = first; q < first + queueShards_; ++q)
+            {
+                uint64_t mask = taskQues_[q]->que.nonEmpty();
+                if (mask != 0 && (bestMask == 0 || __builtin_ctzll(mask) < __builtin_ctzll(bestMask)))
+                {
+                    best = q;
+                    bestMask = mask;
+                }
+            }
+            return best;
+        }
+        if (taskQues_[home]->size.load(std::memory_order_relaxed) > 0)
+            return home;
+        size_t a = first + nextRandom(self) % queueShards_;
+        size_t b = first + nextRandom(self) % queueShards_;
+        return taskQues_[a]->size.load(std::memory_order_relaxed) >= taskQues_[b]->size.load(std::memory_order_relaxed) ? a : b;
+    }
+
+    // Node whose shared queue a worker of home pops from: its own, unless it is empty or another
+    // node has more urgent tasks
+    size_t pickNode(size_t home) const
+    {
+        if (queueNodes_ == 1)
+            return 0;
+        size_t best = home;
+        uint64_t bestMask = nonEmpty(home);
+        for (size_t node = 0; node < queueNodes_; ++node)
+        {
+            uint64_t mask = nonEmpty(node);
+            if (mask != 0 && (bestMask == 0 || __builtin_ctzll(mask) < __builtin_ctzll(bestMask)))
+            {
+                best = node;
+                bestMask = mask;
+            }
+        }
+        return best;
+    }
+
+    // Tasks in the rings of every node
+    size_t ringSize() const
+    {
+        size_t size = 0;
+        for (auto &ring : ringQues_)
+            size += ring->size();
+        return size;
+    }
+
+    // submitTask(): queue the call, or hand it to the reject policy once the queue has stayed full
+    // for waitNs. The future of a dropped task is broken.
+    template <typename Func, typename... Args>
+    auto submitWithin(int64_t waitNs, size_t level, Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        if (!checkRunningState())
+            throw std::runtime_error("ThreadPool is not running");
+        using RType = decltype(func(args...));
+        FutureState<RType> *state = FutureState<RType>::create(executor());
+        Future<RType> res(state);
+
+        // The closure owns the promise, the callable and the arguments. It is kept in the state, so
+        // that a worker waiting for the result can run it, and the queue holds a PendingRun.
+        // In the common case both fit in the inline storage of Task, so nothing is allocated.
+        state->setPending([promise = Promise<RType>(state), func = std::forward<Func>(func),
+                           args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                          { promise.run([&]() -> RType
+                                        { return std::apply(func, args); }); });
+        pushOrReject(PendingRun<RType>(state), level, waitNs);
+        return res;
+    }
+
+    // submitWithin() for a task that is dropped unrun when it is dequeued after its token was
+    // cancelled or after deadlineNs (see nowNs()). The check lives in the closure, so it is made by
+    // whoever dequeues the task, a worker or a waiter running it itself, and plain tasks pay nothing.
+    template <typename Func, typename... Args>
+    auto submitGuarded(CancellationToken token, int64_t deadlineNs, Func &&func, Args &&...args) -> Future<decltype(func(args...))>
+    {
+        if (!checkRunningState())
+            throw std::runtime_error("ThreadPool is not running");
+        using RType = decltype(func(args...));
+        FutureState<RType> *state = FutureState<RType>::create(executor());
+        Future<RType> res(state);
+
+        state->setPending([this, promise = Promise<RType>(state), token = std::move(token), deadlineNs,
+                           func = std::forward<Func>(func), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                          {
+                              if (token.isCancelled() || (deadlineNs != TimerWheel::NEVER && nowNs() >= deadlineNs))
+                              {
+                                  skipped_.fetch_add(1, std::memory_order_relaxed);
+                                  promise.fail(std::make_exception_ptr(TaskCancelledError(
+                                      token.isCancelled() ? "task cancelled before it started" : "task deadline passed before it started")));
+                                  return;
+                              }
+                              promise.run([&]() -> RType
+                                          { return std::apply(func, args); }); });
+        pushOrReject(PendingRun<RType>(state), defaultLevel(), submitWaitNs_);
+        return res;
+    }
+
+    // Queue the task, or apply the reject policy to it once the queue has stayed full for waitNs.
+    // False if the task was dropped.
+    bool pushOrReject(Task task, size_t level, int64_t waitNs)
+    {
+        if (pushTask(task, level, waitNs))
+            return true;
+        // A worker may be one of those that have to drain the queue, a task it gave up on may be one
+        // it waits for: it runs the task at once instead, like a nested call
+        if (isWorker(this))
+        {
+            runTask(task);
+            return true;
+        }
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+
+        switch (rejectPolicy_)
+        {
+        case RejectPolicy::REJECT_THROW:
+            throw QueueFullError();
+        case RejectPolicy::REJECT_CALLER_RUNS:
+            runTask(task);
+            return true;
+        case RejectPolicy::REJECT_DISCARD_OLDEST:
+            return evictAndPush(task, level);
+        case RejectPolicy::REJECT_CUSTOM:
+            rejectHandler_(task);
+            return !task;
+        default:
+            return false;
+        }
+    }
+
+    // REJECT_DISCARD_OLDEST: make room by dropping the oldest task of the least urgent level, as
+    // long as it is not more urgent than the new one. The dropped task breaks its future outside
+    // the lock, its continuations may submit again.
+    bool evictAndPush(Task &task, size_t level)
+    {
+        Task victim;
+        size_t queue = submitQueue();
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+        {
+            MultiLevelRing<Task> &ring = *ringQues_[queue];
+            // Another producer may take the room first, evict again then
+            while (ring.evict(level, victim))
+            {
+                taskSize_.fetch_sub(1, std::memory_order_relaxed);
+                evicted_.fetch_add(1, std::memory_order_relaxed);
+                victim = Task();
+                if (pushTask(task, level, 0))
+                    return true;
+            }
+            return false;
+        }
+
+        QueueShard &shard = *taskQues_[queue];
+        {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            if (!shard.que.evict(level, victim))
+                return false;
+            evicted_.fetch_add(1, std::memory_order_relaxed);
+            task.setQueuedAt(nowNs());
+            shard.que.push(level, std::move(task));
+        }
+        wakeWorkers(1, queue / queueShards_);
+        return true;
+    }
+
+    // Queue a task for the workers, false if the queue stayed full for waitNs. The task is only
+    // moved from when it was queued. A worker of the pool does not wait for room at all.
+    bool pushTask(Task &task, size_t level, int64_t waitNs)
+    {
+        task.setQueuedAt(nowNs());
+
+        // work stealing mode: tasks submitted from a worker go to its own deque, unless they
+        // have a priority of their own, the deques have none
+        if (poolMode_ == PoolMode::MODE_WORK_STEALING && level == defaultLevel())
+        {
+            Worker *self = currentWorker();
+            if (self != nullptr && self->pool == this)
+            {
+                pushLocal(self->index, SlabPool<Task>::instance().create(std::move(task)));
+                return true;
+            }
+        }
+
+        // external submission, in work stealing mode the shared queue is the global injection queue
+        if (waitNs != 0 && isWorker(this))
+            waitNs = 0;
+        size_t queue = submitQueue();
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+            return pushLockFree(task, level, queue, waitNs);
+
+        QueueShard &shard = *taskQues_[queue];
+        {
+            std::unique_lock<std::mutex> lock(shard.mtx);
+            auto hasRoom = [&]() -> bool
+            { return shard.que.size() < shard.capacity; };
+            // Without a wait, do not go through the condition variable: a timed wait that has
+            // already timed out still costs a system call
+            if (waitNs == 0 ? !hasRoom() : !shard.notFull.wait_for(lock, std::chrono::nanoseconds(waitNs), hasRoom))
+                return false;
+
+            shard.que.push(level, std::move(task));
+            shard.size.store(static_cast<int>(shard.que.size()), std::memory_order_relaxed);
+            noteQueueDepth(++taskSize_);
+        }
+        wakeWorkers(1, queue / queueShards_);
+        kickController();
+        return true;
+    }
+
+    bool pushLockFree(Task &task, size_t level, size_t node, int64_t waitNs)
+    {
+        MultiLevelRing<Task> &ring = *ringQues_[node];
+        if (!pushRing(ring, level, task) && (waitNs == 0 || !waitRingSpace(task, level, ring, waitNs)))
+            return false;
+        noteQueueDepth(ring.size());
+        wakeWorkers(1, node);
+        kickController();
+        return true;
+    }
+
+    // submitBulk()/submitBatch(): queue n tasks that each run the next index of body not taken yet
+    TaskBatch queueBatch(size_t n, std::shared_ptr<void> body, BatchState::Call call)
+    {
+        if (!checkRunningState())
+            throw std::runtime_error("ThreadPool is not running");
+        BatchState *state = BatchState::create(n, std::move(body), call, executor());
+        TaskBatch batch(state);
+
+        size_t made = 0; // A task that was made but not queued rejects itself when destroyed
+        size_t pushed = pushTasks(n, [&](size_t) -> Task
+                                  { ++made;
+                                    return [ticket = BatchTicket(state)]() mutable
+                                    { ticket.run(); }; });
+        if (pushed < n)
+        {
+            rejected_.fetch_add(n - pushed, std::memory_order_relaxed);
+            if (made < n)
+                state->reject(n - made);
+        }
+        return batch;
+    }
+
+    // Queue the tasks make(0) ... make(n - 1) taking the lock and waking the workers once per chunk
+    // instead of once per task. Returns how many were queued; when the queue stays full the
+    // remaining tasks are not created, except for one the lock-free path may have created and destroyed.
+    // With overflow, a full queue is not waited for: that task is handed back in *overflow instead.
+    // Without, a worker of the pool does not wait either: it runs the tasks that do not fit itself,
+    // and they count as queued.
+    template <typename MakeTask>
+    size_t pushTasks(size_t n, MakeTask &&make, Task *overflow = nullptr)
+    {
+        // The whole batch is queued at the same time as far as the wait statistics go
+        int64_t queuedAt = nowNs();
+        size_t level = defaultLevel();
+        auto stamped = [&](size_t i) -> Task
+        {
+            Task task = make(i);
+            task.setQueuedAt(queuedAt);
+            return task;
+        };
+
+        size_t pushed = 0;
+        if (poolMode_ == PoolMode::MODE_WORK_STEALING)
+        {
+            Worker *self = currentWorker();
+            if (self != nullptr && self->pool == this)
+            {
+                for (; pushed < n; ++pushed)
+                    deques_[self->index]->push(SlabPool<Task>::instance().create(stamped(pushed)));
+                noteQueueDepth(deques_[self->index]->size());
+                wakeWorkers(n, self->node);
+                return n;
+            }
+        }
+
+        bool runsOverflow = overflow == nullptr && isWorker(this);
+        size_t queue = submitQueue();
+        size_t node = queue / queueShards_;
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+        {
+            MultiLevelRing<Task> &ring = *ringQues_[node];
+            size_t woken = 0;
+            for (; pushed < n; ++pushed)
+            {
+                Task task = stamped(pushed);
+                if (!pushRing(ring, level, task))
+                {
+                    if (overflow != nullptr)
+                    {
+                        *overflow = std::move(task);
+                        break;
+                    }
+                    if (runsOverflow)
+                    {
+                        runTask(task);
+                        continue;
+                    }
+                    // Let the workers drain what is queued so far before waiting for room
+                    wakeWorkers(pushed - woken, node);
+                    woken = pushed;
+                    if (!waitRingSpace(task, level, ring, submitWaitNs_))
+                        break;
+                }
+            }
+            noteQueueDepth(ring.size());
+            wakeWorkers(pushed - woken, node);
+            kickController();
+            return pushed;
+        }
+
+        QueueShard &shard = *taskQues_[queue];
+        std::unique_lock<std::mutex> lock(shard.mtx);
+        while (pushed < n)
+        {
+            if (runsOverflow && shard.que.size() >= shard.capacity)
+            {
+                lock.unlock();
+                Task task = stamped(pushed++);
+                runTask(task);
+                lock.lock();
+                continue;
+            }
+            if (overflow != nullptr ? shard.que.size() >= shard.capacity
+                                    : !shard.notFull.wait_for(lock, std::chrono::nanoseconds(submitWaitNs_),
+                                                              [&]() -> bool
+                                                              { return shard.que.size() < shard.capacity; }))
+            {
+                break;
+            }
+
+            // Fill all the room there is, then wake one worker per queued task at most
+            size_t room = std::min(n - pushed, shard.capacity - shard.que.size());
+            for (size_t i = 0; i < room; ++i)
+                shard.que.emplace(level, stamped(pushed++));
+            shard.size.store(static_cast<int>(shard.que.size()), std::memory_order_relaxed);
+            noteQueueDepth(taskSize_ += static_cast<int>(room));
+
+            lock.unlock();
+            wakeWorkers(room, node);
+            kickController();
+            lock.lock();
+        }
+        return pushed;
+    }
+
+    // Each ring has maxTaskQueSize_ slots per level, and there is one ring per node: taskSize_ keeps
+    // the tasks of all of them within maxTaskQueSize_, as the locked queues are
+    bool pushRing(MultiLevelRing<Task> &ring, size_t level, Task &task)
+    {
+        if (taskSize_.fetch_add(1, std::memory_order_relaxed) < static_cast<int>(maxTaskQueSize_) &&
+            ring.push(level, std::move(task)))
+        {
+            return true;
+        }
+        taskSize_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // The ring is full: fall back to the mutex and wait up to waitNs for a consumer to make room
+    bool waitRingSpace(Task &task, size_t level, MultiLevelRing<Task> &ring, int64_t waitNs)
+    {
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        ++waitingProducers_;
+        // pairs with the fence in notifyProducers()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool pushed = notFull_.wait_for(lock, std::chrono::nanoseconds(waitNs),
+                                        [&]() -> bool
+                                        { return pushRing(ring, level, task); });
+        --waitingProducers_;
+        return pushed;
+    }
+
+    // Tasks in the shared queues of every node
+    size_t queuedTasks() const
+    {
+        return queueMode_ == QueueMode::QUEUE_LOCK_FREE ? ringSize() : static_cast<size_t>(taskSize_);
+    }
+
+    // cached mode: wake the controller when more tasks are queued than there are idle workers.
+    // Called after wakeWorkers(), whose fence pairs with the one in controlLoop(). Once the
+    // controller is awake this is a single load.
+    void kickController()
+    {
+        if (poolMode_ != PoolMode::MODE_CACHED || growKick_.load(std::memory_order_relaxed) ||
+            queuedTasks() <= static_cast<size_t>(std::max(0, idleThreadSize_.load())) ||
+            curThreadSize_ >= static_cast<int>(maxThreadSize_) || growKick_.exchange(true))
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(controlMtx_);
+        controlCv_.notify_one();
+    }
+
+    // Wake the producers blocked on a full ring, called after a lock-free pop
+    void notifyProducers()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waitingProducers_.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(taskQueMtx_);
+            notFull_.notify_all();
+        }
+    }
+
+    // Unpark up to n parked workers for n new tasks queued on node, preferring the workers of that
+    // node. Workers already searching for a task will pick them up, so they are subtracted:
+    // a single submit wakes nobody while one is searching.
+    void wakeWorkers(size_t n, size_t node = ANY_NODE)
+    {
+        // pairs with the fence in park(): either we see the parked worker or it sees the new task
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t searching = static_cast<size_t>(searching_.load(std::memory_order_relaxed));
+        if (n <= searching || parkedSize_.load(std::memory_order_relaxed) == 0)
+            return;
+
+        for (n -= searching; n > 0; --n)
+        {
+            if (!unparkOne(node))
+                return;
+        }
+    }
+
+    // Unpark the most recently parked worker of node, or of any node if it has none parked.
+    // It counts as searching. False if no worker is parked.
+    bool unparkOne(size_t node = ANY_NODE)
+    {
+        Worker *worker = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            if (idleWorkers_.empty())
+                return false;
+            // The most recently parked worker has the warmest cache
+            auto it = idleWorkers_.end() - 1;
+            if (node != ANY_NODE && queueNodes_ > 1)
+            {
+                auto local = std::find_if(idleWorkers_.rbegin(), idleWorkers_.rend(), [&](Worker *w) -> bool
+                                          { return w->node == node; });
+                if (local != idleWorkers_.rend())
+                    it = std::next(local).base();
+            }
+            worker = *it;
+            idleWorkers_.erase(it);
+            --parkedSize_;
+            worker->parked = false;
+            ++searching_;
+        }
+        unpark(worker);
+        return true;
+    }
+
+    // Hand the permit to a worker already removed from idleWorkers_
+    void unpark(Worker *worker)
+    {
+        std::lock_guard<std::mutex> lock(worker->mtx);
+        worker->notified = true;
+        worker->unparkTime = std::chrono::steady_clock::now();
+        ++unparks_;
+        worker->cv.notify_one();
+    }
+
+    // Wake every parked worker, used when the pool stops
+    void unparkAll()
+    {
+        std::vector<Worker *> workers;
+        {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            workers.swap(idleWorkers_);
+            parkedSize_ = 0;
+            for (Worker *worker : workers)
+                worker->parked = false;
+        }
+        for (Worker *worker : workers)
+            unpark(worker);
+    }
+
+    // Busy wait for a task before parking: spin, then yield. Returns true when a task showed up,
+    // the worker then counts as searching, like a worker that was unparked.
+    bool spin(Worker &self)
+    {
+        auto now = std::chrono::steady_clock::now();
+        int64_t window = spinWindowNs_;
+        if (idleMode_ == IdleMode::IDLE_ADAPTIVE)
+        {
+            if (!self.idle)
+            {
+                self.idle = true;
+                self.idleSince = now.time_since_epoch() / std::chrono::nanoseconds(1);
+            }
+            // Tasks usually come later than we are willing to spin: park straight away
+            if (self.avgIdleNs > window)
+                return false;
+            window = std::min(window, 2 * self.avgIdleNs);
+        }
+
+        // While we spin, submitters do not need to unpark anybody for their first task
+        ++searching_;
+        auto deadline = now + std::chrono::nanoseconds(window);
+        bool found = false;
+        while (!found && isPoolRunning_)
+        {
+            for (int i = 0; i < 64; ++i)
+                cpuRelax();
+            found = hasPendingTask();
+            if (std::chrono::steady_clock::now() >= deadline)
+                break;
+        }
+        for (int i = 0; !found && isPoolRunning_ && i < IDLE_YIELD_ROUNDS; ++i)
+        {
+            std::this_thread::yield();
+            found = hasPendingTask();
+        }
+
+        if (!found)
+        {
+            --searching_;
+            return false;
+        }
+        ++spinHits_;
+        self.woken = true;
+        return true;
+    }
+
+    // Block the worker until unpark(), false when it has exited because the controller retired it
+    bool park(Worker &self, int threadId)
+    {
+        {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            idleWorkers_.push_back(&self);
+            self.parked = true;
+            ++parkedSize_;
+        }
+        // pairs with the fence in wakeWorkers(): either we see the new task or the pusher sees us parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hasPendingTask() || !isPoolRunning_ || stopping_)
+        {
+            // A waker got to us first, it counted us as searching, unless it was the controller
+            if (!unlist(self) && !takePermit(self))
+            {
+                exitRetired(self, threadId);
+                return false;
+            }
+            return true;
+        }
+
+        int64_t dueNs = keepTime(self);
+        ++parks_;
+        std::unique_lock<std::mutex> lock(self.mtx);
+        while (!self.notified)
+        {
+            if (dueNs != TimerWheel::NEVER)
+            {
+                // Timekeeper: get up when the next timer is due or an earlier one was armed
+                int64_t now = nowNs();
+                if (self.timerKick || now >= dueNs)
+                    break;
+                self.cv.wait_for(lock, std::chrono::nanoseconds(dueNs - now));
+            }
+            else
+            {
+                self.cv.wait(lock);
+            }
+        }
+        self.timerKick = false;
+        if (!self.notified)
+        {
+            // Back to the worker loop to collect the timers, still listed in idleWorkers_
+            lock.unlock();
+            resignTimekeeper(self);
+            if (!unlist(self) && !takePermit(self))
+            {
+                exitRetired(self, threadId);
+                return false;
+            }
+            return true;
+        }
+        self.notified = false;
+        if (self.retiring)
+        {
+            lock.unlock();
+            exitRetired(self, threadId);
+            return false;
+        }
+        auto unparkTime = self.unparkTime;
+        lock.unlock();
+        if (dueNs != TimerWheel::NEVER)
+            resignTimekeeper(self);
+        recordWakeup(std::chrono::steady_clock::now() - unparkTime);
+        self.woken = true;
+        return true;
+    }
+
+    // A parking worker keeps time when timers are armed and nobody else does: instead of sleeping
+    // until unparked it sleeps until the next timer is due. Returns that time, or TimerWheel::NEVER.
+    int64_t keepTime(Worker &self)
+    {
+        if (timers_.size() == 0)
+            return TimerWheel::NEVER;
+        std::lock_guard<std::mutex> lock(keeperMtx_);
+        if (keeper_ != nullptr)
+            return TimerWheel::NEVER;
+        keeper_ = &self;
+        keeperDueNs_ = timers_.nextDueNs();
+        return keeperDueNs_;
+    }
+
+    void resignTimekeeper(Worker &self)
+    {
+        std::lock_guard<std::mutex> lock(keeperMtx_);
+        if (keeper_ == &self)
+            keeper_ = nullptr;
+    }
+
+    // A timer was armed: wake the timekeeper if the timer is due before it gets up. Without a
+    // timekeeper, unpark a worker to take the job, unless none is parked: the running workers
+    // check the timers between tasks.
+    void wakeTimekeeper()
+    {
+        // pairs with the fence in park(): either we see the parked worker or it sees the timer
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t dueNs = timers_.nextDueNs();
+        {
+            std::lock_guard<std::mutex> lock(keeperMtx_);
+            if (keeper_ != nullptr)
+            {
+                if (dueNs < keeperDueNs_)
+                {
+                    keeperDueNs_ = dueNs;
+                    std::lock_guard<std::mutex> workerLock(keeper_->mtx);
+                    keeper_->timerKick = true;
+                    keeper_->cv.notify_one();
+                }
+                return;
+            }
+        }
+        if (parkedSize_.load(std::memory_order_relaxed) > 0)
+            unparkOne();
+    }
+
+    template <typename Func, typename... Args>
+    TimerHandle scheduleTimer(int64_t dueNs, int64_t periodNs, Func &&func, Args &&...args)
+    {
+        if (!checkRunningState())
+            throw std::runtime_error("ThreadPool is not running");
+        TimerNode *node = timers_.schedule([func = std::forward<Func>(func),
+                                            args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                                           { std::apply(func, args); },
+                                           dueNs, periodNs);
+        TimerHandle handle(node);
+        wakeTimekeeper();
+        return handle;
+    }
+
+    // Queue the firings of the timers that are due, as one batch. One worker at a time collects them.
+    void pollTimers(Worker &self)
+    {
+        if (!timers_.collect(nowNs(), self.expired) || self.expired.empty())
+            return;
+        // Now a producer: still counted as searching, it would be subtracted from its own wakeups
+        if (self.woken)
+        {
+            self.woken = false;
+            --searching_;
+        }
+
+        // Never wait for room here: the other workers may all be collecting timers as well, and
+        // nobody would drain the queue. The firings that do not fit run on this worker.
+        Task overflow;
+        size_t n = self.expired.size();
+        size_t next = pushTasks(n, [&](size_t i) -> Task
+                                { return std::move(self.expired[i]); },
+                                &overflow);
+        if (overflow)
+        {
+            runTask(overflow);
+            ++next;
+        }
+        for (; next < n; ++next)
+            runTask(self.expired[next]);
+        self.expired.clear();
+    }
+
+    // Queue a continuation. It is never waited for: the caller may be the worker that has to drain
+    // the queue. If the queue is full, or the pool is not running, it runs on the calling thread.
+    static void submitContinuation(void *owner, Task &&task)
+    {
+        ThreadPool *pool = static_cast<ThreadPool *>(owner);
+        if (pool->isPoolRunning_)
+        {
+            Task overflow;
+            if (pool->pushTasks(1, [&](size_t) -> Task
+                                { return std::move(task); },
+                                &overflow) == 1)
+            {
+                return;
+            }
+            if (overflow)
+                task = std::move(overflow);
+        }
+        pool->runTask(task);
+    }
+
+    static bool isWorker(void *owner)
+    {
+        Worker *self = currentWorker();
+        return self != nullptr && self->pool == owner;
+    }
+
+    // A worker waits for a future whose task is running elsewhere: run one queued task in the
+    // meantime, the newest one, see findTask(). Each one adds to the stack of the worker,
+    // HELP_MAX_DEPTH bounds the nesting.
+    static bool helpWhileWaiting(void *owner)
+    {
+        ThreadPool *pool = static_cast<ThreadPool *>(owner);
+        Worker *self = currentWorker();
+        Task task;
+        if (self == nullptr || self->pool != pool || self->helpDepth >= HELP_MAX_DEPTH || !pool->isPoolRunning_ ||
+            !pool->findTask(*self, task, true))
+        {
+            return false;
+        }
+
+        // Counted as a task of this worker, its time is already part of the task that waits
+        int64_t start = nowNs();
+        ++self->helpDepth;
+        pool->runTask(task);
+        --self->helpDepth;
+        WorkerCounters &counters = self->counters;
+        addRelaxed(counters.tasks, 1);
+        counters.waitTime.record(start - task.queuedAt());
+        counters.execTime.record(nowNs() - start);
+        return true;
+    }
+
+    // Queue the resumption of a coroutine without waiting for room, false if it could not be queued
+    template <typename Handle>
+    bool queueResume(Handle handle)
+    {
+        if (!isPoolRunning_)
+            return false;
+        Task overflow;
+        return pushTasks(1, [&](size_t) -> Task
+                         { return [handle]() mutable
+                           { handle.resume(); }; },
+                         &overflow) == 1;
+    }
+
+    // Remove a worker from idleWorkers_, false if a waker already took it out
+    bool unlist(Worker &self)
+    {
+        std::lock_guard<std::mutex> lock(idleMtx_);
+        if (!self.parked)
+            return false;
+        idleWorkers_.erase(std::find(idleWorkers_.begin(), idleWorkers_.end(), &self));
+        self.parked = false;
+        --parkedSize_;
+        return true;
+    }
+
+    // A waker has taken the worker out of idleWorkers_ and is about to unpark it. Wait for the
+    // permit: the waker still uses the worker's mutex, so the worker must not exit before that.
+    // False if the waker was the controller retiring the worker.
+    bool takePermit(Worker &self)
+    {
+        std::unique_lock<std::mutex> lock(self.mtx);
+        self.cv.wait(lock, [&]() -> bool
+                     { return self.notified; });
+        self.notified = false;
+        self.woken = !self.retiring;
+        return !self.retiring;
+    }
+
+    // Exit a worker the controller has retired, see retireWorkers()
+    void exitRetired(Worker &self, int threadId)
+    {
+        // Hand the timers over to another parked worker, the worker may have resigned already on
+        // its way back to collect them
+        resignTimekeeper(self);
+        if (timers_.size() != 0)
+            wakeTimekeeper();
+        currentWorker() = nullptr;
+        unregisterWorker(self);
+        // The thread cannot join itself: the controller does, see reapThreads()
+        std::lock_guard<std::mutex> lock(taskQueMtx_);
+        auto it = threads_.find(threadId);
+        retiredThreads_.push_back(std::move(it->second));
+        threads_.erase(it);
+        --curThreadSize_;
+        --idleThreadSize_;
+        exitCv_.notify_all();
+    }
+
+    // Join the threads of the workers the controller has retired
+    void reapThreads()
+    {
+        std::vector<std::unique_ptr<Thread>> threads;
+        {
+            std::lock_guard<std::mutex> lock(taskQueMtx_);
+            threads.swap(retiredThreads_);
+        }
+        for (auto &thread : threads)
+            thread->join();
+    }
+
+    // shutdown(): stop the controller, then let the workers drain the queues until deadline and
+    // exit once they find them empty. After the deadline the remaining workers exit after their
+    // current task. Every thread is joined before the queues are emptied.
+    size_t stop(bool drain, std::chrono::steady_clock::time_point deadline)
+    {
+        std::lock_guard<std::mutex> guard(shutdownMtx_);
+        if (!isPoolRunning_)
+            return 0;
+
+        // From here on the number of workers only goes down
+        stopping_ = true;
+        if (controller_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(controlMtx_);
+            }
+            controlCv_.notify_all();
+            controller_.join();
+        }
+
+        if (drain)
+        {
+            unparkAll();
+            std::unique_lock<std::mutex> lock(taskQueMtx_);
+            auto exited = [&]() -> bool
+            { return curThreadSize_ == 0; };
+            if (deadline == std::chrono::steady_clock::time_point::max())
+                exitCv_.wait(lock, exited);
+            else
+                exitCv_.wait_until(lock, deadline, exited);
+        }
+        isPoolRunning_ = false;
+        unparkAll();
+
+        std::vector<std::unique_ptr<Thread>> threads;
+        {
+            std::unique_lock<std::mutex> lock(taskQueMtx_);
+            exitCv_.wait(lock, [&]() -> bool
+                         { return curThreadSize_ == 0; });
+            for (auto &thread : threads_)
+                threads.push_back(std::move(thread.second));
+            threads_.clear();
+            for (auto &thread : retiredThreads_)
+                threads.push_back(std::move(thread));
+            retiredThreads_.clear();
+        }
+        for (auto &thread : threads)
+            thread->join();
+
+        // Tasks left in the queues are never run, release them. Their futures break now, while the
+        // pool is intact: continuations attached to them run inline since the pool is not running.
+        // The timers that have not fired are disarmed, a restart does not bring them back.
+        size_t dropped = queuedTasks() + timers_.clear();
+        for (auto &deque : deques_)
+        {
+            Task *task = nullptr;
+            while (deque->pop(task))
+            {
+                SlabPool<Task>::instance().destroy(task);
+                ++dropped;
+            }
+        }
+        deques_.clear();
+        taskQues_.clear();
+        ringQues_.clear();
+        taskSize_ = 0;
+        return dropped;
+    }
+
+    // Make the counters of a worker visible to getStats()
+    void registerWorker(Worker &self)
+    {
+        std::lock_guard<std::mutex> lock(statsMtx_);
+        liveWorkers_.push_back(&self);
+    }
+
+    // The worker exits: fold its counters into the totals of the exited workers
+    void unregisterWorker(Worker &self)
+    {
+        std::lock_guard<std::mutex> lock(statsMtx_);
+        liveWorkers_.erase(std::find(liveWorkers_.begin(), liveWorkers_.end(), &self));
+        exited_.tasks += self.counters.tasks.load(std::memory_order_relaxed);
+        exited_.busyNs += self.counters.busyNs.load(std::memory_order_relaxed);
+        exited_.idleNs += self.counters.idleNs.load(std::memory_order_relaxed);
+        self.counters.waitTime.snapshot(exited_.waitTime);
+        self.counters.execTime.snapshot(exited_.execTime);
+    }
+
+    // Record the depth of a queue right after a push
+    void noteQueueDepth(size_t depth)
+    {
+        uint64_t max = queueHighWater_.load(std::memory_order_relaxed);
+        while (depth > max && !queueHighWater_.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void recordWakeup(std::chrono::steady_clock::duration latency)
+    {
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+        wakeLatencyNs_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = maxWakeLatencyNs_.load(std::memory_order_relaxed);
+        while (ns > max && !maxWakeLatencyNs_.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Run a task on the current thread, exceptions escaping it go to the exception handler. Those
+    // come from post(), timers and strands; a task with a Future or a batch catches its own.
+    void runTask(Task &task)
+    {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            if (exceptionHandler_)
+            {
+                exceptionHandler_(std::current_exception());
+            }
+            else
+            {
+                unhandled_.fetch_add(1, std::memory_order_relaxed);
+                std::cerr << "Unhandled exception in a ThreadPool task, see setExceptionHandler()" << std::endl;
+            }
+        }
+    }
+
+    // Grow the cached pool by n threads. They are listed under taskQueMtx_ and started after it
+    // is released: only a thread itself removes its entry from threads_.
+    void addThreads(size_t n)
+    {
+        std::vector<Thread *> added;
+        {
+            std::lock_guard<std::mutex> lock(taskQueMtx_);
+            for (size_t i = 0; i < n; ++i)
+            {
+                size_t index = threads_.size();
+                auto ptr = std::make_unique<Thread>([this, index](int threadId)
+                                                    { this->threadFunc(threadId, index, false); });
+                added.push_back(ptr.get());
+                threads_.emplace(ptr->getThreadId(), std::move(ptr));
+                ++curThreadSize_;
+                ++idleThreadSize_;
+            }
+        }
+        for (Thread *thread : added)
+            thread->start();
+    }
+
+    // Retire up to n parked workers, the ones parked the longest first: their caches are the coldest
+    void retireWorkers(size_t n)
+    {
+        std::vector<Worker *> workers;
+        {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            n = std::min(n, idleWorkers_.size());
+            workers.assign(idleWorkers_.begin(), idleWorkers_.begin() + n);
+            idleWorkers_.erase(idleWorkers_.begin(), idleWorkers_.begin() + n);
+            parkedSize_ -= static_cast<int>(n);
+            for (Worker *worker : workers)
+                worker->parked = false;
+        }
+        // Like unpark(), but the permit tells the worker to exit and it is not counted as searching
+        for (Worker *worker : workers)
+        {
+            std::lock_guard<std::mutex> lock(worker->mtx);
+            worker->retiring = true;
+            worker->notified = true;
+            worker->cv.notify_one();
+        }
+    }
+
+    // Totals of every worker, exited ones included, sampled by the controller
+    struct ControlSample
+    {
+        int64_t timeNs;
+        uint64_t tasks;
+        uint64_t waitNs; // Queue wait of those tasks, summed
+        uint64_t busyNs;
+        size_t queued; // Tasks in the shared queues
+    };
+
+    ControlSample sampleControl() const
+    {
+        std::lock_guard<std::mutex> lock(statsMtx_);
+        ControlSample sample{nowNs(), exited_.tasks, exited_.waitTime.sum(), exited_.busyNs, queuedTasks()};
+        for (Worker *worker : liveWorkers_)
+        {
+            const WorkerCounters &counters = worker->counters;
+            sample.tasks += counters.tasks.load(std::memory_order_relaxed);
+            sample.waitNs += counters.waitTime.sum();
+            sample.busyNs += counters.busyNs.load(std::memory_order_relaxed);
+        }
+        return sample;
+    }
+
+    // cached mode: size the pool from what the workers measure. It sleeps while the pool is at its
+    // minimum size without a backlog and a submit wakes it, see kickController(). Otherwise every
+    // CACHED_CONTROL_MS it grows the pool while tasks wait longer than growWaitNs_, and shrinks it
+    // once the threads have been less than CACHED_SHRINK_UTILIZATION busy for threadIdleNs_, down
+    // to CACHED_TARGET_UTILIZATION. The gap between the two is the hysteresis that keeps a bursty
+    // load from making the pool oscillate.
+    void controlLoop()
+    {
+        ControlSample last = sampleControl();
+        int64_t lowSince = 0; // Start of the current run of underused periods, 0 if none
+        double lowBusy = 0;   // Busy threads integrated over that run, in thread-nanoseconds
+        while (!stopping_)
+        {
+            if (static_cast<size_t>(curThreadSize_) <= minThreadSize_ && !hasBacklog())
+            {
+                growKick_.store(false);
+                // pairs with the fence in wakeWorkers(): either we see the backlog or the submitter sees growKick_ cleared
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!hasBacklog())
+                {
+                    std::unique_lock<std::mutex> lock(controlMtx_);
+                    controlCv_.wait(lock, [&]() -> bool
+                                    { return growKick_.load() || stopping_; });
+                }
+                last = sampleControl();
+                lowSince = 0;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(controlMtx_);
+                controlCv_.wait_for(lock, std::chrono::milliseconds(CACHED_CONTROL_MS), [&]() -> bool
+                                    { return stopping_.load(); });
+            }
+            if (stopping_)
+                break;
+            reapThreads();
+
+            ControlSample now = sampleControl();
+            double elapsed = static_cast<double>(std::max<int64_t>(1, now.timeNs - last.timeNs));
+            uint64_t tasks = now.tasks - last.tasks;
+            uint64_t waitNs = now.waitNs - last.waitNs;
+            size_t cur = static_cast<size_t>(std::max(0, curThreadSize_.load()));
+            size_t idle = static_cast<size_t>(std::max(0, idleThreadSize_.load()));
+            size_t queued = now.queued;
+            // Busy threads: time spent in the tasks that finished, or the tasks running now if more
+            double busy = std::max(static_cast<double>(now.busyNs - last.busyNs) / elapsed,
+                                   static_cast<double>(cur - std::min(cur, idle)));
+            // Tasks submitted in the period: the ones started plus the growth of the queues
+            double arrived = std::max(0.0, static_cast<double>(tasks) + static_cast<double>(queued) -
+                                               static_cast<double>(last.queued));
+            last = now;
+
+            if (queued > idle && cur < maxThreadSize_)
+            {
+                // Wait of the tasks started in the period, or the wait of the backlog by Little's law:
+                // queued tasks over the rate they are taken. Nothing started at all: every thread is stuck.
+                double wait = tasks == 0 ? elapsed + growWaitNs_
+                                         : std::max(static_cast<double>(waitNs) / tasks, queued * elapsed / tasks);
+                if (wait > growWaitNs_)
+                {
+                    // Enough threads for the tasks to arrive no faster than they are taken at the target
+                    // utilization, at least one more to work off the backlog, at most twice as many
+                    size_t grow = cur;
+                    if (tasks != 0)
+                    {
+                        double needed = std::ceil(busy * arrived / tasks / CACHED_TARGET_UTILIZATION);
+                        grow = needed > cur ? std::min(cur, static_cast<size_t>(needed) - cur) : 1;
+                    }
+                    addThreads(std::min(maxThreadSize_ - cur, std::max<size_t>(1, std::min(grow, queued - idle))));
+                    lowSince = 0;
+                    continue;
+                }
+            }
+
+            if (queued == 0 && busy < CACHED_SHRINK_UTILIZATION * cur)
+            {
+                if (lowSince == 0)
+                {
+                    lowSince = now.timeNs - static_cast<int64_t>(elapsed);
+                    lowBusy = 0;
+                }
+                lowBusy += busy * elapsed;
+                int64_t lowNs = now.timeNs - lowSince;
+                if (lowNs >= threadIdleNs_ && cur > minThreadSize_)
+                {
+                    size_t target = static_cast<size_t>(std::ceil(lowBusy / lowNs / CACHED_TARGET_UTILIZATION));
+                    target = std::max(target, minThreadSize_);
+                    if (target < cur)
+                        retireWorkers(cur - target);
+                    lowSince = 0;
+                }
+            }
+            else
+            {
+                lowSince = 0;
+            }
+        }
+    }
+
+    // More queued tasks than idle workers to take them
+    bool hasBacklog() const
+    {
+        return queuedTasks() > static_cast<size_t>(std::max(0, idleThreadSize_.load()));
+    }
+
+    // Worker loop shared by all modes: find a task, run it, park when there is nothing to do.
+    // The initial workers are placed first, the threads added by the cached mode are not.
+    void threadFunc(int threadId, size_t index, bool initial)
+    {
+        if (initial && workerCpus_[index] >= 0)
+        {
+            pinCurrentThread(workerCpus_[index]);
+        }
+        Worker self(this, threadId, index);
+        if (initial)
+        {
+            setupWorker(self);
+        }
+        self.queue = self.node * queueShards_ + index % queueShards_;
+        currentWorker() = &self;
+        registerWorker(self);
+        int64_t lastEnd = nowNs();
+
+        while (isPoolRunning_)
+        {
+            if (timers_.size() != 0 && timers_.nextDueNs() <= nowNs())
+                pollTimers(self);
+
+            Task task;
+            if (!findTask(self, task))
+            {
+                if (self.woken)
+                {
+                    // Somebody else took the task we were woken for
+                    self.woken = false;
+                    --searching_;
+                    ++futileWakeups_;
+                }
+                // Draining: the queues are empty, the tasks still running queue their follow-ups
+                // where their own workers find them
+                if (stopping_)
+                    break;
+                if (idleMode_ != IdleMode::IDLE_PARK && spin(self))
+                    continue;
+                if (!park(self, threadId))
+                    return;
+                continue;
+            }
+
+            int64_t start = nowNs();
+            if (self.idle)
+            {
+                // Average over the last few idle periods, the spin window follows it
+                self.idle = false;
+                self.avgIdleNs += (start - self.idleSince - self.avgIdleNs) / 4;
+            }
+
+            if (self.woken)
+            {
+                self.woken = false;
+                // The last searcher to find a task passes the wakeup on when more work is queued
+                if (--searching_ == 0 && hasPendingTask())
+                    wakeWorkers(1, self.node);
+            }
+
+            --idleThreadSize_;
+            runTask(task);
+            ++idleThreadSize_;
+
+            int64_t end = nowNs();
+            WorkerCounters &counters = self.counters;
+            addRelaxed(counters.tasks, 1);
+            addRelaxed(counters.busyNs, end - start);
+            addRelaxed(counters.idleNs, start - lastEnd);
+            counters.waitTime.record(start - task.queuedAt());
+            counters.execTime.record(end - start);
+            lastEnd = end;
+        }
+
+        // exit the thread, the pool is stopping. shutdown() joins it.
+        currentWorker() = nullptr;
+        unregisterWorker(self);
+        std::lock_guard<std::mutex> lock(taskQueMtx_);
+        --curThreadSize_;
+        exitCv_.notify_all();
+    } // Thread function
+
+    // work stealing mode: local deque first, then the injection queue, then the peers
+    // newest: a helping worker takes the most recently queued task instead of the oldest one. Those
+    // are the subtasks of the work it waits for, nested ones are small and keep the queue short.
+    bool findTask(Worker &self, Task &task, bool newest = false)
+    {
+        if (poolMode_ != PoolMode::MODE_WORK_STEALING)
+            return popShared(self, task, newest);
+
+        // Urgent tasks only ever go to the injection queue, do not let them wait behind local work
+        if (hasUrgentTask() && popShared(self, task, newest))
+            return true;
+
+        // The own deque is popped newest first anyway
+        Task *node = nullptr;
+        if (deques_[self.index]->pop(node) || (!popShared(self, task, newest) && stealTask(self, node)))
+        {
+            task = std::move(*node);
+            SlabPool<Task>::instance().destroy(node);
+        }
+        return static_cast<bool>(task);
+    }
+
+    // Take a task from the shared queues (the global injection queues in work stealing mode),
+    // the one of the home node first. The lock-free rings only give out their oldest task.
+    bool popShared(Worker &self, Task &task, bool newest = false)
+    {
+        if (queueMode_ == QueueMode::QUEUE_LOCK_FREE)
+        {
+            bool popped = ringQues_[pickNode(self.node)]->pop(task);
+            // Another worker emptied it first, take whatever is left anywhere
+            for (size_t node = 0; !popped && node < queueNodes_; ++node)
+                popped = ringQues_[node]->pop(task);
+            if (!popped)
+                return false;
+            taskSize_.fetch_sub(1, std::memory_order_relaxed);
+            notifyProducers();
+            return true;
+        }
+
+        if (taskSize_ == 0)
+            return false;
+        size_t picked = pickQueue(self);
+        if (popShard(*taskQues_[picked], task, newest))
+            return true;
+        // Sharded: the chosen shards were empty, take whatever is left anywhere before giving up
+        for (size_t q = 0; queueShards_ > 1 && q < taskQues_.size(); ++q)
+        {
+            if (q != picked && taskQues_[q]->size.load(std::memory_order_relaxed) > 0 && popShard(*taskQues_[q], task, newest))
+                return true;
+        }
+        return false;
+    }
+
+    bool popShard(QueueShard &shard, Task &task, bool newest = false)
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (!(newest ? shard.que.popNewest(task) : shard.que.pop(task)))
+            return false;
+        shard.size.store(static_cast<int>(shard.que.size()), std::memory_order_relaxed);
+        --taskSize_;
+        // one slot was freed, one producer is enough
+        shard.notFull.notify_one();
+        return true;
+    }
+
+    // Push a task onto the deque of the calling worker
+    void pushLocal(size_t index, Task *task)
+    {
+        deques_[index]->push(task);
+        noteQueueDepth(deques_[index]->size());
+        wakeWorkers(1, workerNodes_[index]);
+    }
+
+    // Try every other worker once, starting from a random victim. The workers of the same NUMA
+    // node go first, the others are only robbed when none of them has a task.
+    bool stealTask(Worker &self, Task *&task)
+    {
+        size_t n = deques_.size();
+        size_t start = nextRandom(self) % n;
+        for (int pass = 0; pass < (queueNodes_ > 1 ? 2 : 1); ++pass)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                size_t victim = (start + i) % n;
+                if (victim != self.index && (workerNodes_[victim] == self.node) == (pass == 0) &&
+                    deques_[victim]->steal(task))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether any queue holds a task, may be called without taskQueMtx_
+    bool hasPendingTask() const
+    {
+        if (taskSize_ > 0)
+            return true;
+        for (auto &ring : ringQues_)
+        {
+            if (ring && !ring->empty())
+                return true;
+        }
+        for (auto &deque : deques_)
+        {
+            if (!deque->empty())
+                return true;
+        }
+        return false;
+    }
+
+    bool checkRunningState() const
+    {
+        return isPoolRunning_;
+    }; // Check the state of the poo
+
+private:
+    std::unordered_map<int, std::unique_ptr<Thread>> threads_; // Threads
+    std::vector<std::unique_ptr<Thread>> retiredThreads_;      // Threads of retired workers, not joined yet
+    size_t initThreadSize_;                                    // Thread Size
+    size_t maxThreadSize_;                                     // Max Thread Size
+    size_t minThreadSize_;                                     // Min Thread Size of the cached mode
+    bool minThreadSizeSet_;                                    // Set by setThreadMinSize(), else the start() size
+    std::atomic_int curThreadSize_;                            // current number of threads
+    std::atomic_int idleThreadSize_;                           // Number of idle threads
+
+    // Users may input temporary task which we need to consider the lifetime of the task
+    // so every Task owns its callable, its arguments and the promise of its result
+    std::vector<std::unique_ptr<QueueShard>> taskQues_; // Task Queue of every node, queueShards_ shards per node
+    std::atomic_int taskSize_;                          // Task Size, all nodes and shards (or rings) together
+    size_t maxTaskQueSize_;                             // Max Task Queue Size
+
+    std::mutex taskQueMtx_;           // Protects the threads, and the sleep of producers waiting for room in a ring
+    std::condition_variable notFull_; // Condition Variable to notify the producers that a ring is not full
+    std::condition_variable exitCv_;  // Condition Variable to notify the thread that the thread pool is exiting
+    std::condition_variable readyCv_; // Signaled as the initial workers finish setupWorker()
+    size_t readyWorkers_;             // Initial workers done with setupWorker(), protected by taskQueMtx_
+
+    // lock-free queue mode
+    std::vector<std::unique_ptr<MultiLevelRing<Task>>> ringQues_; // Rings used instead of taskQues_, maxTaskQueSize_ per level
+    std::atomic_int waitingProducers_;         // Producers blocked on notFull_ because the ring is full
+
+    // work stealing mode
+    std::vector<std::unique_ptr<WorkStealingDeque<Task *>>> deques_; // One deque per worker
+
+    // placement, fixed by start()
+    static constexpr size_t ANY_NODE = static_cast<size_t>(-1);
+    AffinityMode affinityMode_;
+    std::vector<int> cpuset_;         // CPUs of AFFINITY_CPUSET
+    std::vector<int> workerCpus_;     // CPU of every initial worker, -1 when it is not pinned
+    std::vector<size_t> workerNodes_; // Shared queue node of every initial worker
+    std::vector<size_t> nodeLeaders_; // First worker of every node, it allocates the queue of the node
+    std::vector<size_t> queueNodeOf_; // Topology node -> shared queue node
+    size_t queueNodes_;               // Shared queues, one per NUMA node the workers run on
+    size_t queueShards_;              // Shards of every locked shared queue, see start()
+
+    // parking, lock order: taskQueMtx_ -> idleMtx_ -> Worker::mtx, keeperMtx_ -> Worker::mtx
+    std::mutex idleMtx_;                // Protects idleWorkers_
+    std::vector<Worker *> idleWorkers_; // Parked workers, used as a stack
+    std::atomic_int parkedSize_;        // Size of idleWorkers_, readable without idleMtx_
+    std::atomic_int searching_;         // Workers unparked that have not found a task yet
+    std::atomic<uint64_t> parks_;            // Times a worker blocked, i.e. voluntary context switches
+    std::atomic<uint64_t> unparks_;          // Targeted wakeups
+    std::atomic<uint64_t> futileWakeups_;    // Wakeups that found no task
+    std::atomic<uint64_t> wakeLatencyNs_;    // Sum of the unpark -> running delays
+    std::atomic<uint64_t> maxWakeLatencyNs_; // Longest unpark -> running delay
+    std::atomic<uint64_t> spinHits_;         // Idle periods ended by spinning
+
+    // timers
+    TimerWheel timers_;     // Delayed and periodic tasks, collected by the workers
+    std::mutex keeperMtx_;  // Protects keeper_ and keeperDueNs_
+    Worker *keeper_;        // Parked worker that gets up for the next timer, if any
+    int64_t keeperDueNs_;   // When it gets up
+
+    int64_t spinTimeNs_;   // Spin window of the spinning idle modes, as set
+    int64_t spinWindowNs_; // The one this run uses, see start()
+
+    // cached mode sizing, see controlLoop()
+    int64_t threadIdleNs_;              // Underused time before the pool shrinks
+    int64_t growWaitNs_;                // Queue wait above which the pool grows
+    std::thread controller_;            // Runs controlLoop()
+    std::mutex controlMtx_;             // Protects the sleep of the controller
+    std::condition_variable controlCv_; // Wakes the controller on a backlog or when the pool stops
+    std::atomic_bool growKick_;         // Controller awake or being woken, cleared when it goes to sleep
+
+    // statistics
+    struct ExitedCounters
+    {
+        uint64_t tasks = 0;
+        uint64_t busyNs = 0;
+        uint64_t idleNs = 0;
+        Histogram waitTime;
+        Histogram execTime;
+    };
+    mutable std::mutex statsMtx_;          // Protects liveWorkers_ and exited_
+    std::vector<Worker *> liveWorkers_;    // Workers whose counters getStats() reads
+    ExitedCounters exited_;                // Counters of the workers that have exited
+    std::atomic<uint64_t> queueHighWater_; // Deepest queue seen after a push
+    std::atomic<uint64_t> rejected_;       // Submissions the full queue refused
+    std::atomic<uint64_t> evicted_;        // Queued tasks dropped to make room, REJECT_DISCARD_OLDEST
+    std::atomic<uint64_t> skipped_;        // Cancelled or expired tasks dropped when dequeued
+    std::atomic<uint64_t> unhandled_;      // Exceptions only reported on std::cerr, no handler was set
+
+    int64_t submitWaitNs_;        // How long a submission waits for room in a full queue
+    RejectPolicy rejectPolicy_;   // What happens to the tasks the full queue refuses
+    RejectHandler rejectHandler_; // Receives them with REJECT_CUSTOM
+
+    ExceptionHandler exceptionHandler_; // Called for exceptions escaping a task, see runTask()
 
-    std::mutex taskQueMtx_;            // Task Queue Mutex to protect the task queue
-    std::condition_variable notEmpty_; // Condition Variable to notify the thread that the task queue is not empty
-    std::condition_variable notFull_;  // Condition Variable to notify the thread that the task queue is not full
-    std::condition_variable exitCv_;   // Condition Variable to notify the thread that the thread pool is exiting
+    size_t priorityLevels_; // Levels of the task queues
+    unsigned agingRounds_;  // Pops a waiting level may be passed over before it is served
 
     PoolMode poolMode_;              // Pool Mode
+    QueueMode queueMode_;            // Shared queue backend
+    IdleMode idleMode_;              // What workers do when they run out of tasks
+    std::mutex shutdownMtx_;         // Serializes shutdown() calls
+    std::atomic_bool stopping_;      // shutdown() has begun: no growth, workers exit once out of tasks
     std::atomic_bool isPoolRunning_; // state of the pool running or not
 };
 
@@ -0,0 +1,364 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "slabpool.h"
+#include "task.h"
+
+const int64_t TIMER_TICK_NS = 1000000; // Timer resolution: 1 ms
+
+class TimerWheel;
+
+/*
+ * One delayed or periodic call
+ * Owned by the wheel while it is armed, by its TimerHandle and by every queued firing of it.
+ * */
+struct TimerNode
+{
+    TimerNode(TimerWheel *w, Task &&t, int64_t p)
+        : task(std::move(t)), wheel(w), expiry(0), period(p), prev(nullptr), next(nullptr),
+          level(-1), slot(0), refs(2), cancelled(false), running(false) {}
+
+    void release()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            SlabPool<TimerNode>::instance().destroy(this);
+    }
+
+    Task task;
+    TimerWheel *wheel;
+    int64_t expiry; // Tick the timer fires at, protected by the wheel mutex
+    int64_t period; // Ticks between two firings, 0 for a one-shot timer
+    TimerNode *prev;
+    TimerNode *next;
+    int level; // Wheel level of the slot holding the node, -1 when it is not armed
+    int slot;
+    std::atomic_int refs;
+    std::atomic_bool cancelled;
+    std::atomic_bool running; // A firing is queued or running, firings of a periodic timer never overlap
+};
+
+/*
+ * Task queued when a timer fires
+ * Runs the timer callable unless the timer was cancelled in the meantime.
+ * */
+class TimerFiring
+{
+public:
+    explicit TimerFiring(TimerNode *node) : node_(node) {}
+    TimerFiring(TimerFiring &&other) noexcept : node_(std::exchange(other.node_, nullptr)) {}
+    TimerFiring &operator=(TimerFiring &&) = delete;
+    TimerFiring(const TimerFiring &) = delete;
+
+    ~TimerFiring()
+    {
+        if (node_ != nullptr)
+        {
+            node_->running.store(false, std::memory_order_release);
+            node_->release();
+        }
+    }
+
+    void operator()()
+    {
+        if (!node_->cancelled.load(std::memory_order_acquire))
+            node_->task();
+    }
+
+private:
+    TimerNode *node_;
+};
+
+/*
+ * Hierarchical timing wheel, LEVELS wheels of SLOTS slots each
+ * Level 0 holds the timers due within SLOTS ticks, one tick per slot; every level above covers
+ * SLOTS times the range of the one below. Each slot is an intrusive list, so arming and
+ * cancelling a timer are O(1), and a slot of an upper level is moved down (cascaded) once per
+ * turn of the level below it. Timers further away than the whole wheel wait in the last level.
+ * A per-level bitmap of the non-empty slots lets advance() jump over empty ticks.
+ * */
+class TimerWheel
+{
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int64_t NEVER = std::numeric_limits<int64_t>::max();
+
+    explicit TimerWheel(int64_t nowNs) : now_(nowNs / TIMER_TICK_NS), size_(0), nextDueNs_(NEVER)
+    {
+        for (int level = 0; level < LEVELS; ++level)
+        {
+            occupied_[level] = 0;
+            for (int slot = 0; slot < SLOTS; ++slot)
+                slots_[level][slot] = nullptr;
+        }
+    }
+
+    ~TimerWheel() { clear(); }
+
+    // Disarm every timer, returns how many were armed. Their handles see them as cancelled.
+    size_t clear()
+    {
+        size_t cleared = 0;
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (int level = 0; level < LEVELS; ++level)
+        {
+            for (int slot = 0; slot < SLOTS; ++slot)
+            {
+                while (TimerNode *node = slots_[level][slot])
+                {
+                    node->cancelled.store(true, std::memory_order_release);
+                    unlink(node);
+                    node->release();
+                    ++cleared;
+                }
+            }
+        }
+        updateNextDue();
+        return cleared;
+    }
+
+    // Arm a timer due at dueNs (see nowNs()), then every periodNs if it is not 0.
+    // The node comes with one reference for the wheel and one for the caller's handle.
+    TimerNode *schedule(Task &&task, int64_t dueNs, int64_t periodNs)
+    {
+        int64_t period = periodNs > 0 ? std::max<int64_t>(1, (periodNs + TIMER_TICK_NS - 1) / TIMER_TICK_NS) : 0;
+        TimerNode *node = SlabPool<TimerNode>::instance().create(this, std::move(task), period);
+        std::lock_guard<std::mutex> lock(mtx_);
+        node->expiry = std::max(now_ + 1, (dueNs + TIMER_TICK_NS - 1) / TIMER_TICK_NS);
+        link(node);
+        updateNextDue();
+        return node;
+    }
+
+    // Disarm the timer, false if it was not armed any more (a one-shot timer that fired or a second cancel).
+    // A firing already queued does not run the callable either, one already running completes.
+    bool cancel(TimerNode *node)
+    {
+        node->cancelled.store(true, std::memory_order_release);
+        bool armed = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            armed = node->level >= 0;
+            if (armed)
+                unlink(node);
+        }
+        if (armed)
+            node->release();
+        return armed;
+    }
+
+    // Move the wheel up to nowNs and append one TimerFiring per expired timer to out.
+    // Returns false without doing anything when another thread is already at it.
+    bool collect(int64_t nowNs, std::vector<Task> &out)
+    {
+        std::unique_lock<std::mutex> lock(mtx_, std::try_to_lock);
+        if (!lock)
+            return false;
+        advance(nowNs / TIMER_TICK_NS, out);
+        updateNextDue();
+        return true;
+    }
+
+    // Armed timers, readable without the lock
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+    // No timer fires before this time, NEVER when none is armed. Readable without the lock.
+    int64_t nextDueNs() const { return nextDueNs_.load(std::memory_order_relaxed); }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+private:
+    void link(TimerNode *node)
+    {
+        // A timer beyond the range of the wheel sits in the last level until it comes closer
+        int64_t delta = std::min<int64_t>(node->expiry - now_, (int64_t(1) << (LEVELS * SLOT_BITS)) - 1);
+        int64_t tick = now_ + delta;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (int64_t(1) << ((level + 1) * SLOT_BITS)))
+            ++level;
+        int slot = static_cast<int>((tick >> (level * SLOT_BITS)) & (SLOTS - 1));
+
+        TimerNode *&head = slots_[level][slot];
+        node->level = level;
+        node->slot = slot;
+        node->prev = nullptr;
+        node->next = head;
+        if (head != nullptr)
+            head->prev = node;
+        head = node;
+        occupied_[level] |= uint64_t(1) << slot;
+        size_.store(size_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void unlink(TimerNode *node)
+    {
+        TimerNode *&head = slots_[node->level][node->slot];
+        if (node->prev != nullptr)
+            node->prev->next = node->next;
+        else
+            head = node->next;
+        if (node->next != nullptr)
+            node->next->prev = node->prev;
+        if (head == nullptr)
+            occupied_[node->level] &= ~(uint64_t(1) << node->slot);
+        node->level = -1;
+        size_.store(size_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+    // Detach the whole list of a slot
+    TimerNode *take(int level, int slot)
+    {
+        TimerNode *list = slots_[level][slot];
+        slots_[level][slot] = nullptr;
+        occupied_[level] &= ~(uint64_t(1) << slot);
+        for (TimerNode *node = list; node != nullptr; node = node->next)
+        {
+            node->level = -1;
+            size_.store(size_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        }
+        return list;
+    }
+
+    // Next tick worth stopping at: the next non-empty slot of level 0 in this turn, else the end of the turn
+    int64_t nextStop() const
+    {
+        int index = static_cast<int>(now_ & (SLOTS - 1));
+        uint64_t ahead = index == SLOTS - 1 ? 0 : occupied_[0] & (~uint64_t(0) << (index + 1));
+        if (ahead != 0)
+            return now_ - index + __builtin_ctzll(ahead);
+        return (now_ | (SLOTS - 1)) + 1;
+    }
+
+    void advance(int64_t target, std::vector<Task> &out)
+    {
+        while (now_ < target)
+        {
+            if (size_.load(std::memory_order_relaxed) == 0)
+            {
+                now_ = target;
+                return;
+            }
+            int64_t stop = nextStop();
+            if (stop > target)
+            {
+                now_ = target;
+                return;
+            }
+            now_ = stop;
+
+            // A turn of level 0 is over: move the next slot of every level whose turn is over too
+            if ((now_ & (SLOTS - 1)) == 0)
+            {
+                int top = 1;
+                while (top < LEVELS - 1 && ((now_ >> (top * SLOT_BITS)) & (SLOTS - 1)) == 0)
+                    ++top;
+                for (int level = top; level > 0; --level)
+                {
+                    TimerNode *node = take(level, static_cast<int>((now_ >> (level * SLOT_BITS)) & (SLOTS - 1)));
+                    while (node != nullptr)
+                    {
+                        TimerNode *next = node->next;
+                        link(node);
+                        node = next;
+                    }
+                }
+            }
+
+            TimerNode *node = take(0, static_cast<int>(now_ & (SLOTS - 1)));
+            while (node != nullptr)
+            {
+                TimerNode *next = node->next;
+                expire(node, out);
+                node = next;
+            }
+        }
+    }
+
+    void expire(TimerNode *node, std::vector<Task> &out)
+    {
+        if (node->period == 0)
+        {
+            // The reference of the wheel goes to the firing
+            node->running.store(true, std::memory_order_relaxed);
+            out.emplace_back(TimerFiring(node));
+            return;
+        }
+
+        // Fixed rate: the next firing keeps to the original schedule, periods missed while late are skipped
+        node->expiry += node->period;
+        if (node->expiry <= now_)
+            node->expiry += ((now_ - node->expiry) / node->period + 1) * node->period;
+        link(node);
+        // Still running the previous firing: skip this one rather than run the callable twice at once
+        if (!node->running.exchange(true, std::memory_order_acq_rel))
+        {
+            node->refs.fetch_add(1, std::memory_order_relaxed);
+            out.emplace_back(TimerFiring(node));
+        }
+    }
+
+    void updateNextDue()
+    {
+        nextDueNs_.store(size_.load(std::memory_order_relaxed) == 0 ? NEVER : nextStop() * TIMER_TICK_NS,
+                         std::memory_order_relaxed);
+    }
+
+private:
+    std::mutex mtx_; // Protects the slots, now_ and every armed node
+    TimerNode *slots_[LEVELS][SLOTS];
+    uint64_t occupied_[LEVELS]; // Bit s is set when slot s of the level is not empty
+    int64_t now_;               // Last tick processed, the timers due up to it have fired
+    std::atomic<size_t> size_;  // Armed timers, written under mtx_
+    std::atomic<int64_t> nextDueNs_;
+};
+
+/*
+ * Handle of an armed timer, returned by ThreadPool::scheduleAfter() and scheduleEvery()
+ * It only holds a reference: dropping it leaves the timer armed. cancel() must not be
+ * called after the pool that armed the timer is destroyed.
+ * */
+class TimerHandle
+{
+public:
+    TimerHandle() : node_(nullptr) {}
+    explicit TimerHandle(TimerNode *node) : node_(node) {}
+    TimerHandle(TimerHandle &&other) noexcept : node_(std::exchange(other.node_, nullptr)) {}
+    TimerHandle &operator=(TimerHandle &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (node_ != nullptr)
+                node_->release();
+            node_ = std::exchange(other.node_, nullptr);
+        }
+        return *this;
+    }
+    TimerHandle(const TimerHandle &) = delete;
+    TimerHandle &operator=(const TimerHandle &) = delete;
+
+    ~TimerHandle()
+    {
+        if (node_ != nullptr)
+            node_->release();
+    }
+
+    bool valid() const { return node_ != nullptr; }
+
+    // Stop the timer, false if it had already fired (one-shot) or was cancelled
+    bool cancel() { return node_ != nullptr && node_->wheel->cancel(node_); }
+
+private:
+    TimerNode *node_;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Chase-Lev work-stealing deque
+ * The owner thread pushes and pops at the bottom (LIFO), other threads steal from the top (FIFO).
+ * Memory orderings follow Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+ * T must be trivially copyable (the pool stores task pointers).
+ * */
+template <typename T>
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(size_t capacity = 1024)
+        : top_(0), bottom_(0), array_(new Array(roundUp(capacity)))
+    {
+    }
+
+    ~WorkStealingDeque()
+    {
+        for (Array *a : garbage_)
+            delete a;
+        delete array_.load(std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    // Owner only: push the item at the bottom, growing the buffer when it is full
+    void push(T item)
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array *a = array_.load(std::memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(a->capacity) - 1)
+        {
+            a = grow(a, b, t);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only: pop the most recently pushed item
+    bool pop(T &item)
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array *a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            // The deque was empty, restore the bottom
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = a->get(b);
+        if (t == b)
+        {
+            // Last item, race against the thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread: steal the oldest item
+    bool steal(T &item)
+    {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+
+        Array *a = array_.load(std::memory_order_acquire);
+        item = a->get(t);
+        return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed);
+    }
+
+    // Approximate number of items, exact only when called by the owner with no concurrent thieves
+    size_t size() const
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    // Circular buffer, the capacity is always a power of two
+    struct Array
+    {
+        explicit Array(size_t cap) : capacity(cap), mask(cap - 1), buffer(new std::atomic<T>[cap]) {}
+        ~Array() { delete[] buffer; }
+
+        void put(int64_t i, T item) { buffer[i & mask].store(item, std::memory_order_relaxed); }
+        T get(int64_t i) const { return buffer[i & mask].load(std::memory_order_relaxed); }
+
+        size_t capacity;
+        size_t mask;
+        std::atomic<T> *buffer;
+    };
+
+    Array *grow(Array *old, int64_t b, int64_t t)
+    {
+        Array *a = new Array(old->capacity * 2);
+        for (int64_t i = t; i < b; ++i)
+            a->put(i, old->get(i));
+        // Thieves may still read from the old buffer, so it is retired instead of freed
+        garbage_.push_back(old);
+        array_.store(a, std::memory_order_release);
+        return a;
+    }
+
+    static size_t roundUp(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> top_;    // Steal end, shared by thieves
+    alignas(64) std::atomic<int64_t> bottom_; // Owner end
+    std::atomic<Array *> array_;              // Current buffer
+    std::vector<Array *> garbage_;            // Buffers retired by grow(), freed on destruction
+};
+
+#endif
\ No newline at end of file
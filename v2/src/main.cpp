@@ -23,8 +23,12 @@ int main()
     pool.start(4);
 
     auto res1 = pool.submitTask(sum1, 10, 20);
-    std::future<int> res2 = pool.submitTask([](int a, int b) -> int
+    Future<int> res2 = pool.submitTask([](int a, int b) -> int
                                             { return a - b; }, 30, 10);
     std::cout << "Result: " << res1.get() << ", " << res2.get() << std::endl;
+
+    PoolStats stats = pool.getStats();
+    std::cout << "Tasks: " << stats.tasks << ", queue wait p99: " << stats.waitTime.percentile(0.99)
+              << " ns, exec p99: " << stats.execTime.percentile(0.99) << " ns" << std::endl;
     return 0;
 }
\ No newline at end of file
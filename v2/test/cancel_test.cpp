@@ -0,0 +1,149 @@
+/*
+ * Cancellation: a cancelled or expired task is skipped when dequeued and counted, a running task
+ * runs on, and a dropped CancellableFuture cancels its task
+ * Build: g++ -std=c++17 -O2 -pthread -I../include cancel_test.cpp -o cancel_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <utility>
+#include "../include/threadpool.h"
+#include "check.h"
+#include "gate.h"
+
+template <typename T>
+static bool isCancelled(Future<T> &future)
+{
+    try
+    {
+        future.get();
+    }
+    catch (const TaskCancelledError &)
+    {
+        return true;
+    }
+    return false;
+}
+
+// Cancelled while queued behind the gate: dropped unrun by the worker that dequeues it
+static void checkCancelQueued(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(1);
+    std::atomic_int ran(0);
+    CancellationSource source;
+    Gate gate(pool);
+    Future<int> cancelled = pool.submitTask(source.token(), [&ran]()
+                                            { ++ran;
+                                              return 1; });
+    Future<int> kept = pool.submitTask(CancellationToken(), [&ran]()
+                                       { ++ran;
+                                         return 2; });
+    CHECK(source.cancel());
+    CHECK(!source.cancel());
+    gate.open();
+    CHECK(isCancelled(cancelled));
+    CHECK(kept.get() == 2);
+    CHECK(ran == 1);
+    CHECK(pool.getStats().skipped == 1);
+}
+
+// Its deadline passes while it is queued: skipped and counted like a cancelled task
+static void checkDeadline(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(1);
+    std::atomic_int ran(0);
+    Gate gate(pool);
+    auto now = std::chrono::steady_clock::now();
+    Future<int> expired = pool.submitBefore(now + std::chrono::milliseconds(10), [&ran]()
+                                            { ++ran;
+                                              return 1; });
+    Future<int> inTime = pool.submitBefore(now + std::chrono::seconds(60), [&ran]()
+                                           { ++ran;
+                                             return 2; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    gate.open();
+    CHECK(isCancelled(expired));
+    CHECK(inTime.get() == 2);
+    CHECK(ran == 1);
+    CHECK(pool.getStats().skipped == 1);
+}
+
+// Cancelling a task that has started does not stop it: it sees the token and finishes its way
+static void checkRunning(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(2);
+    CancellationSource source;
+    std::atomic_bool started(false);
+    CancellationToken token = source.token();
+    Future<int> running = pool.submitTask(token, [&started, token]()
+                                          {
+                                              started = true;
+                                              while (!token.isCancelled())
+                                                  std::this_thread::yield();
+                                              return 7; });
+    while (!started)
+        std::this_thread::yield();
+    CHECK(source.cancel());
+    CHECK(running.get() == 7);
+    CHECK(pool.getStats().skipped == 0);
+}
+
+// A moved-from source has nothing to cancel, the moved-to one cancels the tokens of both
+static void checkMove()
+{
+    CancellationSource source;
+    CancellationToken token = source.token();
+    CancellationSource moved(std::move(source));
+    CHECK(!source.cancel());
+    CHECK(!source.isCancelled());
+    CHECK(!source.token().valid());
+    CHECK(moved.cancel());
+    CHECK(token.isCancelled());
+    CHECK(moved.isCancelled());
+}
+
+// Dropping the handle of a queued task cancels it, detaching keeps it
+static void checkCancellableFuture(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(1);
+    std::atomic_int ran(0);
+    Gate gate(pool);
+    {
+        CancellableFuture<void> dropped = pool.submitCancellable([&ran]()
+                                                                 { ++ran; });
+        CancellableFuture<void> handle(std::move(dropped));
+    }
+    CancellableFuture<int> kept = pool.submitCancellable([&ran]()
+                                                         { ++ran;
+                                                           return 3; });
+    Future<int> detached = kept.detach();
+    gate.open();
+    CHECK(detached.get() == 3);
+    CHECK(pool.shutdown() == 0);
+    CHECK(ran == 1);
+    CHECK(pool.getStats().skipped == 1);
+}
+
+int main()
+{
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    for (PoolMode mode : modes)
+    {
+        checkCancelQueued(mode);
+        checkDeadline(mode);
+        checkRunning(mode);
+        checkCancellableFuture(mode);
+    }
+    checkMove();
+    std::printf("ok\n");
+    return 0;
+}
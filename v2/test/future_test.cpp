@@ -0,0 +1,213 @@
+/*
+ * Future combinators and TaskGraph: exceptions go through then(), when_all() keeps the input order,
+ * when_any() takes the first result, and a graph runs every node after its dependencies or
+ * rejects a cycle
+ * Build: g++ -std=c++17 -O2 -pthread -I../include future_test.cpp -o future_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../include/taskgraph.h"
+#include "check.h"
+
+static void checkThen(ThreadPool &pool)
+{
+    CHECK(pool.submitTask([]()
+                          { return 2; })
+              .then([](int x)
+                    { return x * 3; })
+              .then([](int x)
+                    { return std::to_string(x); })
+              .get() == "6");
+
+    // A failed future skips the continuations, the exception reaches the end of the chain
+    std::atomic_int called(0);
+    Future<int> failed = pool.submitTask([]() -> int
+                                         { throw std::runtime_error("task"); })
+                             .then([&called](int x)
+                                   { ++called;
+                                     return x + 1; })
+                             .then([&called](int x)
+                                   { ++called;
+                                     return x + 1; });
+    std::string what;
+    try
+    {
+        failed.get();
+    }
+    catch (const std::runtime_error &e)
+    {
+        what = e.what();
+    }
+    CHECK(what == "task");
+    CHECK(called == 0);
+
+    // So does one thrown by a continuation
+    Future<int> thrown = pool.submitTask([]()
+                                         { return 1; })
+                             .then([](int) -> int
+                                   { throw std::logic_error("continuation"); })
+                             .then([&called](int x)
+                                   { ++called;
+                                     return x; });
+    what.clear();
+    try
+    {
+        thrown.get();
+    }
+    catch (const std::logic_error &e)
+    {
+        what = e.what();
+    }
+    CHECK(what == "continuation");
+    CHECK(called == 0);
+}
+
+static void checkWhenAll(ThreadPool &pool)
+{
+    // Completed in the reverse order of the inputs
+    std::vector<Future<int>> futures;
+    for (int i = 0; i < 4; ++i)
+        futures.push_back(pool.submitTask([i]()
+                                          { std::this_thread::sleep_for(std::chrono::milliseconds(10 * (4 - i)));
+                                            return i; }));
+    std::vector<int> values = when_all(std::move(futures)).get();
+    CHECK(values.size() == 4);
+    for (int i = 0; i < 4; ++i)
+        CHECK(values[i] == i);
+}
+
+static void checkWhenAny(ThreadPool &pool)
+{
+    // The slow ones only finish once the combined future is ready, the last input wins
+    std::atomic_bool release(false);
+    std::vector<Future<int>> futures;
+    for (int i = 0; i < 3; ++i)
+        futures.push_back(pool.submitTask([&release, i]()
+                                          {
+                                              while (!release)
+                                                  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                                              return i; }));
+    futures.push_back(pool.submitTask([]()
+                                      { return 42; }));
+    std::pair<size_t, int> first = when_any(std::move(futures)).get();
+    release = true;
+    CHECK(first.first == 3);
+    CHECK(first.second == 42);
+}
+
+static void checkCycle(ThreadPool &pool)
+{
+    TaskGraph graph;
+    std::atomic_int ran(0);
+    TaskGraph::Node a = graph.emplace([&ran]()
+                                      { ++ran; });
+    TaskGraph::Node b = graph.emplace([&ran]()
+                                      { ++ran; });
+    TaskGraph::Node c = graph.emplace([&ran]()
+                                      { ++ran; });
+    graph.precede(a, b);
+    graph.precede(b, c);
+    graph.precede(c, b);
+    bool rejected = false;
+    try
+    {
+        graph.run(pool);
+    }
+    catch (const std::invalid_argument &)
+    {
+        rejected = true;
+    }
+    CHECK(rejected);
+    CHECK(ran == 0);
+}
+
+// A random DAG, edges only go from lower to higher node numbers: every node must see all its
+// predecessors finished when it starts
+static void checkOrder(ThreadPool &pool)
+{
+    const size_t NODES = 200;
+    TaskGraph graph;
+    std::vector<std::atomic_int> done(NODES);
+    std::vector<std::vector<size_t>> preds(NODES);
+    std::atomic_int misordered(0);
+    std::mt19937 rng(7);
+    for (size_t i = 0; i < NODES; ++i)
+    {
+        for (size_t j = 0; j < i; ++j)
+        {
+            if (rng() % 20 == 0)
+                preds[i].push_back(j);
+        }
+    }
+    for (size_t i = 0; i < NODES; ++i)
+        graph.emplace([&done, &preds, &misordered, i]()
+                      {
+                          for (size_t p : preds[i])
+                          {
+                              if (done[p] != done[i] + 1)
+                                  ++misordered;
+                          }
+                          ++done[i]; });
+    for (size_t i = 0; i < NODES; ++i)
+    {
+        for (size_t p : preds[i])
+            graph.precede(p, i);
+    }
+    // The graph can be run again once a run is over
+    for (int run = 1; run <= 3; ++run)
+    {
+        graph.run(pool).get();
+        for (size_t i = 0; i < NODES; ++i)
+            CHECK(done[i] == run);
+    }
+    CHECK(misordered == 0);
+}
+
+// A node that throws: the nodes after it are skipped and the run's future rethrows
+static void checkGraphError(ThreadPool &pool)
+{
+    TaskGraph graph;
+    std::atomic_int ran(0);
+    TaskGraph::Node first = graph.emplace([]()
+                                          { throw std::runtime_error("node"); });
+    TaskGraph::Node second = graph.emplace([&ran]()
+                                           { ++ran; });
+    graph.precede(first, second);
+    std::string what;
+    try
+    {
+        graph.run(pool).get();
+    }
+    catch (const std::runtime_error &e)
+    {
+        what = e.what();
+    }
+    CHECK(what == "node");
+    CHECK(ran == 0);
+}
+
+int main()
+{
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    for (PoolMode mode : modes)
+    {
+        ThreadPool pool;
+        pool.setMode(mode);
+        pool.start(4);
+        checkThen(pool);
+        checkWhenAll(pool);
+        checkWhenAny(pool);
+        checkCycle(pool);
+        checkOrder(pool);
+        checkGraphError(pool);
+    }
+    std::printf("ok\n");
+    return 0;
+}
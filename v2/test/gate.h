@@ -0,0 +1,31 @@
+#ifndef GATE_H
+#define GATE_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../include/threadpool.h"
+
+// Keeps the single worker busy until open() is called, so that the next tasks stay queued
+class Gate
+{
+public:
+    Gate(ThreadPool &pool) : started_(false), open_(false)
+    {
+        pool.post([this]()
+                  {
+                      started_ = true;
+                      while (!open_)
+                          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                  });
+        while (!started_)
+            std::this_thread::yield();
+    }
+    void open() { open_ = true; }
+
+private:
+    std::atomic_bool started_;
+    std::atomic_bool open_;
+};
+
+#endif
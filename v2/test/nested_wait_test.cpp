@@ -0,0 +1,97 @@
+/*
+ * Recursive tasks that wait for their subtasks on the worker must finish on a small fixed pool,
+ * whatever the queue fills up with: a worker never waits for room in the queue. Same for tasks that
+ * wait for a batch of subtasks.
+ * Build: g++ -std=c++17 -O2 -pthread -I../include nested_wait_test.cpp -o nested_wait_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include "../include/threadpool.h"
+#include "check.h"
+
+static int fibSerial(int n)
+{
+    return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+// Each call submits both halves and waits for them, as a naive divide and conquer would
+static int fib(ThreadPool &pool, int n)
+{
+    if (n < 2)
+        return n;
+    Future<int> a = pool.submitTask([&pool, n]()
+                                    { return fib(pool, n - 1); });
+    Future<int> b = pool.submitTask([&pool, n]()
+                                    { return fib(pool, n - 2); });
+    return a.get() + b.get();
+}
+
+// Each call queues its children as one batch and waits for the batch
+static void tree(ThreadPool &pool, std::atomic_int &leaves, int depth)
+{
+    if (depth == 0)
+    {
+        ++leaves;
+        return;
+    }
+    TaskBatch batch = pool.submitBulk(4, [&pool, &leaves, depth](size_t)
+                                      { tree(pool, leaves, depth - 1); });
+    batch.wait();
+}
+
+static void checkTree(PoolMode mode, QueueMode queueMode, int threads, int depth)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.setQueueMode(queueMode);
+    pool.start(threads);
+    std::atomic_int leaves(0);
+    auto begin = std::chrono::steady_clock::now();
+    pool.submitTask([&pool, &leaves, depth]()
+                    { tree(pool, leaves, depth); })
+        .get();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::printf("mode %d queue %d threads %d batch tree depth %d: %d leaves in %.1f ms\n", static_cast<int>(mode),
+                static_cast<int>(queueMode), threads, depth, leaves.load(), ms);
+    CHECK(leaves == 1 << (2 * depth));
+    CHECK(pool.getStats().rejected == 0);
+    CHECK(ms < SUBMIT_WAIT_MS);
+}
+
+static void checkFib(PoolMode mode, QueueMode queueMode, int threads, int depth)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.setQueueMode(queueMode);
+    pool.start(threads);
+    auto begin = std::chrono::steady_clock::now();
+    int value = pool.submitTask([&pool, depth]()
+                                { return fib(pool, depth); })
+                    .get();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::printf("mode %d queue %d threads %d fib(%d) = %d in %.1f ms, rejected %llu\n", static_cast<int>(mode),
+                static_cast<int>(queueMode), threads, depth, value, ms,
+                static_cast<unsigned long long>(pool.getStats().rejected));
+    CHECK(value == fibSerial(depth));
+    CHECK(pool.getStats().rejected == 0);
+    // The queue filling up must not stall anyone for the submit timeout
+    CHECK(ms < SUBMIT_WAIT_MS);
+}
+
+int main()
+{
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    const QueueMode queueModes[] = {QueueMode::QUEUE_LOCKED, QueueMode::QUEUE_LOCK_FREE};
+    for (PoolMode mode : modes)
+    {
+        for (QueueMode queueMode : queueModes)
+        {
+            checkFib(mode, queueMode, 2, 20);
+            checkFib(mode, queueMode, 4, 20);
+            checkTree(mode, queueMode, 2, 6);
+        }
+    }
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * shutdown() modes: what runs, what is dropped and reported, and a restart of the stopped pool
+ * Build: g++ -std=c++17 -O2 -pthread -I../include shutdown_test.cpp -o shutdown_test
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+#include "check.h"
+#include "gate.h"
+
+const int QUEUED = 10;
+
+// Queue QUEUED tasks behind a gate on a one-thread pool, stop it with stop(), check what ran
+template <typename Stop>
+static void checkStop(PoolMode mode, bool drains, Stop &&stop)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(1);
+    std::atomic_int ran(0);
+    Gate gate(pool);
+    std::vector<Future<int>> results;
+    for (int i = 0; i < QUEUED; ++i)
+        results.push_back(pool.submitTask([&ran, i]()
+                                          { ++ran;
+                                            return i; }));
+    // Armed, never fired: always dropped
+    TimerHandle timer = pool.scheduleAfter(std::chrono::seconds(60), [&ran]()
+                                           { ++ran; });
+
+    std::thread opener([&gate]()
+                       {
+                           std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                           gate.open(); });
+    size_t dropped = stop(pool);
+    opener.join();
+
+    CHECK(dropped == (drains ? 0u : static_cast<size_t>(QUEUED)) + 1);
+    CHECK(ran == (drains ? QUEUED : 0));
+    CHECK(pool.getThreadSize() == 0);
+    for (int i = 0; i < QUEUED; ++i)
+    {
+        if (drains)
+        {
+            CHECK(results[i].get() == i);
+            continue;
+        }
+        bool broken = false;
+        try
+        {
+            results[i].get();
+        }
+        catch (const std::future_error &e)
+        {
+            broken = e.code() == std::future_errc::broken_promise;
+        }
+        CHECK(broken);
+    }
+    // Stopped already
+    CHECK(pool.shutdown() == 0);
+}
+
+static void checkRestart(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(2);
+    CHECK(pool.submitTask([]()
+                          { return 1; })
+              .get() == 1);
+    std::atomic_int fired(0);
+    TimerHandle timer = pool.scheduleAfter(std::chrono::milliseconds(100), [&fired]()
+                                           { ++fired; });
+    CHECK(pool.shutdown() == 1);
+
+    for (int run = 0; run < 3; ++run)
+    {
+        pool.start(3 + run);
+        CHECK(pool.getThreadSize() == static_cast<size_t>(3 + run));
+        // Every worker has to be back in business: more nested waits than workers
+        std::vector<Future<int>> results;
+        for (int i = 0; i < 64; ++i)
+            results.push_back(pool.submitTask([&pool, i]()
+                                              { return pool.submitTask([i]()
+                                                                       { return i; })
+                                                    .get(); }));
+        for (int i = 0; i < 64; ++i)
+            CHECK(results[i].get() == i);
+        std::atomic_int posted(0);
+        for (int i = 0; i < 100; ++i)
+            CHECK(pool.post([&posted]()
+                            { ++posted; }));
+        CHECK(pool.shutdown(ShutdownMode::SHUTDOWN_DRAIN) == 0);
+        CHECK(posted == 100);
+        CHECK(pool.getThreadSize() == 0);
+    }
+    // The timer of the first run was dropped with it, it does not come back with a restart
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    CHECK(fired == 0);
+}
+
+// cached mode: without setThreadMinSize(), the floor of a run is the size that run started with
+static void checkRestartMinSize()
+{
+    ThreadPool pool;
+    pool.setMode(PoolMode::MODE_CACHED);
+    pool.setThreadIdleTime(std::chrono::milliseconds(50));
+    pool.start(4);
+    CHECK(pool.shutdown() == 0);
+
+    pool.start(2);
+    std::vector<Future<int>> results;
+    for (int i = 0; i < 32; ++i)
+        results.push_back(pool.submitTask([i]()
+                                          { std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                                            return i; }));
+    size_t peak = 0;
+    for (int i = 0; i < 32; ++i)
+    {
+        peak = std::max(peak, pool.getThreadSize());
+        CHECK(results[i].get() == i);
+    }
+    CHECK(peak > 2);
+    // Idle: back down to 2, not to the 4 of the first run
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (pool.getThreadSize() > 2 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(pool.getThreadSize() == 2);
+    pool.shutdown();
+}
+
+int main()
+{
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    for (PoolMode mode : modes)
+    {
+        checkStop(mode, true, [](ThreadPool &pool)
+                  { return pool.shutdown(ShutdownMode::SHUTDOWN_DRAIN); });
+        checkStop(mode, false, [](ThreadPool &pool)
+                  { return pool.shutdown(ShutdownMode::SHUTDOWN_DISCARD); });
+        // The gate opens after the timeout: nothing queued gets to run
+        checkStop(mode, false, [](ThreadPool &pool)
+                  { return pool.shutdownFor(std::chrono::milliseconds(10)); });
+        checkRestart(mode);
+    }
+    checkRestartMinSize();
+    std::printf("ok\n");
+    return 0;
+}
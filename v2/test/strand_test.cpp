@@ -0,0 +1,133 @@
+/*
+ * Strand: tasks of one strand run in the order posted and never two at a time, and a strand whose
+ * queued turn was dropped by a discarding shutdown takes posts again after a restart
+ * Build: g++ -std=c++17 -O2 -pthread -I../include strand_test.cpp -o strand_test
+ * */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+#include "../include/strand.h"
+#include "check.h"
+#include "gate.h"
+
+const int STRANDS = 8;
+const int POSTS = 20000; // Per strand, well over STRAND_BATCH so that every drain requeues
+const int QUEUED = 10;
+
+struct Checked
+{
+    Checked() : next(0), running(0), overlaps(0), misordered(0) {}
+
+    int next; // Only touched by the strand's tasks: a race here would be a strand bug
+    std::atomic_int running;
+    std::atomic_int overlaps;
+    std::atomic_int misordered;
+};
+
+// One poster thread per strand, all strands at once on a pool with more workers than one
+static void checkOrder(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(4);
+    std::vector<Strand> strands;
+    for (int s = 0; s < STRANDS; ++s)
+        strands.emplace_back(pool);
+    std::vector<Checked> checked(STRANDS);
+
+    std::vector<std::thread> posters;
+    for (int s = 0; s < STRANDS; ++s)
+        posters.emplace_back([&strands, &checked, s]()
+                             {
+                                 Strand &strand = strands[s];
+                                 Checked &c = checked[s];
+                                 for (int i = 0; i < POSTS; ++i)
+                                     strand.post([&strand, &c, i]()
+                                                 {
+                                                     if (c.running.fetch_add(1) != 0)
+                                                         ++c.overlaps;
+                                                     if (c.next != i || !strand.runningInThisThread())
+                                                         ++c.misordered;
+                                                     c.next = i + 1;
+                                                     c.running.fetch_sub(1);
+                                                 }); });
+    for (std::thread &poster : posters)
+        poster.join();
+    // A strand's last task runs after all the ones posted before it
+    for (int s = 0; s < STRANDS; ++s)
+        CHECK(strands[s].submit([&checked, s]()
+                                { return checked[s].next; })
+                  .get() == POSTS);
+    for (int s = 0; s < STRANDS; ++s)
+    {
+        CHECK(checked[s].overlaps == 0);
+        CHECK(checked[s].misordered == 0);
+        CHECK(!strands[s].runningInThisThread());
+    }
+    pool.shutdown();
+}
+
+// The strand's drain is queued behind a gate when the pool drops it: its tasks break, and the
+// strand must not stay convinced that a drain is still on its way
+static void checkDiscard(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(1);
+    Strand strand(pool);
+    std::atomic_int ran(0);
+    Gate gate(pool);
+    std::vector<Future<int>> results;
+    for (int i = 0; i < QUEUED; ++i)
+        results.push_back(strand.submit([&ran, i]()
+                                        { ++ran;
+                                          return i; }));
+
+    std::thread opener([&gate]()
+                       {
+                           std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                           gate.open(); });
+    // The one drain is all the pool sees of the strand
+    CHECK(pool.shutdown(ShutdownMode::SHUTDOWN_DISCARD) == 1);
+    opener.join();
+    CHECK(ran == 0);
+    for (int i = 0; i < QUEUED; ++i)
+    {
+        bool broken = false;
+        try
+        {
+            results[i].get();
+        }
+        catch (const std::future_error &e)
+        {
+            broken = e.code() == std::future_errc::broken_promise;
+        }
+        CHECK(broken);
+    }
+
+    pool.start(2);
+    std::vector<Future<int>> again;
+    for (int i = 0; i < QUEUED; ++i)
+        again.push_back(strand.submit([&ran, i]()
+                                      { ++ran;
+                                        return i; }));
+    for (int i = 0; i < QUEUED; ++i)
+        CHECK(again[i].get() == i);
+    CHECK(ran == QUEUED);
+    pool.shutdown();
+}
+
+int main()
+{
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    for (PoolMode mode : modes)
+    {
+        checkOrder(mode);
+        checkDiscard(mode);
+    }
+    std::printf("ok\n");
+    return 0;
+}
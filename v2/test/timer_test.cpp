@@ -0,0 +1,139 @@
+/*
+ * Timers: the wheel fires every timer on its own tick across the level boundaries, cancel() before
+ * the due time keeps it from running, and shutdown() reports the timers it drops
+ * Build: g++ -std=c++17 -O2 -pthread -I../include timer_test.cpp -o timer_test
+ * */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "../include/threadpool.h"
+#include "check.h"
+
+// Due ticks on both sides of the first and second cascades (64 and 64 * 64 ticks)
+const int64_t DUE_TICKS[] = {1, 2, 62, 63, 64, 65, 100, 127, 128, 129, 1000, 4095, 4096, 4097, 4160, 5000, 70000};
+
+// Driven tick by tick, without a pool: each timer fires exactly on its tick
+static void checkCascade()
+{
+    TimerWheel wheel(0);
+    std::vector<int64_t> fired;
+    std::vector<TimerHandle> handles;
+    // Armed out of order, so the order they fire in comes from the wheel alone
+    for (size_t i = std::size(DUE_TICKS); i-- > 0;)
+    {
+        int64_t due = DUE_TICKS[i];
+        handles.emplace_back(wheel.schedule([&fired, due]()
+                                            { fired.push_back(due); },
+                                            due * TIMER_TICK_NS, 0));
+    }
+    CHECK(wheel.size() == std::size(DUE_TICKS));
+
+    std::vector<Task> out;
+    for (int64_t tick = 1; tick <= 70000; ++tick)
+    {
+        CHECK(wheel.collect(tick * TIMER_TICK_NS, out));
+        for (Task &task : out)
+            task();
+        // Whatever fired at this tick was due at this tick
+        for (size_t i = fired.size() - out.size(); i < fired.size(); ++i)
+            CHECK(fired[i] == tick);
+        out.clear();
+    }
+    CHECK(fired.size() == std::size(DUE_TICKS));
+    CHECK(std::is_sorted(fired.begin(), fired.end()));
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.nextDueNs() == TimerWheel::NEVER);
+}
+
+// One collect far ahead: everything due by then fires, in the order of the due ticks
+static void checkJump()
+{
+    TimerWheel wheel(0);
+    std::vector<int64_t> fired;
+    std::vector<TimerHandle> handles;
+    for (size_t i = std::size(DUE_TICKS); i-- > 0;)
+    {
+        int64_t due = DUE_TICKS[i];
+        handles.emplace_back(wheel.schedule([&fired, due]()
+                                            { fired.push_back(due); },
+                                            due * TIMER_TICK_NS, 0));
+    }
+    std::vector<Task> out;
+    CHECK(wheel.collect(5000 * TIMER_TICK_NS, out));
+    for (Task &task : out)
+        task();
+    CHECK(fired.size() == std::size(DUE_TICKS) - 1);
+    CHECK(std::is_sorted(fired.begin(), fired.end()));
+    // The one left is not due before its tick
+    CHECK(wheel.size() == 1);
+    CHECK(wheel.nextDueNs() <= 70000 * TIMER_TICK_NS);
+}
+
+// Cancelled before it is due: never runs. After firing a one-shot timer has nothing to cancel.
+static void checkCancel(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(2);
+    std::atomic_int cancelledRan(0), firedRan(0);
+    TimerHandle cancelled = pool.scheduleAfter(std::chrono::milliseconds(30), [&cancelledRan]()
+                                               { ++cancelledRan; });
+    TimerHandle fired = pool.scheduleAfter(std::chrono::milliseconds(10), [&firedRan]()
+                                           { ++firedRan; });
+    CHECK(cancelled.cancel());
+    CHECK(!cancelled.cancel());
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (firedRan == 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(firedRan == 1);
+    CHECK(!fired.cancel());
+    // Well past the due time of the cancelled one
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    CHECK(cancelledRan == 0);
+    CHECK(pool.shutdown() == 0);
+}
+
+// shutdown() counts the armed timers, one-shot and periodic, not the cancelled or fired ones
+static void checkDropped(PoolMode mode)
+{
+    ThreadPool pool;
+    pool.setMode(mode);
+    pool.start(2);
+    std::atomic_int ran(0);
+    std::vector<TimerHandle> armed;
+    for (int i = 0; i < 3; ++i)
+        armed.push_back(pool.scheduleAfter(std::chrono::seconds(60 + i), [&ran]()
+                                           { ++ran; }));
+    // Beyond the 64^4 ticks the wheel covers
+    armed.push_back(pool.scheduleAfter(std::chrono::hours(24 * 30), [&ran]()
+                                       { ++ran; }));
+    armed.push_back(pool.scheduleEvery(std::chrono::seconds(60), [&ran]()
+                                       { ++ran; }));
+    TimerHandle cancelled = pool.scheduleAfter(std::chrono::seconds(60), [&ran]()
+                                               { ++ran; });
+    CHECK(cancelled.cancel());
+    CHECK(pool.shutdown() == armed.size());
+    CHECK(ran == 0);
+    // Disarmed by the shutdown: nothing left to cancel
+    for (TimerHandle &handle : armed)
+        CHECK(!handle.cancel());
+}
+
+int main()
+{
+    checkCascade();
+    checkJump();
+    const PoolMode modes[] = {PoolMode::MODE_FIXED, PoolMode::MODE_CACHED, PoolMode::MODE_WORK_STEALING};
+    for (PoolMode mode : modes)
+    {
+        checkCancel(mode);
+        checkDropped(mode);
+    }
+    std::printf("ok\n");
+    return 0;
+}